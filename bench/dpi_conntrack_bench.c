@@ -0,0 +1,255 @@
+/*
+ * Микротесты dpi_conntrack: модуль выполняет тест, выбранный параметром
+ * test, при загрузке и выводит результат в журнал ядра.
+ *
+ * lookup - поиск по одному (nf_conntrack_find_get() с чтением helper и
+ *          метаданных, как это делал бы обработчик пакетов) против
+ *          dpi_conntrack_lookup_batch() на одном и том же наборе кортежей,
+ *          взятых из таблицы conntrack init_net (в случайном порядке).
+ *
+ * insmod dpi_conntrack_bench.ko test=lookup tuples=262144 burst=32
+ * dmesg | grep dpi_conntrack_bench
+ * rmmod dpi_conntrack_bench
+ */
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <linux/random.h>
+#include <linux/sched.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+
+#include <net/net_namespace.h>
+#include <net/netfilter/nf_conntrack.h>
+#include <net/netfilter/nf_conntrack_core.h>
+#include <net/netfilter/nf_conntrack_helper.h>
+#include <net/netfilter/nf_conntrack_zones.h>
+
+#include "../include/dpi_conntrack.h"
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Igor V. Nikolaev <monster@vedga.com>");
+MODULE_DESCRIPTION("DPI connection tracking support module benchmarks");
+
+/* Предварительное объявление локальных функций */
+static int __init bench_startup(void);
+static void bench_cleanup(void);
+static int bench_lookup(void);
+static int bench_collect(struct nf_conn *ct, void *data);
+static unsigned int bench_find_get(struct net *net, struct dpi_conntrack_lookup *l, unsigned int nr);
+static unsigned int bench_batch(struct net *net, struct dpi_conntrack_lookup *l, unsigned int nr);
+
+static char *test = "lookup";
+module_param(test, charp, 0444);
+MODULE_PARM_DESC(test, "Benchmark run at load: lookup");
+
+static unsigned int tuples = 65536;
+module_param(tuples, uint, 0444);
+MODULE_PARM_DESC(tuples, "Max conntrack tuples taken from the table (lookup)");
+
+static unsigned int burst = 32;
+module_param(burst, uint, 0444);
+MODULE_PARM_DESC(burst, "Tuples per dpi_conntrack_lookup_batch() call (lookup)");
+
+static unsigned int rounds = 10;
+module_param(rounds, uint, 0444);
+MODULE_PARM_DESC(rounds, "Passes over the tuple set");
+
+/* Определение точек входа при загрузке и выгрузке модуля */
+module_init(bench_startup);
+module_exit(bench_cleanup);
+
+/* Набор кортежей, собираемый из таблицы conntrack */
+struct bench_tuples {
+    struct dpi_conntrack_lookup *l;
+    unsigned int nr;
+    unsigned int max;
+};
+
+/**
+ * Выполнение теста при загрузке модуля
+ *
+ * @return
+ */
+static int __init bench_startup(void) {
+    if(0 == strcmp(test, "lookup")) {
+        return bench_lookup();
+    }
+
+    pr_err("dpi_conntrack_bench: unknown test %s\n", test);
+
+    return -EINVAL;
+}
+
+/**
+ * Выгрузка модуля
+ */
+static void bench_cleanup(void) {
+}
+
+/**
+ * Поиск по одному против dpi_conntrack_lookup_batch()
+ *
+ * @return
+ *
+ * Кортежи перемешиваются: в порядке обхода таблицы соседние кортежи
+ * попадают в соседние bucket, и промахи кэша почти не видны. Для
+ * показательного результата таблица conntrack должна быть больше LLC.
+ *
+ * NB!
+ * Вызов может приостанавливать выполнение!
+ */
+static int bench_lookup(void) {
+    struct bench_tuples t = {
+        .max = tuples,
+    };
+    u64 find_ns = 0;
+    u64 batch_ns = 0;
+    unsigned int find_found = 0;
+    unsigned int batch_found = 0;
+    unsigned int n;
+
+    if((0 == tuples) || (0 == burst) || (0 == rounds)) {
+        return -EINVAL;
+    }
+
+    if(NULL == (t.l = vzalloc(sizeof(*t.l) * tuples))) {
+        return -ENOMEM;
+    }
+
+    nf_ct_iterate_cleanup(&init_net, bench_collect, &t, 0, 0);
+
+    if(0 == t.nr) {
+        pr_err("dpi_conntrack_bench: conntrack table of init_net is empty\n");
+
+        vfree(t.l);
+
+        return -ENOENT;
+    }
+
+    for(n = t.nr - 1; n > 0; n--) {
+        swap(t.l[n], t.l[prandom_u32_max(n + 1)]);
+    }
+
+    /* Проходы чередуются: ни один из способов не получает прогретый кэш
+     * от предыдущего прохода другого
+     */
+    for(n = 0; n < rounds; n++) {
+        u64 start = ktime_get_ns();
+
+        find_found = bench_find_get(&init_net, t.l, t.nr);
+        find_ns += ktime_get_ns() - start;
+
+        cond_resched();
+
+        start = ktime_get_ns();
+        batch_found = bench_batch(&init_net, t.l, t.nr);
+        batch_ns += ktime_get_ns() - start;
+
+        cond_resched();
+    }
+
+    pr_info("dpi_conntrack_bench: lookup %u tuples x %u: nf_conntrack_find_get %llu ns/tuple (%u found), "
+            "dpi_conntrack_lookup_batch(%u) %llu ns/tuple (%u found)\n",
+            t.nr, rounds,
+            div_u64(find_ns, t.nr * rounds), find_found,
+            burst, div_u64(batch_ns, t.nr * rounds), batch_found);
+
+    vfree(t.l);
+
+    return 0;
+}
+
+/**
+ * Сохранение кортежа исходного направления подтвержденного conntrack
+ *
+ * @param ct
+ * @param data struct bench_tuples
+ * @return 0 (conntrack не удаляется)
+ */
+static int bench_collect(struct nf_conn *ct, void *data) {
+    struct bench_tuples *t = data;
+
+    if((t->nr < t->max) && nf_ct_is_confirmed(ct)) {
+        t->l[t->nr].tuple = ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple;
+        t->l[t->nr].zone = nf_ct_zone_id(nf_ct_zone(ct), IP_CT_DIR_ORIGINAL);
+        t->nr++;
+    }
+
+    return 0;
+}
+
+/**
+ * Поиск по одному кортежу
+ *
+ * @param net
+ * @param l
+ * @param nr
+ * @return кол-во найденных conntrack
+ *
+ * Результат тот же, что у dpi_conntrack_lookup_batch(): helper и метаданные.
+ */
+static unsigned int bench_find_get(struct net *net, struct dpi_conntrack_lookup *l, unsigned int nr) {
+    unsigned int found = 0;
+    unsigned int n;
+
+    for(n = 0; n < nr; n++) {
+        struct nf_conntrack_zone tmp;
+        const struct nf_conntrack_zone *zone = nf_ct_zone_init(&tmp, l[n].zone, NF_CT_DEFAULT_ZONE_DIR, 0);
+        struct nf_conntrack_tuple_hash *h = nf_conntrack_find_get(net, zone, &l[n].tuple);
+        struct nf_conn_help *help;
+        struct nf_conn *ct;
+
+        l[n].flags = 0;
+
+        if(NULL == h) {
+            continue;
+        }
+
+        ct = nf_ct_tuplehash_to_ctrack(h);
+        l[n].flags = DPI_CONNTRACK_LOOKUP_FOUND;
+
+        rcu_read_lock();
+
+        if(NULL != (help = nfct_help(ct))) {
+            struct nf_conntrack_helper *helper = rcu_dereference(help->helper);
+
+            if(NULL != helper) {
+                strlcpy(l[n].helper, helper->name, sizeof(l[n].helper));
+                l[n].flags |= DPI_CONNTRACK_LOOKUP_HELPER;
+            }
+        }
+
+        rcu_read_unlock();
+
+        if(0 == dpi_conntrack_meta_get(ct, &l[n].meta)) {
+            l[n].flags |= DPI_CONNTRACK_LOOKUP_META;
+        }
+
+        nf_ct_put(ct);
+
+        found++;
+    }
+
+    return found;
+}
+
+/**
+ * Поиск пачками по burst кортежей
+ *
+ * @param net
+ * @param l
+ * @param nr
+ * @return кол-во найденных conntrack
+ */
+static unsigned int bench_batch(struct net *net, struct dpi_conntrack_lookup *l, unsigned int nr) {
+    unsigned int found = 0;
+    unsigned int n;
+
+    for(n = 0; n < nr; n += burst) {
+        found += dpi_conntrack_lookup_batch(net, l + n, min(burst, nr - n));
+    }
+
+    return found;
+}
@@ -1,4 +1,4 @@
-/* 
+/*
  * File:   dpi_conntrack.h
  * Author: monster
  *
@@ -8,10 +8,367 @@
 #ifndef DPI_CONNTRACK_H
 #define DPI_CONNTRACK_H
 
+#include <linux/types.h>
+
+/*
+ * Двоичный формат "файла" /proc/net/dpi/<name>.bin (общий для модуля и
+ * userspace): заголовок struct dpi_conntrack_bin_header, за которым следуют
+ * записи struct dpi_conntrack_bin_record фиксированного размера.
+ *
+ * Все поля, кроме адресов и портов (network byte order), - в порядке байт
+ * машины, на которой работает модуль.
+ *
+ * Заголовок может дополняться полями в конце, поэтому записи начинаются
+ * со смещения header_size.
+ */
+
+/* Сигнатура заголовка ("DPIC") */
+#define DPI_CONNTRACK_BIN_MAGIC     0x43495044
+/* Версия формата записей (меняется при любом изменении их структуры) */
+#define DPI_CONNTRACK_BIN_VERSION   2
+
+/* Счетчики пакетов и байт (nf_conn_acct) присутствуют в записях */
+#define DPI_CONNTRACK_BIN_F_ACCT    0x0001
+/* Записи выданы из снимка "файла" (см. generation и age_ns) */
+#define DPI_CONNTRACK_BIN_F_SNAPSHOT 0x0002
+
+struct dpi_conntrack_bin_header {
+    /* DPI_CONNTRACK_BIN_MAGIC */
+    __u32 magic;
+    /* DPI_CONNTRACK_BIN_VERSION */
+    __u16 version;
+    /* sizeof(struct dpi_conntrack_bin_header) */
+    __u16 header_size;
+    /* sizeof(struct dpi_conntrack_bin_record) */
+    __u16 record_size;
+    /* DPI_CONNTRACK_BIN_F_* */
+    __u16 flags;
+    __u32 reserved;
+    /* Поколение снимка (растет при каждом его обновлении, 0 - не снимок) */
+    __u64 generation;
+    /* Возраст снимка на момент чтения заголовка, нс */
+    __u64 age_ns;
+} __attribute__((packed));
+
+/* Кортеж одного направления */
+struct dpi_conntrack_bin_tuple {
+    /* Адреса (для IPv4 используется только первый элемент) */
+    __be32 src[4];
+    __be32 dst[4];
+    /* Порты (для ICMP - id и type/code) */
+    __be16 sport;
+    __be16 dport;
+} __attribute__((packed));
+
+/*
+ * Метаданные классификации conntrack (dpi_conntrack_meta_set/get), все поля
+ * в порядке байт машины. Значения, кроме времен, задаются DPI-модулем.
+ */
+struct dpi_conntrack_meta {
+    /* Идентификатор приложения (0 - не определено) */
+    __u32 app_id;
+    /* Флаги DPI-модуля */
+    __u32 flags;
+    /* Оценка риска */
+    __u16 risk;
+    /* Уверенность классификации, 0..100 */
+    __u8 confidence;
+    __u8 reserved8;
+    __u32 reserved;
+    /* Время первой установки и последнего изменения (CLOCK_MONOTONIC), нс */
+    __u64 first_ns;
+    __u64 last_ns;
+} __attribute__((packed));
+
+/* Направления кортежей в записи */
+#define DPI_CONNTRACK_BIN_DIR_ORIGINAL  0
+#define DPI_CONNTRACK_BIN_DIR_REPLY     1
+#define DPI_CONNTRACK_BIN_DIR_MAX       2
+
+struct dpi_conntrack_bin_record {
+    struct dpi_conntrack_bin_tuple tuple[DPI_CONNTRACK_BIN_DIR_MAX];
+    /* AF_INET/AF_INET6 */
+    __u8 l3num;
+    /* IPPROTO_* */
+    __u8 protonum;
+    /* Зона conntrack */
+    __u16 zone;
+    /* ctmark */
+    __u32 mark;
+    /* IPS_* */
+    __u32 status;
+    /* Оставшееся время жизни, секунд */
+    __u32 timeout;
+    /* Счетчики по направлениям (0, если учет не включен) */
+    __u64 packets[DPI_CONNTRACK_BIN_DIR_MAX];
+    __u64 bytes[DPI_CONNTRACK_BIN_DIR_MAX];
+    /* Метаданные классификации (нули, если не устанавливались) */
+    struct dpi_conntrack_meta meta;
+} __attribute__((packed));
+
+/*
+ * Кольцевые буферы событий "файла" /proc/net/dpi/<name>.ring (mmap).
+ * 
+ * Отображаемая область состоит из nr_rings буферов (по одному на CPU) размером
+ * ring_size байт каждый. Буфер начинается со страницы struct dpi_conntrack_ring_ctl,
+ * с data_offset располагаются nr_events записей struct dpi_conntrack_ring_event.
+ * 
+ * producer увеличивается модулем, consumer - читателем; запись с номером N
+ * находится в элементе N & (nr_events - 1). Если буфер заполнен, событие
+ * отбрасывается с увеличением overflow. poll() на "файле" сообщает о наличии
+ * не менее wakeup_watermark непрочитанных событий в каком-либо буфере.
+ */
+
+/* Версия формата кольцевых буферов */
+#define DPI_CONNTRACK_RING_VERSION  2
+
+/* Типы событий */
+#define DPI_CONNTRACK_RING_EV_NEW       1
+#define DPI_CONNTRACK_RING_EV_UPDATE    2
+#define DPI_CONNTRACK_RING_EV_DESTROY   3
+
+struct dpi_conntrack_ring_event {
+    /* Время события (CLOCK_MONOTONIC), нс */
+    __u64 timestamp;
+    /* DPI_CONNTRACK_RING_EV_* */
+    __u32 type;
+    __u32 reserved;
+    struct dpi_conntrack_bin_record record;
+} __attribute__((packed));
+
+struct dpi_conntrack_ring_ctl {
+    /* Записывается модулем */
+    __u64 producer;
+    /* Кол-во отброшенных из-за переполнения событий */
+    __u64 overflow;
+    
+    /* Неизменяемое описание буфера */
+    __u32 version;
+    __u32 event_size;
+    __u32 nr_events;
+    __u32 nr_rings;
+    __u32 ring_size;
+    __u32 data_offset;
+    
+    /* Записывается читателем (в отдельной cache line) */
+    __u64 consumer __attribute__((aligned(64)));
+    /* Порог пробуждения poll() (0 или 1 - на каждое событие) */
+    __u32 wakeup_watermark;
+};
+
+/*
+ * Поток изменений "файла" /proc/net/dpi/<name>.delta (read/poll).
+ * 
+ * Каждый открытый дескриптор получает записи struct dpi_conntrack_ring_event
+ * (read() возвращает целое их число). Первым выдается DPI_CONNTRACK_DELTA_EV_RESYNC,
+ * за ним - текущие conntrack "файла" (DPI_CONNTRACK_RING_EV_NEW) и
+ * DPI_CONNTRACK_DELTA_EV_SYNCED, далее - только изменения с момента
+ * предыдущего read(). Если читатель отстал больше чем на размер журнала
+ * изменений, последовательность повторяется с DPI_CONNTRACK_DELTA_EV_RESYNC
+ * (ранее полученный набор следует отбросить).
+ * 
+ * Изменения, произошедшие во время выдачи текущего набора, выдаются после
+ * DPI_CONNTRACK_DELTA_EV_SYNCED, поэтому NEW и UPDATE следует применять как
+ * замену записи с тем же кортежем. poll() сообщает о наличии данных для read().
+ */
+
+/* Типы служебных записей (поле record не заполняется) */
+#define DPI_CONNTRACK_DELTA_EV_RESYNC   4
+#define DPI_CONNTRACK_DELTA_EV_SYNCED   5
+
+/*
+ * Семейство generic netlink DPI_CONNTRACK_GENL_NAME.
+ * 
+ * Команда DPI_CONNTRACK_CMD_DUMP (NLM_F_DUMP) с атрибутом DPI_CONNTRACK_A_NAME
+ * возвращает conntrack "файла" с указанным именем в netns сокета запроса.
+ * Каждое сообщение ответа содержит столько атрибутов DPI_CONNTRACK_A_RECORD
+ * (struct dpi_conntrack_bin_record), сколько помещается в буфер. Сообщение
+ * может не содержать записей (обход таблицы conntrack прерывается через
+ * каждые scan_chunk_buckets bucket / scan_chunk_us мкс), конец ответа - NLMSG_DONE.
+ * 
+ * Команда DPI_CONNTRACK_CMD_TOP (NLM_F_DUMP) с атрибутами DPI_CONNTRACK_A_NAME,
+ * DPI_CONNTRACK_A_TOP_KEY (DPI_CONNTRACK_TOP_*, по умолчанию - байты) и
+ * DPI_CONNTRACK_A_TOP_N (по умолчанию DPI_CONNTRACK_TOP_DEFAULT) возвращает
+ * не более N conntrack "файла" с наибольшим значением по убыванию: каждой
+ * записи DPI_CONNTRACK_A_RECORD предшествует DPI_CONNTRACK_A_VALUE (__u64).
+ * Значение - сумма счетчиков обоих направлений или возраст conntrack в нс;
+ * conntrack без расширения учета трафика (nf_conntrack_acct) или времени
+ * (nf_conntrack_timestamp) не учитываются, если учет выключен в netns -
+ * EOPNOTSUPP.
+ * 
+ * Команда DPI_CONNTRACK_CMD_FLUSH с атрибутом DPI_CONNTRACK_A_NAME удаляет все
+ * conntrack "файла" одним обходом, с DPI_CONNTRACK_A_TIMEOUT - сокращает их
+ * оставшееся время жизни до указанного. Ответ содержит кол-во удаленных или
+ * измененных conntrack (DPI_CONNTRACK_A_COUNT) и длительность операции
+ * (DPI_CONNTRACK_A_ELAPSED_NS). Если обход прерван ошибкой после обработки
+ * части conntrack, ответ дополнительно содержит ее код (DPI_CONNTRACK_A_ERROR).
+ */
+
+#define DPI_CONNTRACK_GENL_NAME     "dpi_conntrack"
+#define DPI_CONNTRACK_GENL_VERSION  1
+
+/* Максимальная длина имени "файла" в запросе (включая ограничитель) */
+#define DPI_CONNTRACK_NAME_MAX      64
+
+/* Команды */
+enum {
+    DPI_CONNTRACK_CMD_UNSPEC,
+    DPI_CONNTRACK_CMD_DUMP,
+    DPI_CONNTRACK_CMD_TOP,
+    DPI_CONNTRACK_CMD_FLUSH,
+    __DPI_CONNTRACK_CMD_MAX,
+};
+#define DPI_CONNTRACK_CMD_MAX   (__DPI_CONNTRACK_CMD_MAX - 1)
+
+/* Атрибуты */
+enum {
+    DPI_CONNTRACK_A_UNSPEC,
+    /* Имя "файла" (NUL-terminated) */
+    DPI_CONNTRACK_A_NAME,
+    /* struct dpi_conntrack_bin_record */
+    DPI_CONNTRACK_A_RECORD,
+    /* __u32, DPI_CONNTRACK_TOP_* */
+    DPI_CONNTRACK_A_TOP_KEY,
+    /* __u32, кол-во conntrack в ответе (1..DPI_CONNTRACK_TOP_MAX) */
+    DPI_CONNTRACK_A_TOP_N,
+    /* __u64, значение следующей записи */
+    DPI_CONNTRACK_A_VALUE,
+    /* __u32, время жизни, секунд */
+    DPI_CONNTRACK_A_TIMEOUT,
+    /* __u64, кол-во conntrack */
+    DPI_CONNTRACK_A_COUNT,
+    /* __u64, длительность, нс */
+    DPI_CONNTRACK_A_ELAPSED_NS,
+    /* __u32, положительный код ошибки (errno), прервавшей операцию */
+    DPI_CONNTRACK_A_ERROR,
+    __DPI_CONNTRACK_A_MAX,
+};
+#define DPI_CONNTRACK_A_MAX     (__DPI_CONNTRACK_A_MAX - 1)
+
+/* Упорядочение DPI_CONNTRACK_CMD_TOP */
+#define DPI_CONNTRACK_TOP_BYTES     0
+#define DPI_CONNTRACK_TOP_PACKETS   1
+#define DPI_CONNTRACK_TOP_AGE       2
+
+#define DPI_CONNTRACK_TOP_DEFAULT   10
+#define DPI_CONNTRACK_TOP_MAX       4096
+
+/*
+ * Фильтр "файла" (dpi_conntrack_register_filter). Проверяются только
+ * критерии, отмеченные в flags; conntrack должен удовлетворять всем им.
+ */
+
+/* Максимальное кол-во helper и диапазонов портов в фильтре */
+#define DPI_CONNTRACK_FILTER_HELPERS_MAX    4
+#define DPI_CONNTRACK_FILTER_PORTS_MAX      8
+
+/* Длина имени helper (совпадает с NF_CT_HELPER_NAME_LEN) */
+#define DPI_CONNTRACK_HELPER_NAME_LEN       16
+
+/* Критерии фильтра */
+#define DPI_CONNTRACK_FILTER_L3         0x0001
+#define DPI_CONNTRACK_FILTER_L4         0x0002
+#define DPI_CONNTRACK_FILTER_ZONE       0x0004
+#define DPI_CONNTRACK_FILTER_MARK       0x0008
+#define DPI_CONNTRACK_FILTER_STATUS     0x0010
+#define DPI_CONNTRACK_FILTER_SPORT      0x0020
+#define DPI_CONNTRACK_FILTER_DPORT      0x0040
+
+/* Диапазон портов (включительно, в порядке байт машины) */
+struct dpi_conntrack_port_range {
+    __u16 min;
+    __u16 max;
+};
+
+struct dpi_conntrack_filter {
+    /* DPI_CONNTRACK_FILTER_* */
+    __u32 flags;
+    /* Кол-во helper (0 - helper не проверяется, в т.ч. conntrack без helper) */
+    __u32 nr_helpers;
+    char helpers[DPI_CONNTRACK_FILTER_HELPERS_MAX][DPI_CONNTRACK_HELPER_NAME_LEN];
+    /* AF_INET/AF_INET6 */
+    __u8 l3num;
+    /* IPPROTO_* */
+    __u8 protonum;
+    /* Зона conntrack */
+    __u16 zone;
+    /* (ctmark & mark_mask) == mark */
+    __u32 mark;
+    __u32 mark_mask;
+    /* (status & status_mask) == status, IPS_* */
+    __u32 status;
+    __u32 status_mask;
+    /* Порты исходного направления (любой из диапазонов) */
+    __u32 nr_sport;
+    struct dpi_conntrack_port_range sport[DPI_CONNTRACK_FILTER_PORTS_MAX];
+    __u32 nr_dport;
+    struct dpi_conntrack_port_range dport[DPI_CONNTRACK_FILTER_PORTS_MAX];
+};
+
+#ifdef __KERNEL__
+
 #include <net/net_namespace.h>
+#include <net/netfilter/nf_conntrack_tuple.h>
 
 int dpi_conntrack_register_file(const char *name, struct net *net);
+int dpi_conntrack_register_filter(const char *name, struct net *net,
+                                  const struct dpi_conntrack_filter *filter);
 int dpi_conntrack_unregister_file(const char *name, struct net *net);
+int dpi_conntrack_count(const char *name, struct net *net);
+
+struct nf_conn;
+
+/*
+ * Обход conntrack "файла" пакетами: cb получает массив из nr conntrack
+ * (ссылки удерживаются до возврата из cb), вызывается вне rcu_read_lock и
+ * может приостанавливать выполнение. Ненулевой результат cb прекращает
+ * обход. batch_size - от 1 до 1024, 0 - по умолчанию (64). -EAGAIN - обход
+ * прекращен до конца после изменения размера таблицы conntrack.
+ */
+int dpi_conntrack_for_each_batch(struct net *net, const char *name,
+                                 int (*cb)(struct nf_conn **ct, unsigned int nr, void *ctx),
+                                 void *ctx, unsigned int batch_size);
+
+/*
+ * Метаданные классификации conntrack (O(1) по указателю на nf_conn, в т.ч.
+ * в softirq). Удаляются вместе с conntrack по уведомлению IPCT_DESTROY,
+ * поэтому set возвращает -EOPNOTSUPP в netns без уведомлений (параметр
+ * модуля events, nf_conntrack_netlink) и -EAGAIN для еще не подтвержденного
+ * conntrack. get возвращает -ENOENT, если метаданные не устанавливались.
+ */
+int dpi_conntrack_meta_set(struct nf_conn *ct, const struct dpi_conntrack_meta *meta);
+int dpi_conntrack_meta_get(const struct nf_conn *ct, struct dpi_conntrack_meta *meta);
+
+/* Результат поиска кортежа (dpi_conntrack_lookup.flags) */
+#define DPI_CONNTRACK_LOOKUP_FOUND      0x0001
+/* Кортеж ответного направления */
+#define DPI_CONNTRACK_LOOKUP_REPLY      0x0002
+#define DPI_CONNTRACK_LOOKUP_HELPER     0x0004
+#define DPI_CONNTRACK_LOOKUP_META       0x0008
+
+/* Элемент dpi_conntrack_lookup_batch() */
+struct dpi_conntrack_lookup {
+    /* Заполняются вызывающим: кортеж (любого направления) и идентификатор
+     * зоны conntrack для направления кортежа (nf_ct_zone_id)
+     */
+    struct nf_conntrack_tuple tuple;
+    __u16 zone;
+    /* Результат (для не найденного кортежа - нули) */
+    __u32 flags;
+    /* Имя helper conntrack */
+    char helper[DPI_CONNTRACK_HELPER_NAME_LEN];
+    /* Метаданные классификации */
+    struct dpi_conntrack_meta meta;
+};
+
+/*
+ * Поиск conntrack для пакета кортежей (например, пачки пакетов) в одном
+ * окружении rcu_read_lock с предварительной загрузкой bucket таблицы.
+ * Возвращает кол-во найденных, может вызываться в контексте softirq.
+ */
+int dpi_conntrack_lookup_batch(struct net *net, struct dpi_conntrack_lookup *l, unsigned int nr);
+
+#endif /* __KERNEL__ */
 
 #endif /* DPI_CONNTRACK_H */
 
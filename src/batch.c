@@ -0,0 +1,182 @@
+#include <linux/slab.h>
+
+#include <net/netfilter/nf_conntrack.h>
+
+#include "dpi_conntrack_ko.h"
+
+/* Максимальный размер пакета dpi_conntrack_for_each_batch() */
+#define BATCH_SIZE_MAX      1024
+/* Размер пакета по умолчанию */
+#define BATCH_SIZE_DEFAULT  64
+
+/* Предварительное объявление локальных функций модуля */
+static bool batch_take(struct dpi_conntrack_file *f, struct nf_conn *ct,
+                       const struct nf_conntrack_tuple *tuple);
+static void batch_put(struct nf_conn **ct, unsigned int nr);
+
+/**
+ * Обход conntrack "файла" пакетами
+ *
+ * @param net
+ * @param name имя "файла"
+ * @param cb вызывается для каждого пакета из nr (1..batch_size) conntrack,
+ * ненулевой результат прекращает обход и возвращается вызывающему
+ * @param ctx передается в cb
+ * @param batch_size 0 - размер по умолчанию
+ * @return -ENOENT, если "файл" не найден или снят с регистрации во время
+ * обхода, -EINVAL, если batch_size больше максимального, -EAGAIN, если
+ * обход прекращен после изменения размера таблицы conntrack до ее конца
+ *
+ * conntrack собираются обходом "файла" (тем же, что и для чтения файлов
+ * procfs) со ссылками, cb вызывается вне rcu_read_lock и может
+ * приостанавливать выполнение. Ссылки освобождаются после возврата из cb
+ * (чтобы сохранить conntrack, cb должен получить собственную ссылку).
+ * Каждый conntrack передается не более одного раза, в т.ч. если cb удаляет
+ * conntrack или таблица conntrack меняет размер во время обхода.
+ *
+ * NB!
+ * Вызов может приостанавливать выполнение!
+ */
+int dpi_conntrack_for_each_batch(struct net *net, const char *name,
+                                 int (*cb)(struct nf_conn **ct, unsigned int nr, void *ctx),
+                                 void *ctx, unsigned int batch_size) {
+    struct dpi_conntrack_net *pernet = dpi_conntrack_pernet(net);
+    struct dpi_conntrack_cursor *st;
+    struct nf_conn **batch;
+    bool more;
+    int rv = 0;
+
+    if(0 == batch_size) {
+        batch_size = BATCH_SIZE_DEFAULT;
+    } else if(batch_size > BATCH_SIZE_MAX) {
+        return -EINVAL;
+    }
+
+    st = kzalloc(sizeof(*st), GFP_KERNEL);
+    batch = kmalloc_array(batch_size, sizeof(*batch), GFP_KERNEL);
+
+    if((NULL == st) || (NULL == batch)) {
+        dpi_conntrack_stats_inc(pernet->stats, alloc_failed);
+
+        kfree(batch);
+        kfree(st);
+
+        return -ENOMEM;
+    }
+
+    do {
+        struct dpi_conntrack_file *f;
+        struct dpi_iterator *i;
+        unsigned int nr = 0;
+
+        dpi_conntrack_iter_reserve(st);
+
+        rcu_read_lock();
+
+        /* Ссылка на "файл" не удерживается, ищем его заново на каждом участке */
+        f = dpi_conntrack_file_find_rcu(pernet, name);
+
+        if((NULL == f) || (st->f && (f->gen != st->gen))) {
+            rcu_read_unlock();
+
+            rv = -ENOENT;
+
+            break;
+        }
+
+        st->f = f;
+        st->gen = f->gen;
+
+        for(i = dpi_conntrack_iter_start(st, st->pos);i;i = dpi_conntrack_iter_next(st, i)) {
+            struct nf_conn *ct;
+
+            if(batch_size == nr) {
+                /* Пакет заполнен, с этого conntrack продолжим после его обработки */
+                break;
+            }
+
+            ct = dpi_conntrack_iter_ct(i);
+
+            if(batch_take(f, ct, dpi_conntrack_iter_tuple(i))) {
+                batch[nr++] = ct;
+            }
+        }
+
+        dpi_conntrack_iter_stop(st, i);
+
+        rcu_read_unlock();
+
+        more = (NULL != i) || st->yield;
+
+        if(nr) {
+            rv = cb(batch, nr, ctx);
+
+            batch_put(batch, nr);
+        }
+
+        cond_resched();
+    } while(more && !rv);
+
+    if(!rv && st->lost) {
+        /* Обход прекращен после изменения размера таблицы, не дойдя до конца */
+        rv = -EAGAIN;
+    }
+
+    dpi_conntrack_iter_release(st);
+
+    kfree(batch);
+    kfree(st);
+
+    return rv;
+}
+EXPORT_SYMBOL_GPL(dpi_conntrack_for_each_batch);
+
+/**
+ * Получение ссылки на conntrack "файла"
+ *
+ * @param f
+ * @param ct
+ * @param tuple кортеж исходного направления, по которому conntrack найден обходом
+ * @return false, если conntrack уже уничтожается или не подходит
+ *
+ * Как и dpi_conntrack_record_fill(): до получения ссылки nf_conn мог быть
+ * переиспользован, в т.ч. еще не подтвержденным conntrack, которого
+ * обработчик пакета (например, flush) касаться не должен.
+ *
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+static bool batch_take(struct dpi_conntrack_file *f, struct nf_conn *ct,
+                       const struct nf_conntrack_tuple *tuple) {
+    if(unlikely(!atomic_inc_not_zero(&ct->ct_general.use))) {
+        return false;
+    }
+
+    if(nf_ct_is_dying(ct) ||
+       !nf_ct_is_confirmed(ct) ||
+       !nf_ct_tuple_equal(tuple, &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple) ||
+       !dpi_conntrack_filter_match_rcu(f, ct)) {
+        /* nf_conn был переиспользован до получения ссылки */
+        nf_ct_put(ct);
+
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Освобождение ссылок на conntrack пакета
+ *
+ * @param ct
+ * @param nr
+ */
+static void batch_put(struct nf_conn **ct, unsigned int nr) {
+    unsigned int n;
+
+    for(n = 0;n < nr;n++) {
+        nf_ct_put(ct[n]);
+    }
+}
@@ -0,0 +1,238 @@
+#include <linux/proc_fs.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/ctype.h>
+#include <linux/uaccess.h>
+#include <linux/capability.h>
+
+#include "dpi_conntrack_ko.h"
+
+/* Максимальный размер одной записи в управляющий файл */
+#define CONTROL_WRITE_MAX       (64 * 1024)
+
+/* Команды управляющего файла */
+enum {
+    CONTROL_ADD,
+    CONTROL_DEL,
+};
+
+/* Строка записи: команда и ее аргументы (имена "файлов") */
+struct control_op {
+    int cmd;
+    char **names;
+    unsigned int nr;
+};
+
+/* Предварительное объявление локальных функций модуля */
+static ssize_t control_write(struct file *file, const char __user *buf,
+                             size_t count, loff_t *ppos);
+static int control_parse(char *buf, struct control_op *ops, unsigned int *nr_ops, char **names);
+
+/* Набор операций для файла /proc/net/dpi/control */
+static const struct file_operations control_fops = {
+    .owner   = THIS_MODULE,
+    .write   = control_write,
+    .llseek  = noop_llseek,
+};
+
+/**
+ * Создание управляющего файла netns
+ *
+ * @param pernet
+ * @param net
+ * @return
+ */
+int dpi_conntrack_control_init(struct dpi_conntrack_net *pernet, struct net *net) {
+    if(NULL == proc_create_data(PROC_NET_DPI_CONTROL, 0200, pernet->proc_dpi, &control_fops, net)) {
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+/**
+ * Удаление управляющего файла netns
+ *
+ * @param pernet
+ */
+void dpi_conntrack_control_exit(struct dpi_conntrack_net *pernet) {
+    /* Дожидается завершения выполняющихся записей */
+    remove_proc_entry(PROC_NET_DPI_CONTROL, pernet->proc_dpi);
+}
+
+/**
+ * Запись команд в управляющий файл
+ *
+ * @param file
+ * @param buf
+ * @param count
+ * @param ppos
+ * @return count, либо первая ошибка выполнения команд
+ *
+ * Каждая строка - команда с именами "файлов", разделенными пробелами:
+ *   add sip ftp h323
+ *   del tftp
+ * Пустые строки и строки, начинающиеся с '#', пропускаются.
+ *
+ * Запись сначала разбирается целиком: при синтаксической ошибке (-EINVAL)
+ * ни одна команда не выполняется. Далее строки выполняются по порядку,
+ * каждая - одним изменением таблицы "файлов" (под files_lock): для "add"
+ * индексы заполняются одним обходом таблицы conntrack, для "del" все
+ * "файлы" строки освобождаются после одного grace period. Ошибки отдельных
+ * имен (-EEXIST, -ENOENT, зарезервированные имена) не прерывают выполнение
+ * остальных.
+ */
+static ssize_t control_write(struct file *file, const char __user *buf,
+                             size_t count, loff_t *ppos) {
+    struct net *net = PDE_DATA(file_inode(file));
+    struct dpi_conntrack_net *pernet = dpi_conntrack_pernet(net);
+    struct control_op *ops = NULL;
+    char **names = NULL;
+    char *kbuf;
+    unsigned int nr_ops, n;
+    int rv;
+
+    /* Проверяются права открывшего файл (f_cred), а не пишущего: иначе
+     * дескриптор можно было бы передать привилегированному процессу
+     * (например, как stdout setuid-программы)
+     */
+    if(!file_ns_capable(file, net->user_ns, CAP_NET_ADMIN)) {
+        return -EPERM;
+    }
+
+    if((0 == count) || (count > CONTROL_WRITE_MAX)) {
+        return -EINVAL;
+    }
+
+    if(NULL == (kbuf = kmalloc(count + 1, GFP_KERNEL))) {
+        rv = -ENOMEM;
+
+        goto out;
+    }
+
+    if(copy_from_user(kbuf, buf, count)) {
+        rv = -EFAULT;
+
+        goto out;
+    }
+
+    kbuf[count] = '\0';
+
+    /* Строк не больше, чем символов '\n' + 1, имен - не больше половины символов + 1 */
+    nr_ops = 1;
+
+    for(n = 0;n < count;n++) {
+        nr_ops += ('\n' == kbuf[n]);
+    }
+
+    ops = kmalloc_array(nr_ops, sizeof(*ops), GFP_KERNEL);
+    names = kmalloc_array(count / 2 + 1, sizeof(*names), GFP_KERNEL);
+
+    if((NULL == ops) || (NULL == names)) {
+        rv = -ENOMEM;
+
+        goto out;
+    }
+
+    if(0 != (rv = control_parse(kbuf, ops, &nr_ops, names))) {
+        goto out;
+    }
+
+    for(n = 0;n < nr_ops;n++) {
+        int err;
+
+        if(CONTROL_ADD == ops[n].cmd) {
+            err = dpi_conntrack_procfs_register_files(net, ops[n].names, ops[n].nr);
+        } else {
+            err = dpi_conntrack_procfs_unregister_files(net, ops[n].names, ops[n].nr);
+        }
+
+        if(err && !rv) {
+            /* Запоминаем первую ошибку, выполнение продолжается */
+            rv = err;
+        }
+    }
+
+out:
+    if(-ENOMEM == rv) {
+        dpi_conntrack_stats_inc(pernet->stats, alloc_failed);
+    }
+
+    kfree(names);
+    kfree(ops);
+    kfree(kbuf);
+
+    return rv ? rv : count;
+}
+
+/**
+ * Разбор записи на команды
+ *
+ * @param buf строка (изменяется: разделители заменяются на '\0')
+ * @param ops
+ * @param nr_ops на входе - размер ops, на выходе - кол-во команд
+ * @param names хранилище указателей на имена для всех команд
+ * @return -EINVAL при синтаксической ошибке или имени add длиннее имени helper
+ */
+static int control_parse(char *buf, struct control_op *ops, unsigned int *nr_ops, char **names) {
+    unsigned int nr = 0;
+    char *line;
+
+    while(NULL != (line = strsep(&buf, "\n"))) {
+        struct control_op *op = &ops[nr];
+        char *word;
+
+        line = skip_spaces(line);
+
+        if(('\0' == *line) || ('#' == *line)) {
+            continue;
+        }
+
+        word = strsep(&line, " \t\r");
+
+        if(0 == strcmp(word, "add")) {
+            op->cmd = CONTROL_ADD;
+        } else if(0 == strcmp(word, "del")) {
+            op->cmd = CONTROL_DEL;
+        } else {
+            return -EINVAL;
+        }
+
+        op->names = names;
+        op->nr = 0;
+
+        while(NULL != (word = strsep(&line, " \t\r"))) {
+            size_t len = strlen(word);
+
+            if(0 == len) {
+                /* Повторный разделитель */
+                continue;
+            }
+
+            if((len >= DPI_CONNTRACK_NAME_MAX) || strchr(word, '/')) {
+                /* Имя не может быть именем "файла" в /proc/net/dpi */
+                return -EINVAL;
+            }
+
+            if((CONTROL_ADD == op->cmd) && (len >= DPI_CONNTRACK_HELPER_NAME_LEN)) {
+                /* Имя "файла" add - имя helper, усеченное имя отбирало бы другой helper */
+                return -EINVAL;
+            }
+
+            op->names[op->nr++] = word;
+        }
+
+        if(0 == op->nr) {
+            /* Команда без аргументов */
+            return -EINVAL;
+        }
+
+        names += op->nr;
+        nr++;
+    }
+
+    *nr_ops = nr;
+
+    return 0;
+}
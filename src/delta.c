@@ -0,0 +1,426 @@
+#include <linux/vmalloc.h>
+#include <linux/slab.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/log2.h>
+#include <linux/ktime.h>
+#include <linux/uaccess.h>
+#include <linux/proc_fs.h>
+#include <linux/mutex.h>
+
+#include "dpi_conntrack_ko.h"
+
+/* Максимальное кол-во записей, выдаваемых одним read() */
+#define DELTA_READ_BATCH    256
+
+/* Кол-во записей журнала изменений "файла" (0 - журнал и файл <name>.delta не создаются) */
+static unsigned int delta_events __read_mostly;
+module_param(delta_events, uint, 0444);
+MODULE_PARM_DESC(delta_events, "Change log entries kept for each file's .delta readers (0 - disabled)");
+
+/*
+ * Состояние читателя <name>.delta (file->private_data)
+ */
+struct delta_reader {
+    struct dpi_conntrack_file *f;
+    struct dpi_conntrack_delta *d;
+    /* Для параллельных read() одного дескриптора */
+    struct mutex lock;
+    /* Номер следующего выдаваемого изменения */
+    u64 seq;
+    /* Требуется выдать набор заново (первое чтение, отставание) */
+    bool resync;
+    /* Выполняется выдача текущего набора (курсор обхода индекса) */
+    bool full;
+    struct dpi_conntrack_cursor cursor;
+    /* Буфер для формирования записей (copy_to_user вне блокировок) */
+    struct dpi_conntrack_ring_event *buf;
+};
+
+/* Предварительное объявление локальных функций модуля */
+static int delta_open(struct inode *inode, struct file *file);
+static int delta_release(struct inode *inode, struct file *file);
+static ssize_t delta_read(struct file *file, char __user *buf, size_t count, loff_t *ppos);
+static unsigned int delta_poll(struct file *file, struct poll_table_struct *wait);
+static unsigned int delta_fill(struct delta_reader *rd, unsigned int max);
+static unsigned int delta_fill_full(struct delta_reader *rd, struct dpi_conntrack_ring_event *ev,
+                                    unsigned int max);
+static unsigned int delta_fill_changes(struct delta_reader *rd, struct dpi_conntrack_ring_event *ev,
+                                       unsigned int max);
+static void delta_marker(struct dpi_conntrack_ring_event *ev, u32 type);
+static bool delta_pending(struct delta_reader *rd);
+
+/* Набор операций для файла <name>.delta */
+const struct file_operations dpi_conntrack_delta_fops = {
+    .owner   = THIS_MODULE,
+    .open    = delta_open,
+    .release = delta_release,
+    .read    = delta_read,
+    .poll    = delta_poll,
+    .llseek  = noop_llseek,
+};
+
+/**
+ * Создание журнала изменений для "файла"
+ *
+ * @return NULL, если журнал отключен (delta_events == 0) или не хватило памяти
+ */
+struct dpi_conntrack_delta *dpi_conntrack_delta_new(void) {
+    struct dpi_conntrack_delta *d;
+    unsigned int nr;
+
+    if(!delta_events) {
+        /* Журнал изменений не используется */
+        return NULL;
+    }
+
+    /* Кол-во элементов должно быть степенью 2 (индекс получаем маской) */
+    nr = roundup_pow_of_two(delta_events);
+
+    if(NULL == (d = vzalloc(sizeof(*d) + nr * sizeof(struct dpi_conntrack_ring_event)))) {
+        return NULL;
+    }
+
+    d->nr_events = nr;
+
+    spin_lock_init(&d->lock);
+    init_waitqueue_head(&d->wait);
+
+    return d;
+}
+
+/**
+ * Освобождение журнала изменений
+ *
+ * @param d
+ *
+ * Вызывается вместе с освобождением "файла" (все дескрипторы <name>.delta
+ * уже закрыты при удалении его из procfs).
+ */
+void dpi_conntrack_delta_free(struct dpi_conntrack_delta *d) {
+    vfree(d);
+}
+
+/**
+ * Запись изменения в журнал
+ *
+ * @param d
+ * @param type DPI_CONNTRACK_RING_EV_*
+ * @param ct
+ *
+ * NB!
+ * Вызывается из обработчика уведомлений conntrack (rcu_read_lock, в т.ч. softirq).
+ * conntrack удерживается вызывающим.
+ */
+void dpi_conntrack_delta_event(struct dpi_conntrack_delta *d, u32 type, struct nf_conn *ct) {
+    struct dpi_conntrack_ring_event *ev;
+
+    spin_lock_bh(&d->lock);
+
+    /* Самые старые записи перезаписываются, отставшие читатели это обнаружат по head */
+    ev = &d->ev[d->head & (d->nr_events - 1)];
+
+    ev->timestamp = ktime_get_ns();
+    ev->type = type;
+    ev->reserved = 0;
+
+    dpi_conntrack_record_fill_ct(&ev->record, ct);
+
+    d->head++;
+
+    spin_unlock_bh(&d->lock);
+
+    /* Пробуждаем только при наличии ожидающих (без лишнего захвата wait.lock) */
+    smp_mb();
+
+    if(waitqueue_active(&d->wait)) {
+        wake_up_interruptible_poll(&d->wait, POLLIN | POLLRDNORM);
+    }
+}
+
+/**
+ * Пробуждение читателей при снятии "файла" с регистрации
+ *
+ * @param d
+ *
+ * Вызывается после установки f->dead.
+ */
+void dpi_conntrack_delta_shutdown(struct dpi_conntrack_delta *d) {
+    wake_up_interruptible_all(&d->wait);
+}
+
+/**
+ * Открытие файла <name>.delta
+ *
+ * @param inode
+ * @param file
+ * @return
+ */
+static int delta_open(struct inode *inode, struct file *file) {
+    struct dpi_conntrack_file *f = PDE_DATA(inode);
+    struct delta_reader *rd;
+
+    if(NULL == (rd = kzalloc(sizeof(*rd), GFP_KERNEL)) ||
+       NULL == (rd->buf = vmalloc(DELTA_READ_BATCH * sizeof(struct dpi_conntrack_ring_event)))) {
+        kfree(rd);
+
+        dpi_conntrack_stats_inc(dpi_conntrack_pernet(f->net)->stats, alloc_failed);
+
+        return -ENOMEM;
+    }
+
+    mutex_init(&rd->lock);
+
+    rd->f = f;
+    rd->d = f->delta;
+    rd->cursor.f = f;
+    rd->cursor.preemptible = true;
+
+    /* Первое чтение начинается с выдачи текущего набора */
+    rd->resync = true;
+
+    file->private_data = rd;
+
+    return nonseekable_open(inode, file);
+}
+
+/**
+ * Закрытие файла <name>.delta
+ *
+ * @param inode
+ * @param file
+ * @return
+ */
+static int delta_release(struct inode *inode, struct file *file) {
+    struct delta_reader *rd = file->private_data;
+
+    dpi_conntrack_iter_release(&rd->cursor);
+
+    vfree(rd->buf);
+    kfree(rd);
+
+    return 0;
+}
+
+/**
+ * Чтение изменений
+ *
+ * @param file
+ * @param buf
+ * @param count
+ * @param ppos
+ * @return -EAGAIN, если изменений нет (O_NONBLOCK)
+ *
+ * Без O_NONBLOCK ожидает появления изменений.
+ */
+static ssize_t delta_read(struct file *file, char __user *buf, size_t count, loff_t *ppos) {
+    struct delta_reader *rd = file->private_data;
+    unsigned int max = min_t(size_t, count / sizeof(struct dpi_conntrack_ring_event), DELTA_READ_BATCH);
+    unsigned int n;
+    size_t len;
+    ssize_t rv;
+
+    if(0 == max) {
+        /* Буфер меньше одной записи */
+        return -EINVAL;
+    }
+
+    if(mutex_lock_interruptible(&rd->lock)) {
+        return -ERESTARTSYS;
+    }
+
+    while(0 == (n = delta_fill(rd, max))) {
+        mutex_unlock(&rd->lock);
+
+        if(READ_ONCE(rd->f->dead)) {
+            /* "Файл" снят с регистрации, изменений больше не будет */
+            return 0;
+        }
+
+        if(file->f_flags & O_NONBLOCK) {
+            return -EAGAIN;
+        }
+
+        /* Ожидание прерывается и при снятии "файла" с регистрации
+         * (иначе удаление файла из procfs ждало бы завершения read)
+         */
+        if(0 != (rv = wait_event_interruptible(rd->d->wait, delta_pending(rd) || READ_ONCE(rd->f->dead)))) {
+            return rv;
+        }
+
+        if(mutex_lock_interruptible(&rd->lock)) {
+            return -ERESTARTSYS;
+        }
+    }
+
+    len = n * sizeof(struct dpi_conntrack_ring_event);
+
+    /* Записи уже учтены как выданные, при ошибке копирования они теряются */
+    rv = copy_to_user(buf, rd->buf, len) ? -EFAULT : len;
+
+    mutex_unlock(&rd->lock);
+
+    if(rv > 0) {
+        dpi_conntrack_stats_add(dpi_conntrack_pernet(rd->f->net)->stats, bytes, len);
+    }
+
+    return rv;
+}
+
+/**
+ * Ожидание изменений
+ *
+ * @param file
+ * @param wait
+ * @return
+ */
+static unsigned int delta_poll(struct file *file, struct poll_table_struct *wait) {
+    struct delta_reader *rd = file->private_data;
+
+    poll_wait(file, &rd->d->wait, wait);
+
+    return (delta_pending(rd) || READ_ONCE(rd->f->dead)) ? (POLLIN | POLLRDNORM) : 0;
+}
+
+/**
+ * Формирование очередной порции записей в rd->buf
+ *
+ * @param rd
+ * @param max
+ * @return кол-во записей (0 - изменений нет)
+ */
+static unsigned int delta_fill(struct delta_reader *rd, unsigned int max) {
+    struct dpi_conntrack_ring_event *ev = rd->buf;
+    unsigned int n = 0;
+
+    if(!rd->full) {
+        n = delta_fill_changes(rd, ev, max);
+    }
+
+    if(rd->resync) {
+        /* Изменения, начиная с этого момента, выдаются после текущего набора */
+        spin_lock_bh(&rd->d->lock);
+
+        rd->seq = rd->d->head;
+
+        spin_unlock_bh(&rd->d->lock);
+
+        rd->resync = false;
+        rd->full = true;
+
+        /* Новый обход индекса */
+        rd->cursor.saved = false;
+        rd->cursor.pos = 0;
+
+        /* Ранее сформированные изменения отбрасываются (набор выдается заново) */
+        n = 0;
+
+        delta_marker(&ev[n++], DPI_CONNTRACK_DELTA_EV_RESYNC);
+    }
+
+    if(rd->full && (n < max)) {
+        n += delta_fill_full(rd, &ev[n], max - n);
+    }
+
+    return n;
+}
+
+/**
+ * Выдача текущего набора conntrack "файла"
+ *
+ * @param rd
+ * @param ev
+ * @param max
+ * @return кол-во записей
+ */
+static unsigned int delta_fill_full(struct delta_reader *rd, struct dpi_conntrack_ring_event *ev,
+                                    unsigned int max) {
+    struct dpi_conntrack_cursor *st = &rd->cursor;
+    struct dpi_iterator *i;
+    unsigned int n = 0;
+    u64 now = ktime_get_ns();
+
+    dpi_conntrack_iter_reserve(st);
+
+    rcu_read_lock();
+
+    i = dpi_conntrack_iter_start(st, st->pos);
+
+    while(i && (n < max)) {
+        if(0 == dpi_conntrack_record_fill(&ev[n].record, dpi_conntrack_iter_ct(i),
+                                         dpi_conntrack_iter_tuple(i), rd->f)) {
+            ev[n].timestamp = now;
+            ev[n].type = DPI_CONNTRACK_RING_EV_NEW;
+            ev[n].reserved = 0;
+
+            n++;
+        }
+
+        i = dpi_conntrack_iter_next(st, i);
+    }
+
+    dpi_conntrack_iter_stop(st, i);
+
+    rcu_read_unlock();
+
+    if((NULL == i) && (n < max)) {
+        /* Набор выдан полностью */
+        delta_marker(&ev[n++], DPI_CONNTRACK_DELTA_EV_SYNCED);
+
+        rd->full = false;
+    }
+
+    return n;
+}
+
+/**
+ * Выдача изменений из журнала
+ *
+ * @param rd
+ * @param ev
+ * @param max
+ * @return кол-во записей (при отставании читателя устанавливается rd->resync)
+ */
+static unsigned int delta_fill_changes(struct delta_reader *rd, struct dpi_conntrack_ring_event *ev,
+                                       unsigned int max) {
+    struct dpi_conntrack_delta *d = rd->d;
+    unsigned int n = 0;
+
+    spin_lock_bh(&d->lock);
+
+    if(d->head - rd->seq > d->nr_events) {
+        /* Часть изменений перезаписана */
+        rd->resync = true;
+    } else {
+        for(;(n < max) && (rd->seq != d->head);n++, rd->seq++) {
+            ev[n] = d->ev[rd->seq & (d->nr_events - 1)];
+        }
+    }
+
+    spin_unlock_bh(&d->lock);
+
+    return n;
+}
+
+/**
+ * Служебная запись
+ *
+ * @param ev
+ * @param type DPI_CONNTRACK_DELTA_EV_*
+ */
+static void delta_marker(struct dpi_conntrack_ring_event *ev, u32 type) {
+    memset(ev, 0, sizeof(*ev));
+
+    ev->timestamp = ktime_get_ns();
+    ev->type = type;
+}
+
+/**
+ * Есть ли данные для read()
+ *
+ * @param rd
+ * @return
+ */
+static bool delta_pending(struct delta_reader *rd) {
+    return rd->resync || rd->full || (READ_ONCE(rd->d->head) != rd->seq);
+}
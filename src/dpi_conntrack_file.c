@@ -1,164 +1,308 @@
 #include <linux/crc32.h>
+#include <linux/jhash.h>
+#include <linux/slab.h>
 #include <linux/rcupdate.h>
+#include <linux/rhashtable.h>
 
 #include "dpi_conntrack_ko.h"
 
 /* seed для вычисления hash на основе CRC32 */
 #define HASH_CRC_SEED   0xEDB88320
 
+/* Ключ поиска "файла": имя с заранее вычисленными длиной и hash */
+struct file_key {
+    const char *name;
+    u32 len;
+    u32 hash;
+};
+
 /* Предварительное объявление локальных функций модуля */
-static struct dpi_conntrack_file *file_find_rcu(struct dpi_conntrack_net *pernet, 
-                                                const char *name, size_t len, 
-                                                u32 hash);
+static u32 file_key_hashfn(const void *data, u32 len, u32 seed);
+static u32 file_obj_hashfn(const void *data, u32 len, u32 seed);
+static int file_obj_cmpfn(struct rhashtable_compare_arg *arg, const void *obj);
+static void file_key_init(struct file_key *key, const char *name);
+
+/* Память под "файлы" */
+static struct kmem_cache *file_cachep __read_mostly;
+
+/* Последнее выданное поколение регистрации "файла" */
+static atomic64_t file_gen = ATOMIC64_INIT(0);
+
+/* Параметры таблицы "файлов" (размер меняется по мере регистрации) */
+static const struct rhashtable_params file_params = {
+    .head_offset         = offsetof(struct dpi_conntrack_file, node),
+    .hashfn              = file_key_hashfn,
+    .obj_hashfn          = file_obj_hashfn,
+    .obj_cmpfn           = file_obj_cmpfn,
+    .automatic_shrinking = true,
+};
+
 /**
  * Вычисление hash-значения по ASCIZ-строке
- * 
+ *
  * @param file
- * @return 
+ * @return
  */
 static inline u32 string_hash(const char *s, size_t len) {
     return crc32(HASH_CRC_SEED, s, len);
 }
 
+/**
+ * Создание кэша памяти для "файлов"
+ *
+ * @return
+ */
+int __init dpi_conntrack_file_startup(void) {
+    file_cachep = KMEM_CACHE(dpi_conntrack_file, 0);
+
+    return file_cachep ? 0 : -ENOMEM;
+}
+
+/**
+ * Удаление кэша памяти для "файлов"
+ *
+ * NB!
+ * Вызывается после освобождения всех "файлов" (rcu_barrier)
+ */
+void dpi_conntrack_file_cleanup(void) {
+    /* Дожидаемся освобождения снимков, освобожденных вместе с "файлами" */
+    rcu_barrier();
+
+    kmem_cache_destroy(file_cachep);
+}
+
+/**
+ * Инициализация таблицы "файлов" netns
+ *
+ * @param pernet
+ * @return
+ */
+int dpi_conntrack_files_init(struct dpi_conntrack_net *pernet) {
+    mutex_init(&pernet->files_lock);
+
+    return rhashtable_init(&pernet->files, &file_params);
+}
+
+/**
+ * Удаление таблицы "файлов" netns
+ *
+ * @param pernet
+ * @param release вызывается для каждого оставшегося в таблице "файла"
+ * @param arg второй аргумент release
+ *
+ * NB!
+ * Вызов может приостанавливать выполнение!
+ */
+void dpi_conntrack_files_destroy(struct dpi_conntrack_net *pernet,
+                                 void (*release)(void *ptr, void *arg), void *arg) {
+    rhashtable_free_and_destroy(&pernet->files, release, arg);
+}
 
 /**
  * Создать новый элемент только в том случае, если он еще не существует
- * 
+ *
  * @param net
  * @param pernet
  * @param name
- * @return 
- * 
+ * @param match скомпилированный фильтр "файла"
+ * @return -ENAMETOOLONG, если имя не помещается в "файл"
+ *
  * Данный вызов всегда должен выполняться в окружении
  * rcu_read_lock();
  * rcu_read_unlock();
  */
 int dpi_conntrack_file_new_rcu(struct net *net,
-                               struct dpi_conntrack_net *pernet, 
+                               struct dpi_conntrack_net *pernet,
                                const char *name,
+                               const struct dpi_conntrack_match *match,
                                struct dpi_conntrack_file **df) {
-    size_t len = strlen(name);
-    u32 hash = string_hash(name, len);
-    
-    /* Попытаться найти существующий элемент */
-    struct dpi_conntrack_file *f = file_find_rcu(pernet, name, len, hash);
-    
-    if(f) {
+    struct dpi_conntrack_file *f;
+    struct file_key key;
+    int rv;
+
+    file_key_init(&key, name);
+
+    if(key.len >= DPI_CONNTRACK_NAME_MAX) {
+        /* Имя хранится в самом элементе */
+        return -ENAMETOOLONG;
+    }
+
+    if(rhashtable_lookup_fast(&pernet->files, &key, file_params)) {
         /* Был найден существующий элемент, это ошибка! */
         return -EEXIST;
     }
 
     /* Элемента с таким именем не существует, создаем новый */
-    f = kzalloc(sizeof(struct dpi_conntrack_file), GFP_ATOMIC);
-    
+    f = kmem_cache_zalloc(file_cachep, GFP_ATOMIC);
+
     if(NULL == f) {
         /* Память не выделена */
         return -ENOMEM;
     }
-    
-    /* Выделяем память для хранения имени */
-    f->name = kmalloc(len + 1, GFP_ATOMIC);
-    
-    if(NULL == f->name) {
-        /* Память не выделена */
-        kfree(f);
-        
-        return -ENOMEM;
+
+    /* Копируем имя (ограничитель - из обнуленной памяти) */
+    memcpy(f->name, name, key.len);
+
+    f->len = key.len;
+    f->hash = key.hash;
+
+    /* Фильтр должен быть заполнен до появления элемента в таблице */
+    f->match = *match;
+
+    /* Индекс conntrack пока пуст */
+    INIT_LIST_HEAD(&f->index);
+    spin_lock_init(&f->index_lock);
+    atomic_set(&f->count, 0);
+
+    mutex_init(&f->snap_lock);
+
+    /* Ссылка на netns без увеличения кол-ва использований: иначе net_exit не
+     * выполнялся бы, пока есть "файлы", а оставшиеся "файлы" освобождаются
+     * именно в net_exit
+     */
+    f->net = net;
+
+    /* Отличает эту регистрацию от прежних с тем же адресом или именем */
+    f->gen = atomic64_inc_return(&file_gen);
+
+    /* Добавляем вновь созданный элемент в таблицу (если его не успели добавить параллельно).
+     * При заданном obj_hashfn вставка возможна только с ключом поиска.
+     */
+    if(0 != (rv = rhashtable_lookup_insert_key(&pernet->files, &key, &f->node, file_params))) {
+        kmem_cache_free(file_cachep, f);
+
+        return rv;
     }
-    
-    /* Копируем имя */
-    memcpy(f->name, name, len);
-
-    /* Ограничитель имени */
-    *(f->name + len) = 0;
-
-    /* В данный момент элемент еще не находится в таблице */
-    INIT_HLIST_NODE(&f->link);
-    
-    /* Ссылка на netns (с увеличением кол-ва использований) */
-    f->net = get_net(net);
-    
-    /* Доступ на запись к pernet->files */
-    spin_lock(&pernet->lock);
-
-    /* Добавляем вновь созданный элемент в таблицу */
-    hash_add_rcu(pernet->files, &f->link, hash);
-    
-    /* Окончание доступа на запись к pernet->files */
-    spin_unlock(&pernet->lock);
-    
+
     /* Возвращаем вновь созданный и добавленный в hash-таблицу элемент */
     rcu_assign_pointer(*df, f);
-    
+
     /* Ошибок не обнаружено */
     return 0;
 }
 
+/**
+ * Удалить элемент из таблицы
+ *
+ * @param pernet
+ * @param f
+ *
+ * @return -ENOENT, если элемент уже удален (например, параллельным вызовом)
+ *
+ * Память освобождается вызывающим после истечения grace period.
+ */
+int dpi_conntrack_file_remove(struct dpi_conntrack_net *pernet, struct dpi_conntrack_file *f) {
+    return rhashtable_remove_fast(&pernet->files, &f->node, file_params);
+}
+
 /**
  * Освобождение ресурсов
- * 
+ *
  * @param f
  */
 void dpi_conntrack_file_free(struct dpi_conntrack_file *f) {
-    /* Нет ссылки на netns */
-    put_net(f->net);
-    
-    /* Освобождаем память из-под имени "файла" */
-    kfree(f->name);
-    
+    /* Освобождаем элементы индекса conntrack */
+    dpi_conntrack_index_free(f);
+
+    if(f->ring) {
+        /* Буферы событий освобождаются после удаления всех отображений */
+        dpi_conntrack_ring_put(f->ring);
+    }
+
+    if(f->delta) {
+        /* Дескрипторы <name>.delta закрыты при удалении из procfs */
+        dpi_conntrack_delta_free(f->delta);
+    }
+
+    if(f->sketch) {
+        /* Дескрипторы <name>.distinct закрыты при удалении из procfs */
+        dpi_conntrack_sketch_free(f->sketch);
+    }
+
+    /* Снимок освобождается по истечении еще одного grace period */
+    dpi_conntrack_snapshot_drop(f);
+
+    /* Результат поиска helper фильтра */
+    kfree(rcu_dereference_protected(f->helpers, 1));
+
     /* Освобождаем память от данной структуры */
-    kfree(f);
+    kmem_cache_free(file_cachep, f);
 }
 
 /**
- * 
+ *
  * @param pernet
  * @param name
- * @return 
- * 
+ * @return
+ *
  * Данный вызов всегда должен выполняться в окружении
  * rcu_read_lock();
  * rcu_read_unlock();
  */
-struct dpi_conntrack_file *dpi_conntrack_file_find_rcu(struct dpi_conntrack_net *pernet, 
+struct dpi_conntrack_file *dpi_conntrack_file_find_rcu(struct dpi_conntrack_net *pernet,
                                                        const char *name) {
-    size_t len = strlen(name);
-    u32 hash = string_hash(name, len);
-    
+    struct file_key key;
+
+    file_key_init(&key, name);
+
     /* Попытаться найти существующий элемент */
-    return file_find_rcu(pernet, name, len, hash);
+    return rhashtable_lookup_fast(&pernet->files, &key, file_params);
 }
 
-
 /**
- * Реализация поиска значения в hash-таблице
- * 
- * @param pernet
+ * Заполнение ключа поиска по имени
+ *
+ * @param key
  * @param name
+ */
+static void file_key_init(struct file_key *key, const char *name) {
+    key->name = name;
+    key->len = strlen(name);
+    key->hash = string_hash(name, key->len);
+}
+
+/**
+ * hash ключа поиска (struct file_key)
+ *
+ * @param data
  * @param len
- * @param hash
- * @return 
- * 
- * Данный вызов всегда должен выполняться в окружении
- * rcu_read_lock();
- * rcu_read_unlock();
+ * @param seed
+ * @return
  */
-static struct dpi_conntrack_file *file_find_rcu(struct dpi_conntrack_net *pernet, 
-                                                const char *name, size_t len, 
-                                                u32 hash) {
-    struct dpi_conntrack_file *f;
-    
-    /* Выборка из таблицы по совпадению hash-значения */
-    hash_for_each_possible_rcu(pernet->files, f, link, hash) {
-        /* Проверяем на точное совпадение длины имени */
-        if(strlen(f->name) == len) {
-            /* Проверяем на точное совпадение имени */
-            if(0 == memcmp(f->name, name, len)) {
-                /* Возвращаем уже существующий элемент */
-                return f;
-            }
-        }
+static u32 file_key_hashfn(const void *data, u32 len, u32 seed) {
+    const struct file_key *key = data;
+
+    return jhash_2words(key->hash, key->len, seed);
+}
+
+/**
+ * hash элемента таблицы (по сохраненным при создании длине и hash имени)
+ *
+ * @param data
+ * @param len
+ * @param seed
+ * @return
+ */
+static u32 file_obj_hashfn(const void *data, u32 len, u32 seed) {
+    const struct dpi_conntrack_file *f = data;
+
+    return jhash_2words(f->hash, f->len, seed);
+}
+
+/**
+ * Сравнение ключа поиска с элементом таблицы
+ *
+ * @param arg
+ * @param obj
+ * @return 0 при совпадении
+ */
+static int file_obj_cmpfn(struct rhashtable_compare_arg *arg, const void *obj) {
+    const struct file_key *key = arg->key;
+    const struct dpi_conntrack_file *f = obj;
+
+    if((f->hash != key->hash) || (f->len != key->len)) {
+        return 1;
     }
-    
-    return NULL;
+
+    return memcmp(f->name, key->name, key->len);
 }
@@ -13,28 +13,447 @@
 #include <net/net_namespace.h>
 #include <linux/spinlock.h>
 #include <linux/hashtable.h>
+#include <linux/rhashtable.h>
 #include <linux/rcupdate.h>
+#include <linux/rculist.h>
+#include <linux/wait.h>
+#include <linux/jump_label.h>
+#include <linux/percpu.h>
+#include <linux/kref.h>
+#include <linux/mutex.h>
 
+#include <net/netfilter/nf_conntrack.h>
+#include <net/netfilter/nf_conntrack_helper.h>
+#include <net/netfilter/nf_conntrack_ecache.h>
 
 /* Public API */
 #include "../include/dpi_conntrack.h"
 
-/* Кол-во buckets в hashtable */
-#define FILES_HASHTABLE_BITS 2
+/* Отладочный вывод включается параметром модуля debug (static key) */
+DECLARE_STATIC_KEY_FALSE(dpi_conntrack_debug_key);
+
+#define dpi_conntrack_debug(fmt, ...)                           \
+    do {                                                        \
+        if(static_branch_unlikely(&dpi_conntrack_debug_key)) {  \
+            pr_info(fmt, ##__VA_ARGS__);                        \
+        }                                                       \
+    } while(0)
+
+/* Кол-во интервалов гистограммы длительности обхода (log2, мкс) */
+#define DPI_STATS_LATENCY_SLOTS 24
+
+/* Файлы /proc/net/dpi, не являющиеся "файлами" (их имена зарезервированы) */
+#define PROC_NET_DPI_STATS      "stats"
+#define PROC_NET_DPI_CONTROL    "control"
 
 struct dpi_conntrack_net;
 
-struct dpi_conntrack_file {
-    /* Для хранения элемента в hashtable */
-    struct hlist_node link;
+/*
+ * Счетчики одного CPU (/proc/net/dpi/stats). Увеличиваются this_cpu_*
+ * без блокировок, при чтении файла суммируются по всем CPU.
+ */
+struct dpi_conntrack_stats {
+    /* Начато обходов (не считая продолжений с сохраненной позиции) */
+    u64 dumps;
+    /* Просмотрено bucket таблицы conntrack */
+    u64 buckets;
+    /* Просмотрено conntrack (элементов таблицы или индекса) */
+    u64 visited;
+    /* Найдено подходящих conntrack */
+    u64 matches;
+    /* Перезапусков цепочки в ct_get_next (nulls другого bucket) */
+    u64 restarts;
+    /* Выдано байт (двоичный "файл", netlink) */
+    u64 bytes;
+    /* Не удалось выделить память под состояние обхода или элемент индекса */
+    u64 alloc_failed;
+    u64 registered;
+    u64 unregistered;
+    /* Гистограмма длительности полного обхода */
+    u64 latency[DPI_STATS_LATENCY_SLOTS];
+    /* Обход таблицы conntrack прерван по исчерпанию бюджета участка */
+    u64 yields;
+    /* Гистограмма длительности участков обхода таблицы (в окружении rcu_read_lock) */
+    u64 chunk[DPI_STATS_LATENCY_SLOTS];
+    /* Обход продолжен по таблице conntrack нового размера */
+    u64 resyncs;
+    /* Удалено или изменено время жизни (DPI_CONNTRACK_CMD_FLUSH) */
+    u64 flushed;
+};
+
+#define dpi_conntrack_stats_inc(stats, field)       this_cpu_inc((stats)->field)
+#define dpi_conntrack_stats_add(stats, field, n)    this_cpu_add((stats)->field, (n))
+
+/*
+ * Кольцевые буферы событий "файла" (по одному на CPU, отображаются в
+ * userspace через mmap файла <name>.ring)
+ */
+struct dpi_conntrack_ring {
+    /* Счетчик использований ("файл", открытые дескрипторы, отображения) */
+    atomic_t refs;
+    /* Область vmalloc_user с буферами всех CPU */
+    void *area;
+    /* Размер буфера одного CPU (вместе с управляющей страницей) */
+    size_t ring_size;
+    unsigned int nr_rings;
+    /* Кол-во элементов в буфере (степень 2) */
+    unsigned int nr_events;
+    /* Ожидающие событий в poll() */
+    wait_queue_head_t wait;
+};
+
+/*
+ * Журнал изменений "файла" для читателей <name>.delta: последние nr_events
+ * событий conntrack, событие с номером N находится в элементе N & (nr_events - 1)
+ */
+struct dpi_conntrack_delta {
+    /* Для записи событий и их копирования читателями */
+    spinlock_t lock;
+    /* Ожидающие изменений в read() и poll() */
+    wait_queue_head_t wait;
+    /* Номер следующего события */
+    u64 head;
+    /* Кол-во элементов (степень 2) */
+    unsigned int nr_events;
+    struct dpi_conntrack_ring_event ev[];
+};
+
+/*
+ * Оценки кол-ва различных адресов и портов conntrack "файла" (HyperLogLog,
+ * набор регистров на каждом CPU, объединяются при чтении <name>.distinct)
+ */
+struct dpi_conntrack_sketch {
+    /* Кол-во бит номера регистра (1 << bits регистров на оценку) */
+    unsigned int bits;
+    /* Случайная составляющая hash (общая для всех CPU) */
+    u32 seed;
+    /* Регистры всех оценок одного CPU */
+    u8 __percpu *regs;
+};
+
+/*
+ * Скомпилированный фильтр "файла": диапазоны портов отсортированы и
+ * объединены, порядок проверок определяется flags.
+ */
+struct dpi_conntrack_match {
+    /* DPI_CONNTRACK_FILTER_* */
+    u32 flags;
+    /* Фильтр совпадает с helper по имени "файла" - используется индекс */
+    bool indexed;
+    unsigned int nr_helpers;
+    char helpers[DPI_CONNTRACK_FILTER_HELPERS_MAX][NF_CT_HELPER_NAME_LEN];
+    u8 l3num;
+    u8 protonum;
+    u16 zone;
+    u32 mark;
+    u32 mark_mask;
+    u32 status;
+    u32 status_mask;
+    unsigned int nr_sport;
+    struct dpi_conntrack_port_range sport[DPI_CONNTRACK_FILTER_PORTS_MAX];
+    unsigned int nr_dport;
+    struct dpi_conntrack_port_range dport[DPI_CONNTRACK_FILTER_PORTS_MAX];
+};
+
+/* Критерии фильтра дескриптора */
+#define DPI_FD_FILTER_SRC       0x0001
+#define DPI_FD_FILTER_DST       0x0002
+#define DPI_FD_FILTER_SPORT     0x0004
+#define DPI_FD_FILTER_DPORT     0x0008
+#define DPI_FD_FILTER_ZONE      0x0010
+
+/* Кортеж, с которым сравниваются адреса и порты фильтра дескриптора */
+#define DPI_FD_FILTER_DIR_ORIGINAL  0
+#define DPI_FD_FILTER_DIR_REPLY     1
+#define DPI_FD_FILTER_DIR_ANY       2
+
+/* Адрес (IPv4 - в lo) в порядке байт машины, для сравнения как 128-бит числа */
+struct dpi_conntrack_addr {
+    u64 hi;
+    u64 lo;
+};
+
+/* Диапазон адресов префикса (включительно) */
+struct dpi_conntrack_addr_range {
+    struct dpi_conntrack_addr first;
+    struct dpi_conntrack_addr last;
+};
+
+/* Префиксы одного семейства: диапазоны отсортированы и не пересекаются */
+struct dpi_conntrack_prefixes {
+    unsigned int nr;
+    unsigned int size;
+    struct dpi_conntrack_addr_range *range;
+};
+
+/*
+ * Фильтр, записанный в открытый дескриптор "файла" (дополняет фильтр
+ * "файла"). Префиксы - по семействам: [0] - IPv4, [1] - IPv6.
+ */
+struct dpi_conntrack_fd_filter {
+    /* DPI_FD_FILTER_* */
+    u32 flags;
+    /* DPI_FD_FILTER_DIR_* */
+    u8 dir;
+    u16 zone;
+    struct dpi_conntrack_prefixes src[2];
+    struct dpi_conntrack_prefixes dst[2];
+    unsigned int nr_sport;
+    struct dpi_conntrack_port_range sport[DPI_CONNTRACK_FILTER_PORTS_MAX];
+    unsigned int nr_dport;
+    struct dpi_conntrack_port_range dport[DPI_CONNTRACK_FILTER_PORTS_MAX];
+};
+
+/*
+ * Зарегистрированные helper с именами из фильтра (сравнение conntrack
+ * выполняется по указателю). Действителен, пока не изменилось поколение
+ * набора helper (загрузка/выгрузка модулей, появление неизвестного helper).
+ */
+struct dpi_conntrack_helpers {
+    /* Для kfree_rcu */
+    struct rcu_head rcu;
+    /* Поколение, для которого выполнен поиск */
+    int gen;
+    unsigned int nr;
+    const struct nf_conntrack_helper *helper[];
+};
+
+/* Буфер записей снимка */
+struct dpi_conntrack_snapshot_chunk {
+    struct dpi_conntrack_bin_record *rec;
+    size_t nr;
+};
+
+/*
+ * Снимок записей "файла" (результат обхода, общий для нескольких читателей).
+ * 
+ * Не изменяется после построения. Освобождается после освобождения последней
+ * ссылки и истечения grace period.
+ */
+struct dpi_conntrack_snapshot {
+    struct kref ref;
     /* Для call_rcu, чтобы освобождать ресурс после истечения grace period */
     struct rcu_head rcu;
-    /* Имя "Файла" */
-    char *name;
-    /* Мы также храним ссылку на netns (с увеличением счетчика использований!) */
+    /* Поколение (0 - снимок не сохранялся в "файле") */
+    u64 generation;
+    /* Время построения, нс (ktime_get_ns) */
+    u64 built;
+    /* Общее кол-во записей */
+    size_t nr;
+    /* Записи выдаются по буферам в порядке их следования */
+    unsigned int nr_chunks;
+    struct dpi_conntrack_snapshot_chunk chunk[];
+};
+
+/* Элемент результата DPI_CONNTRACK_CMD_TOP */
+struct dpi_conntrack_top_entry {
+    /* Значение, по которому упорядочены conntrack (DPI_CONNTRACK_TOP_*) */
+    u64 value;
+    struct dpi_conntrack_bin_record record;
+};
+
+/*
+ * N наибольших conntrack "файла" (куча во время обхода, по его окончании -
+ * массив по убыванию значения)
+ */
+struct dpi_conntrack_top {
+    /* DPI_CONNTRACK_TOP_* */
+    u32 key;
+    /* Размер кучи и кол-во элементов в ней */
+    u32 max;
+    u32 nr;
+    struct dpi_conntrack_top_entry entries[];
+};
+
+struct dpi_conntrack_file {
+    /* Для хранения элемента в rhashtable pernet->files */
+    struct rhash_head node;
+    /* Для освобождения группы "файлов" после одного grace period */
+    struct list_head release;
+    /* Длина имени и его hash (ключ поиска в pernet->files) */
+    u32 len;
+    u32 hash;
+    /* Имя "Файла" (хранится в самом элементе) */
+    char name[DPI_CONNTRACK_NAME_MAX];
+    /* Ссылка на netns (без увеличения счетчика использований: "файлы" netns
+     * освобождаются в net_exit)
+     */
     struct net *net;
+    /* Поколение регистрации: уникально для каждой регистрации, в отличие
+     * от адреса (память снятого с регистрации элемента переиспользуется)
+     */
+    u64 gen;
   
     struct proc_dir_entry *pde;
+    /* Двоичный "файл" <name>.bin */
+    struct proc_dir_entry *pde_bin;
+    /* "Файл" кольцевых буферов событий <name>.ring (если буферы созданы) */
+    struct proc_dir_entry *pde_ring;
+    
+    /* Кольцевые буферы событий (NULL - не используются) */
+    struct dpi_conntrack_ring __rcu *ring;
+    /* Журнал изменений для <name>.delta (NULL - не используется) */
+    struct dpi_conntrack_delta __rcu *delta;
+    /* "Файл" журнала изменений <name>.delta (если журнал создан) */
+    struct proc_dir_entry *pde_delta;
+    /* "Файлы" итогов <name>.summary и кол-ва conntrack <name>.count */
+    struct proc_dir_entry *pde_summary;
+    struct proc_dir_entry *pde_count;
+    /* "Файл" оценок итогов по выборке <name>.estimate */
+    struct proc_dir_entry *pde_estimate;
+    /* Оценки кол-ва различных значений (NULL - не используются) и их "файл"
+     * <name>.distinct
+     */
+    struct dpi_conntrack_sketch __rcu *sketch;
+    struct proc_dir_entry *pde_distinct;
+    
+    /* Фильтр conntrack "файла" */
+    struct dpi_conntrack_match match;
+    /* Найденные helper фильтра (NULL - поиск еще не выполнялся) */
+    struct dpi_conntrack_helpers __rcu *helpers;
+    
+    /* Список элементов индекса conntrack, использующих helper с именем name */
+    struct list_head index;
+    /* Для изменения списка index и признака dead (в т.ч. из softirq!) */
+    spinlock_t index_lock;
+    /* Порядковый номер следующего элемента индекса (под index_lock) */
+    u64 index_seq;
+    /* Кол-во элементов в индексе (включая еще не удаленные устаревшие) */
+    atomic_t count;
+    /* Элемент снят с регистрации, добавлять его в индекс больше нельзя */
+    bool dead;
+    
+    /* Сохраненный снимок записей (NULL - отсутствует) */
+    struct dpi_conntrack_snapshot __rcu *snap;
+    /* Для построения и замены снимка */
+    struct mutex snap_lock;
+    /* Поколение последнего построенного снимка */
+    u64 snap_gen;
+};
+
+/*
+ * Элемент индекса conntrack: связь nf_conn с "файлом" для его helper.
+ * 
+ * Счетчик использований nf_conn не увеличивается, поэтому перед использованием
+ * элемент проверяется (nf_conn размещаются в SLAB_DESTROY_BY_RCU и могут
+ * быть переиспользованы в пределах rcu_read_lock).
+ */
+struct dpi_conntrack_index_entry {
+    /* Для хранения элемента в rhashtable pernet->index (поиск по nf_conn) */
+    struct rhash_head node;
+    /* Для хранения элемента в списке f->index (обход при чтении "файла") */
+    struct list_head list;
+    /* Для kfree_rcu */
+    struct rcu_head rcu;
+    /* "Файл", к которому относится элемент */
+    struct dpi_conntrack_file *f;
+    /* Ссылка на conntrack (без увеличения счетчика использований!) */
+    struct nf_conn *ct;
+    /* Кортеж conntrack на момент добавления в индекс */
+    struct nf_conntrack_tuple tuple;
+    /* Порядковый номер в "файле" (в списке f->index номера возрастают) */
+    u64 seq;
+};
+
+/* Итератор обхода conntrack "файла" (по индексу или по таблице conntrack) */
+struct dpi_iterator {
+    /* Обход выполняется по индексу conntrack "файла" */
+    bool indexed;
+    /* Текущий элемент индекса conntrack (если индекс поддерживается) */
+    struct dpi_conntrack_index_entry *entry;
+    /* Таблица conntrack, по которой идет обход (адрес и размер согласованы),
+     * и ее поколение (net->ct.generation меняется при изменении размера)
+     */
+    struct hlist_nulls_head *hash;
+    unsigned int htable_size;
+    unsigned int generation;
+    unsigned int bucket;
+    struct hlist_nulls_node *head;
+    /* Кортеж исходного направления head на момент проверки фильтра */
+    struct nf_conntrack_tuple tuple;
+    /* Номер head в цепочке bucket */
+    unsigned int chain_pos;
+    /* Таблица заменена: head == NULL, обход продолжается по новой таблице */
+    bool resized;
+    /* Цепочка текущего bucket перезапускалась (nulls другого bucket) */
+    bool restarted;
+    /* Выдано conntrack (отпечатки в cursor->seen), из них отсортировано */
+    unsigned int nr_seen;
+    unsigned int nr_sorted;
+    /* nr_seen при входе в текущий bucket */
+    unsigned int bucket_seen;
+    /* Отпечаток не поместился в cursor->seen (повторы не исключить) */
+    bool seen_lost;
+    /* Бюджет участка исчерпан: head == NULL, обход продолжается с начала bucket */
+    bool stalled;
+    /* Просмотрено bucket в текущем участке */
+    unsigned int chunk_buckets;
+    /* Время начала текущего участка, нс */
+    u64 chunk_started;
+    /* Счетчики netns обхода */
+    struct dpi_conntrack_stats __percpu *stats;
+};
+
+/*
+ * Курсор обхода conntrack "файла" (seq_file->private, состояние dump netlink).
+ * 
+ * Сохраняется между dpi_conntrack_iter_stop() и dpi_conntrack_iter_start(),
+ * поэтому при последовательном чтении обход продолжается с места остановки,
+ * а не повторяется с начала таблицы.
+ */
+struct dpi_conntrack_cursor {
+    /* Наша управляющая структура */
+    struct dpi_conntrack_file *f;
+    /* Поколение регистрации f: если "файл" не удерживается (!preemptible),
+     * найденный заново "файл" сравнивается по нему, а не по адресу
+     */
+    u64 gen;
+    /* Итератор (действителен только между iter_start и iter_stop) */
+    struct dpi_iterator i;
+    /* Позиция текущего элемента итератора */
+    loff_t pos;
+    
+    /* Позиция сохранена при вызове dpi_conntrack_iter_stop() */
+    bool saved;
+    /* Обход был завершен (сохраненная позиция за последним элементом) */
+    bool eof;
+    /* Обход прекращен до конца таблицы: после изменения ее размера повторы
+     * не исключить (отпечатки не поместились в seen), выдача неполна
+     */
+    bool lost;
+    /* Позиция, на которой был остановлен обход */
+    loff_t saved_pos;
+    /* conntrack, на котором был остановлен обход (без увеличения счетчика
+     * использований - используется только для сравнения!)
+     */
+    struct nf_conn *ct;
+    /* Его кортеж для проверки того, что nf_conn не был переиспользован */
+    struct nf_conntrack_tuple tuple;
+    /* Порядковый номер элемента индекса, на котором был остановлен обход */
+    u64 seq;
+    /* Время начала текущего обхода, нс (0 - обход завершен) */
+    u64 started;
+    /* Вызывающий допускает снятие rcu_read_lock между участками обхода
+     * ("файл" не может быть освобожден, выполнение может приостанавливаться)
+     */
+    bool preemptible;
+    /* Обход прерван по исчерпанию бюджета участка (только !preemptible):
+     * итератор вернул NULL, но это не конец обхода
+     */
+    bool yield;
+    /* Снимок, из которого выдаются записи (только для двоичного "файла",
+     * NULL - записи выдаются обходом)
+     */
+    struct dpi_conntrack_snapshot *snap;
+    /* Отпечатки conntrack, выданных текущим обходом таблицы (для исключения
+     * повторов после изменения ее размера), seen_cap - размер буфера
+     */
+    u32 *seen;
+    unsigned int seen_cap;
+    /* Фильтр, записанный в дескриптор (NULL - только фильтр "файла").
+     * Заменяется под блокировкой seq_file, поэтому не меняется во время обхода
+     */
+    struct dpi_conntrack_fd_filter *ff;
 };
 
 /*
@@ -45,29 +464,193 @@ struct dpi_conntrack_net {
     /* Ссылка на каталог PROC_NET_DPI ("/proc/net/dpi") */
     struct proc_dir_entry *proc_dpi;
     
-    /* Для доступа на запись к полю files */
-    spinlock_t lock;
-    /* hash-таблица для хранения структур dpi_conntrack_file */
-    DECLARE_HASHTABLE(files, FILES_HASHTABLE_BITS);
+    /* Таблица зарегистрированных структур dpi_conntrack_file (размер
+     * меняется вместе с кол-вом элементов, запись - под собственными блокировками)
+     */
+    struct rhashtable files;
+    /* Регистрация и снятие с регистрации "файлов" (проверка имен, создание
+     * и удаление файлов procfs) выполняются последовательно
+     */
+    struct mutex files_lock;
+    
+    /* Индекс поддерживается уведомлениями conntrack для данной netns */
+    bool events;
+    /* Таблица элементов индекса conntrack по указателю на nf_conn (размер
+     * меняется вместе с кол-вом элементов)
+     */
+    struct rhashtable index;
+    
+    /* Счетчики (по одному набору на CPU) */
+    struct dpi_conntrack_stats __percpu *stats;
     
+    /* Метаданные классификации conntrack (по указателю на nf_conn) */
+    struct rhashtable meta;
 };
 
+/**
+ * Получить helper, назначенный conntrack
+ * 
+ * @param ct
+ * @return NULL, если helper отсутствует
+ * 
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+static inline struct nf_conntrack_helper *dpi_conntrack_helper_rcu(const struct nf_conn *ct) {
+    struct nf_conn_help *help = nfct_help(ct);
+    
+    return help ? rcu_dereference(help->helper) : NULL;
+}
+
 /* netns.c */
 int __init dpi_conntrack_netns_startup(void);
 void dpi_conntrack_netns_cleanup(void);
 struct dpi_conntrack_net *dpi_conntrack_pernet(struct net *net);
 
 /* dpi_conntrack_file.c */
+int __init dpi_conntrack_file_startup(void);
+void dpi_conntrack_file_cleanup(void);
+int dpi_conntrack_files_init(struct dpi_conntrack_net *pernet);
+void dpi_conntrack_files_destroy(struct dpi_conntrack_net *pernet,
+                                 void (*release)(void *ptr, void *arg), void *arg);
 int dpi_conntrack_file_new_rcu(struct net *net,
                                struct dpi_conntrack_net *pernet, 
                                const char *name,
+                               const struct dpi_conntrack_match *match,
                                struct dpi_conntrack_file **df);
 struct dpi_conntrack_file *dpi_conntrack_file_find_rcu(struct dpi_conntrack_net *pernet, 
                                                        const char *name);
+int dpi_conntrack_file_remove(struct dpi_conntrack_net *pernet, struct dpi_conntrack_file *f);
 void dpi_conntrack_file_free(struct dpi_conntrack_file *f);
 
+/* filter.c */
+int __init dpi_conntrack_filter_startup(void);
+void dpi_conntrack_filter_cleanup(void);
+int dpi_conntrack_filter_compile(struct dpi_conntrack_match *m, const char *name,
+                                 const struct dpi_conntrack_filter *filter);
+void dpi_conntrack_filter_refresh_rcu(struct dpi_conntrack_file *f, bool force);
+void dpi_conntrack_filter_invalidate(void);
+int dpi_conntrack_filter_helper_rcu(const struct dpi_conntrack_file *f,
+                                    const struct nf_conntrack_helper *helper);
+int dpi_conntrack_filter_match_rcu(const struct dpi_conntrack_file *f, const struct nf_conn *ct);
+struct dpi_conntrack_fd_filter *dpi_conntrack_fd_filter_parse(char *text);
+void dpi_conntrack_fd_filter_free(struct dpi_conntrack_fd_filter *ff);
+int dpi_conntrack_fd_filter_match_rcu(const struct dpi_conntrack_fd_filter *ff, const struct nf_conn *ct);
+
+/* events.c */
+int dpi_conntrack_events_register(struct net *net);
+void dpi_conntrack_events_unregister(struct net *net);
+
+/* index.c */
+int dpi_conntrack_index_init(struct dpi_conntrack_net *pernet);
+void dpi_conntrack_index_exit(struct dpi_conntrack_net *pernet);
+void dpi_conntrack_index_update_rcu(struct dpi_conntrack_net *pernet,
+                                    struct dpi_conntrack_file *f,
+                                    struct nf_conn *ct);
+void dpi_conntrack_index_del_rcu(struct dpi_conntrack_net *pernet,
+                                 const struct nf_conn *ct);
+void dpi_conntrack_index_seed(struct dpi_conntrack_file *f);
+void dpi_conntrack_index_seed_net(struct net *net);
+void dpi_conntrack_index_release(struct dpi_conntrack_net *pernet,
+                                 struct dpi_conntrack_file *f);
+void dpi_conntrack_index_free(struct dpi_conntrack_file *f);
+struct dpi_conntrack_index_entry *dpi_conntrack_index_next_rcu(struct dpi_conntrack_file *f,
+                                                               struct dpi_conntrack_index_entry *e);
+struct dpi_conntrack_index_entry *dpi_conntrack_index_find_rcu(struct dpi_conntrack_net *pernet,
+                                                               const struct nf_conn *ct);
+int dpi_conntrack_index_is_valid_rcu(const struct dpi_conntrack_index_entry *e);
+struct dpi_conntrack_file *dpi_conntrack_index_lookup_rcu(struct dpi_conntrack_net *pernet,
+                                                          const struct nf_conn *ct);
+
+/* record.c */
+void dpi_conntrack_record_header(struct dpi_conntrack_bin_header *h);
+int dpi_conntrack_record_fill(struct dpi_conntrack_bin_record *r, struct nf_conn *ct,
+                              const struct nf_conntrack_tuple *tuple,
+                              const struct dpi_conntrack_file *f);
+void dpi_conntrack_record_fill_ct(struct dpi_conntrack_bin_record *r, struct nf_conn *ct);
+
+/* ring.c */
+extern const struct file_operations dpi_conntrack_ring_fops;
+struct dpi_conntrack_ring *dpi_conntrack_ring_new(void);
+void dpi_conntrack_ring_put(struct dpi_conntrack_ring *r);
+void dpi_conntrack_ring_event(struct dpi_conntrack_ring *r, u32 type, struct nf_conn *ct);
+
+/* delta.c */
+extern const struct file_operations dpi_conntrack_delta_fops;
+struct dpi_conntrack_delta *dpi_conntrack_delta_new(void);
+void dpi_conntrack_delta_free(struct dpi_conntrack_delta *d);
+void dpi_conntrack_delta_event(struct dpi_conntrack_delta *d, u32 type, struct nf_conn *ct);
+void dpi_conntrack_delta_shutdown(struct dpi_conntrack_delta *d);
+
+/* summary.c */
+extern const struct file_operations dpi_conntrack_summary_fops;
+extern const struct file_operations dpi_conntrack_count_fops;
+extern const struct file_operations dpi_conntrack_estimate_fops;
+
+/* sketch.c */
+extern const struct file_operations dpi_conntrack_sketch_fops;
+struct dpi_conntrack_sketch *dpi_conntrack_sketch_new(void);
+void dpi_conntrack_sketch_free(struct dpi_conntrack_sketch *s);
+void dpi_conntrack_sketch_add(struct dpi_conntrack_sketch *s, const struct nf_conn *ct);
+
+/* meta.c */
+int dpi_conntrack_meta_init(struct dpi_conntrack_net *pernet);
+void dpi_conntrack_meta_exit(struct dpi_conntrack_net *pernet);
+void dpi_conntrack_meta_del_rcu(struct dpi_conntrack_net *pernet, const struct nf_conn *ct);
+
+/* flush.c */
+int dpi_conntrack_flush(struct net *net, const char *name, bool retime, u32 timeout, u64 *done);
+
+/* top.c */
+struct dpi_conntrack_top *dpi_conntrack_top_run(struct net *net, const char *name, u32 key, u32 n);
+void dpi_conntrack_top_free(struct dpi_conntrack_top *top);
+
+/* iter.c */
+struct dpi_iterator *dpi_conntrack_iter_start(struct dpi_conntrack_cursor *st, loff_t pos);
+struct dpi_iterator *dpi_conntrack_iter_next(struct dpi_conntrack_cursor *st, struct dpi_iterator *i);
+void dpi_conntrack_iter_stop(struct dpi_conntrack_cursor *st, struct dpi_iterator *i);
+struct nf_conn *dpi_conntrack_iter_ct(struct dpi_iterator *i);
+const struct nf_conntrack_tuple *dpi_conntrack_iter_tuple(struct dpi_iterator *i);
+void dpi_conntrack_iter_reserve(struct dpi_conntrack_cursor *st);
+void dpi_conntrack_iter_release(struct dpi_conntrack_cursor *st);
+unsigned int dpi_conntrack_table_rcu(struct net *net, struct hlist_nulls_head **hash, unsigned int *size);
+void dpi_conntrack_scan_prefetch_rcu(struct hlist_nulls_head *hash, unsigned int size, unsigned int bucket);
+
+/* pscan.c */
+int __init dpi_conntrack_pscan_startup(void);
+void dpi_conntrack_pscan_cleanup(void);
+bool dpi_conntrack_pscan_enabled(const struct dpi_conntrack_file *f);
+struct dpi_conntrack_snapshot *dpi_conntrack_pscan_run(struct dpi_conntrack_file *f);
+
+/* snapshot.c */
+struct dpi_conntrack_snapshot *dpi_conntrack_snapshot_new(unsigned int nr_chunks);
+void dpi_conntrack_snapshot_put(struct dpi_conntrack_snapshot *s);
+const struct dpi_conntrack_bin_record *dpi_conntrack_snapshot_record(const struct dpi_conntrack_snapshot *s,
+                                                                     loff_t idx);
+struct dpi_conntrack_snapshot *dpi_conntrack_snapshot_get(struct dpi_conntrack_file *f);
+void dpi_conntrack_snapshot_drop(struct dpi_conntrack_file *f);
+
+/* stats.c */
+int dpi_conntrack_stats_init(struct dpi_conntrack_net *pernet);
+void dpi_conntrack_stats_exit(struct dpi_conntrack_net *pernet);
+void dpi_conntrack_stats_latency(struct dpi_conntrack_stats __percpu *stats, u64 ns);
+void dpi_conntrack_stats_chunk(struct dpi_conntrack_stats __percpu *stats, u64 ns);
+
+/* control.c */
+int dpi_conntrack_control_init(struct dpi_conntrack_net *pernet, struct net *net);
+void dpi_conntrack_control_exit(struct dpi_conntrack_net *pernet);
+
+/* netlink.c */
+int __init dpi_conntrack_netlink_startup(void);
+void dpi_conntrack_netlink_cleanup(void);
+
 /* procfs.c */
-void dpi_conntrack_procfs_unregister_file(struct dpi_conntrack_file *f);
+void dpi_conntrack_procfs_release_file(struct dpi_conntrack_file *f, struct list_head *files);
+void dpi_conntrack_procfs_destroy_files(struct list_head *files);
+int dpi_conntrack_procfs_register_files(struct net *net, char * const *names, unsigned int nr);
+int dpi_conntrack_procfs_unregister_files(struct net *net, char * const *names, unsigned int nr);
 
 #endif /* DPI_CONNTRACK_KO_H */
 
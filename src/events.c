@@ -0,0 +1,102 @@
+#include <net/netfilter/nf_conntrack.h>
+#include <net/netfilter/nf_conntrack_ecache.h>
+#include <net/netfilter/nf_conntrack_helper.h>
+
+#include "dpi_conntrack_ko.h"
+
+/* События, при которых conntrack может получить (или сменить) helper */
+#define EVENTS_UPDATE   ((1 << IPCT_NEW) | (1 << IPCT_RELATED) | (1 << IPCT_HELPER))
+
+/* Предварительное объявление локальных функций модуля */
+static int dpi_conntrack_event(unsigned int events, struct nf_ct_event *item);
+
+/* Получатель уведомлений conntrack (общий для всех netns) */
+static struct nf_ct_event_notifier event_notifier = {
+    .fcn = dpi_conntrack_event,
+};
+
+/**
+ * Подписка на уведомления conntrack в указанной netns
+ *
+ * @param net
+ * @return -EBUSY, если уведомления уже получает кто-то другой
+ * (например, nf_conntrack_netlink)
+ */
+int dpi_conntrack_events_register(struct net *net) {
+    return nf_conntrack_register_notifier(net, &event_notifier);
+}
+
+/**
+ * Отмена подписки на уведомления conntrack в указанной netns
+ *
+ * @param net
+ *
+ * NB!
+ * Вызывать только в том случае, если подписка была успешно выполнена,
+ * иначе nf_conntrack_unregister_notifier() выполнит BUG_ON().
+ */
+void dpi_conntrack_events_unregister(struct net *net) {
+    nf_conntrack_unregister_notifier(net, &event_notifier);
+}
+
+/**
+ * Обработка уведомления conntrack
+ *
+ * @param events
+ * @param item
+ * @return
+ *
+ * NB!
+ * Вызывается из nf_conntrack_eventmask_report() в окружении rcu_read_lock,
+ * в т.ч. в контексте softirq.
+ */
+static int dpi_conntrack_event(unsigned int events, struct nf_ct_event *item) {
+    struct nf_conn *ct = item->ct;
+    /* Область в netns для нашей подсистемы */
+    struct dpi_conntrack_net *pernet = dpi_conntrack_pernet(nf_ct_net(ct));
+    struct nf_conntrack_helper *helper = dpi_conntrack_helper_rcu(ct);
+    /* "Файл" с именем helper (если зарегистрирован) */
+    struct dpi_conntrack_file *f = helper ? dpi_conntrack_file_find_rcu(pernet, helper->name) : NULL;
+    struct dpi_conntrack_ring *ring;
+    struct dpi_conntrack_delta *delta;
+    u32 type;
+
+    if(f && !f->match.indexed) {
+        /* "Файл" с фильтром, индекс и буферы событий для него не ведутся */
+        f = NULL;
+    }
+
+    if(f && !dpi_conntrack_filter_helper_rcu(f, helper)) {
+        /* helper с именем "файла" отсутствует среди найденных ранее */
+        dpi_conntrack_filter_invalidate();
+    }
+
+    if(events & (1 << IPCT_DESTROY)) {
+        /* conntrack уничтожается, удаляем его из индекса и его метаданные */
+        dpi_conntrack_index_del_rcu(pernet, ct);
+        dpi_conntrack_meta_del_rcu(pernet, ct);
+
+        type = DPI_CONNTRACK_RING_EV_DESTROY;
+    } else if(events & EVENTS_UPDATE) {
+        /* Новый conntrack или смена helper */
+        dpi_conntrack_index_update_rcu(pernet, f, ct);
+
+        type = (events & ((1 << IPCT_NEW) | (1 << IPCT_RELATED))) ?
+                DPI_CONNTRACK_RING_EV_NEW : DPI_CONNTRACK_RING_EV_UPDATE;
+    } else {
+        type = DPI_CONNTRACK_RING_EV_UPDATE;
+    }
+
+    if(f && (NULL != (ring = rcu_dereference(f->ring)))) {
+        /* Сообщаем о событии читателям кольцевых буферов "файла" */
+        dpi_conntrack_ring_event(ring, type, ct);
+    }
+
+    if(f && (NULL != (delta = rcu_dereference(f->delta)))) {
+        /* Журнал изменений для читателей <name>.delta */
+        dpi_conntrack_delta_event(delta, type, ct);
+    }
+
+    /* Отрицательное значение привело бы к повторной доставке IPCT_DESTROY */
+    return 0;
+}
@@ -0,0 +1,834 @@
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/sort.h>
+#include <linux/string.h>
+#include <linux/notifier.h>
+#include <linux/rculist.h>
+#include <linux/inet.h>
+#include <asm/unaligned.h>
+
+#include <net/netfilter/nf_conntrack.h>
+#include <net/netfilter/nf_conntrack_helper.h>
+#include <net/netfilter/nf_conntrack_zones.h>
+
+#include "dpi_conntrack_ko.h"
+
+/* Максимальное кол-во префиксов одного семейства в списке фильтра дескриптора */
+#define FD_FILTER_PREFIXES_MAX  65536
+
+/* Таблица зарегистрированных helper (экспортируется nf_conntrack) */
+extern struct hlist_head *nf_ct_helper_hash;
+extern unsigned int nf_ct_helper_hsize;
+
+/* Предварительное объявление локальных функций модуля */
+static int filter_module_event(struct notifier_block *nb, unsigned long action, void *data);
+static int filter_ports_compile(struct dpi_conntrack_port_range *dst, unsigned int *nr,
+                                const struct dpi_conntrack_port_range *src, u32 n);
+static int filter_port_range_cmp(const void *a, const void *b);
+static int filter_ports_match(const struct dpi_conntrack_port_range *r, unsigned int nr, u16 port);
+static int filter_helper_name_rcu(const struct dpi_conntrack_match *m,
+                                  const struct nf_conntrack_helper *helper);
+static int fd_filter_value(struct dpi_conntrack_fd_filter *ff, const char *key, char *value);
+static int fd_filter_port_add(struct dpi_conntrack_port_range *r, unsigned int *nr, char *value);
+static int fd_filter_prefix_add(struct dpi_conntrack_prefixes *p, char *value);
+static int fd_filter_prefixes_compile(struct dpi_conntrack_prefixes *p);
+static int fd_filter_prefixes_match(const struct dpi_conntrack_prefixes *p,
+                                    const struct dpi_conntrack_addr *a);
+static int fd_filter_tuple_match(const struct dpi_conntrack_fd_filter *ff,
+                                 const struct nf_conntrack_tuple *t);
+static int addr_cmp(const struct dpi_conntrack_addr *a, const struct dpi_conntrack_addr *b);
+static int addr_range_cmp(const void *a, const void *b);
+
+/*
+ * Поколение набора helper. Увеличивается при загрузке и выгрузке модулей
+ * (helper регистрируются модулями) и при обнаружении conntrack с helper,
+ * которого нет среди найденных ранее (например, helper из userspace).
+ */
+static atomic_t helpers_gen = ATOMIC_INIT(1);
+
+/* Уведомления о загрузке и выгрузке модулей */
+static struct notifier_block filter_module_nb = {
+    .notifier_call = filter_module_event,
+};
+
+/**
+ * Подписка на уведомления о загрузке и выгрузке модулей
+ *
+ * @return
+ */
+int __init dpi_conntrack_filter_startup(void) {
+    return register_module_notifier(&filter_module_nb);
+}
+
+/**
+ * Отмена подписки на уведомления о загрузке и выгрузке модулей
+ */
+void dpi_conntrack_filter_cleanup(void) {
+    unregister_module_notifier(&filter_module_nb);
+}
+
+/**
+ * Компиляция фильтра "файла"
+ *
+ * @param m
+ * @param name имя "файла"
+ * @param filter
+ * @return -EINVAL, если фильтр некорректен
+ */
+int dpi_conntrack_filter_compile(struct dpi_conntrack_match *m, const char *name,
+                                 const struct dpi_conntrack_filter *filter) {
+    unsigned int n;
+    int rv;
+
+    memset(m, 0, sizeof(struct dpi_conntrack_match));
+
+    if(filter->nr_helpers > DPI_CONNTRACK_FILTER_HELPERS_MAX) {
+        return -EINVAL;
+    }
+
+    for(n = 0;n < filter->nr_helpers;n++) {
+        const char *h = filter->helpers[n];
+        size_t len = strnlen(h, DPI_CONNTRACK_HELPER_NAME_LEN);
+
+        if(!len || (len >= NF_CT_HELPER_NAME_LEN)) {
+            /* Пустое или не ограниченное нулем имя */
+            return -EINVAL;
+        }
+
+        memcpy(m->helpers[n], h, len);
+    }
+
+    m->nr_helpers = filter->nr_helpers;
+    m->flags = filter->flags;
+    m->l3num = filter->l3num;
+    m->protonum = filter->protonum;
+    m->zone = filter->zone;
+    m->mark = filter->mark & filter->mark_mask;
+    m->mark_mask = filter->mark_mask;
+    m->status = filter->status & filter->status_mask;
+    m->status_mask = filter->status_mask;
+
+    if(m->flags & DPI_CONNTRACK_FILTER_SPORT) {
+        if(0 != (rv = filter_ports_compile(m->sport, &m->nr_sport, filter->sport, filter->nr_sport))) {
+            return rv;
+        }
+    }
+
+    if(m->flags & DPI_CONNTRACK_FILTER_DPORT) {
+        if(0 != (rv = filter_ports_compile(m->dport, &m->nr_dport, filter->dport, filter->nr_dport))) {
+            return rv;
+        }
+    }
+
+    /* Индекс conntrack ведется по имени helper, совпадающему с именем "файла" */
+    m->indexed = !m->flags && (1 == m->nr_helpers) &&
+                 (0 == strncmp(m->helpers[0], name, NF_CT_HELPER_NAME_LEN));
+
+    return 0;
+}
+
+/**
+ * Поиск зарегистрированных helper с именами из фильтра "файла"
+ *
+ * @param f
+ * @param force выполнить поиск, даже если результат предыдущего еще актуален
+ *
+ * Если память не выделена, сохраняется прежний результат (при его
+ * неактуальности сравнение выполняется по имени).
+ *
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+void dpi_conntrack_filter_refresh_rcu(struct dpi_conntrack_file *f, bool force) {
+    const struct dpi_conntrack_match *m = &f->match;
+    struct dpi_conntrack_helpers *hs = rcu_dereference(f->helpers);
+    struct nf_conntrack_helper *helper;
+    int gen = atomic_read(&helpers_gen);
+    unsigned int bucket, nr = 0;
+
+    if(!m->nr_helpers || (!force && hs && (hs->gen == gen))) {
+        return;
+    }
+
+    /* Кол-во helper с подходящими именами (по одному на каждый l3num/protonum) */
+    for(bucket = 0;bucket < nf_ct_helper_hsize;bucket++) {
+        hlist_for_each_entry_rcu(helper, &nf_ct_helper_hash[bucket], hnode) {
+            nr += filter_helper_name_rcu(m, helper);
+        }
+    }
+
+    if(NULL == (hs = kmalloc(sizeof(struct dpi_conntrack_helpers) + nr * sizeof(hs->helper[0]), GFP_ATOMIC))) {
+        return;
+    }
+
+    hs->gen = gen;
+    hs->nr = 0;
+
+    for(bucket = 0;bucket < nf_ct_helper_hsize;bucket++) {
+        hlist_for_each_entry_rcu(helper, &nf_ct_helper_hash[bucket], hnode) {
+            if((hs->nr < nr) && filter_helper_name_rcu(m, helper)) {
+                hs->helper[hs->nr++] = helper;
+            }
+        }
+    }
+
+    /* Параллельно поиск мог выполнить другой читатель - оставляем последний */
+    if(NULL != (hs = xchg((struct dpi_conntrack_helpers __force **)&f->helpers, hs))) {
+        kfree_rcu(hs, rcu);
+    }
+}
+
+/**
+ * Признать результаты поиска helper всех "файлов" неактуальными
+ */
+void dpi_conntrack_filter_invalidate(void) {
+    atomic_inc(&helpers_gen);
+}
+
+/**
+ * Подходит ли helper фильтру "файла"
+ *
+ * @param f
+ * @param helper
+ * @return
+ *
+ * При актуальном результате поиска helper сравнивается только указатель,
+ * иначе - имя.
+ *
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+int dpi_conntrack_filter_helper_rcu(const struct dpi_conntrack_file *f,
+                                    const struct nf_conntrack_helper *helper) {
+    const struct dpi_conntrack_helpers *hs;
+    unsigned int n;
+
+    if(!f->match.nr_helpers) {
+        /* helper не проверяется */
+        return 1;
+    }
+
+    if(NULL == helper) {
+        return 0;
+    }
+
+    hs = rcu_dereference(f->helpers);
+
+    if(likely(hs && (hs->gen == atomic_read(&helpers_gen)))) {
+        for(n = 0;n < hs->nr;n++) {
+            if(hs->helper[n] == helper) {
+                return 1;
+            }
+        }
+
+        return 0;
+    }
+
+    return filter_helper_name_rcu(&f->match, helper);
+}
+
+/**
+ * Подходит ли conntrack фильтру "файла"
+ *
+ * @param f
+ * @param ct
+ * @return
+ *
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+int dpi_conntrack_filter_match_rcu(const struct dpi_conntrack_file *f, const struct nf_conn *ct) {
+    const struct dpi_conntrack_match *m = &f->match;
+    const struct nf_conntrack_tuple *t;
+    u32 flags = m->flags;
+
+    if(!dpi_conntrack_filter_helper_rcu(f, dpi_conntrack_helper_rcu(ct))) {
+        return 0;
+    }
+
+    if(likely(!flags)) {
+        /* Фильтр только по helper */
+        return 1;
+    }
+
+    if((flags & DPI_CONNTRACK_FILTER_L3) && (nf_ct_l3num(ct) != m->l3num)) {
+        return 0;
+    }
+
+    if((flags & DPI_CONNTRACK_FILTER_L4) && (nf_ct_protonum(ct) != m->protonum)) {
+        return 0;
+    }
+
+    if((flags & DPI_CONNTRACK_FILTER_ZONE) && (nf_ct_zone(ct)->id != m->zone)) {
+        return 0;
+    }
+
+#if defined(CONFIG_NF_CONNTRACK_MARK)
+    if((flags & DPI_CONNTRACK_FILTER_MARK) && ((ct->mark & m->mark_mask) != m->mark)) {
+        return 0;
+    }
+#else
+    if((flags & DPI_CONNTRACK_FILTER_MARK) && m->mark) {
+        /* ctmark не поддерживается ядром (всегда 0) */
+        return 0;
+    }
+#endif
+
+    if((flags & DPI_CONNTRACK_FILTER_STATUS) && (((u32)ct->status & m->status_mask) != m->status)) {
+        return 0;
+    }
+
+    t = &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple;
+
+    if((flags & DPI_CONNTRACK_FILTER_SPORT) &&
+       !filter_ports_match(m->sport, m->nr_sport, ntohs(t->src.u.all))) {
+        return 0;
+    }
+
+    if((flags & DPI_CONNTRACK_FILTER_DPORT) &&
+       !filter_ports_match(m->dport, m->nr_dport, ntohs(t->dst.u.all))) {
+        return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * Разбор фильтра, записанного в дескриптор "файла"
+ *
+ * @param text строки (или части строки через ';') вида "<критерий> <значение>...",
+ * буфер изменяется
+ * @return NULL, если критериев нет (фильтр снимается), ERR_PTR при ошибке
+ *
+ * Критерии:
+ * src, dst - адреса или префиксы IPv4/IPv6 (10.0.0.0/8, 2001:db8::/32);
+ * sport, dport - порты или диапазоны портов (80, 1024-65535);
+ * zone - зона conntrack;
+ * dir - кортеж, с которым сравниваются адреса и порты: original (по умолчанию),
+ * reply или any (любой из двух).
+ * Повторение критерия дополняет список значений, критерии объединяются по "И".
+ */
+struct dpi_conntrack_fd_filter *dpi_conntrack_fd_filter_parse(char *text) {
+    struct dpi_conntrack_fd_filter *ff;
+    char *line;
+    int rv = 0;
+
+    if(NULL == (ff = kzalloc(sizeof(struct dpi_conntrack_fd_filter), GFP_KERNEL))) {
+        return ERR_PTR(-ENOMEM);
+    }
+
+    while(!rv && (NULL != (line = strsep(&text, "\n;")))) {
+        char *key, *value;
+
+        line = skip_spaces(line);
+        key = strsep(&line, " \t");
+
+        if('\0' == *key) {
+            /* Пустая строка */
+            continue;
+        }
+
+        while(!rv && (NULL != (value = strsep(&line, " \t")))) {
+            if('\0' != *value) {
+                rv = fd_filter_value(ff, key, value);
+            }
+        }
+    }
+
+    if(!rv && (ff->flags & DPI_FD_FILTER_SRC)) {
+        if(0 == (rv = fd_filter_prefixes_compile(&ff->src[0]))) {
+            rv = fd_filter_prefixes_compile(&ff->src[1]);
+        }
+    }
+
+    if(!rv && (ff->flags & DPI_FD_FILTER_DST)) {
+        if(0 == (rv = fd_filter_prefixes_compile(&ff->dst[0]))) {
+            rv = fd_filter_prefixes_compile(&ff->dst[1]);
+        }
+    }
+
+    if(!rv && (ff->flags & DPI_FD_FILTER_SPORT)) {
+        rv = filter_ports_compile(ff->sport, &ff->nr_sport, ff->sport, ff->nr_sport);
+    }
+
+    if(!rv && (ff->flags & DPI_FD_FILTER_DPORT)) {
+        rv = filter_ports_compile(ff->dport, &ff->nr_dport, ff->dport, ff->nr_dport);
+    }
+
+    if(rv || !ff->flags) {
+        dpi_conntrack_fd_filter_free(ff);
+
+        return rv ? ERR_PTR(rv) : NULL;
+    }
+
+    return ff;
+}
+
+/**
+ * Освобождение фильтра дескриптора
+ *
+ * @param ff может быть NULL
+ */
+void dpi_conntrack_fd_filter_free(struct dpi_conntrack_fd_filter *ff) {
+    unsigned int n;
+
+    if(NULL == ff) {
+        return;
+    }
+
+    for(n = 0;n < ARRAY_SIZE(ff->src);n++) {
+        vfree(ff->src[n].range);
+        vfree(ff->dst[n].range);
+    }
+
+    kfree(ff);
+}
+
+/**
+ * Подходит ли conntrack фильтру дескриптора
+ *
+ * @param ff
+ * @param ct
+ * @return
+ *
+ * Адреса ищутся двоичным поиском в отсортированных диапазонах префиксов.
+ *
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+int dpi_conntrack_fd_filter_match_rcu(const struct dpi_conntrack_fd_filter *ff, const struct nf_conn *ct) {
+    if((ff->flags & DPI_FD_FILTER_ZONE) && (nf_ct_zone(ct)->id != ff->zone)) {
+        return 0;
+    }
+
+    if(DPI_FD_FILTER_DIR_REPLY == ff->dir) {
+        return fd_filter_tuple_match(ff, &ct->tuplehash[IP_CT_DIR_REPLY].tuple);
+    }
+
+    if(fd_filter_tuple_match(ff, &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple)) {
+        return 1;
+    }
+
+    return (DPI_FD_FILTER_DIR_ANY == ff->dir) &&
+           fd_filter_tuple_match(ff, &ct->tuplehash[IP_CT_DIR_REPLY].tuple);
+}
+
+/**
+ * Обработка уведомления о загрузке или выгрузке модуля
+ *
+ * @param nb
+ * @param action
+ * @param data
+ * @return
+ *
+ * MODULE_STATE_LIVE приходит после инициализации модуля (helper уже
+ * зарегистрированы), MODULE_STATE_GOING - после ее отмены.
+ */
+static int filter_module_event(struct notifier_block *nb, unsigned long action, void *data) {
+    if((MODULE_STATE_LIVE == action) || (MODULE_STATE_GOING == action)) {
+        dpi_conntrack_filter_invalidate();
+    }
+
+    return NOTIFY_DONE;
+}
+
+/**
+ * Компиляция списка диапазонов портов: сортировка по min и объединение
+ * пересекающихся и смежных диапазонов
+ *
+ * @param dst
+ * @param nr
+ * @param src
+ * @param n
+ * @return
+ */
+static int filter_ports_compile(struct dpi_conntrack_port_range *dst, unsigned int *nr,
+                                const struct dpi_conntrack_port_range *src, u32 n) {
+    unsigned int i, out = 0;
+
+    if(!n || (n > DPI_CONNTRACK_FILTER_PORTS_MAX)) {
+        return -EINVAL;
+    }
+
+    for(i = 0;i < n;i++) {
+        if(src[i].min > src[i].max) {
+            return -EINVAL;
+        }
+
+        dst[i] = src[i];
+    }
+
+    sort(dst, n, sizeof(struct dpi_conntrack_port_range), filter_port_range_cmp, NULL);
+
+    for(i = 1;i < n;i++) {
+        if((u32)dst[i].min <= (u32)dst[out].max + 1) {
+            if(dst[i].max > dst[out].max) {
+                dst[out].max = dst[i].max;
+            }
+        } else {
+            dst[++out] = dst[i];
+        }
+    }
+
+    *nr = out + 1;
+
+    return 0;
+}
+
+/**
+ * Сравнение диапазонов портов для сортировки
+ *
+ * @param a
+ * @param b
+ * @return
+ */
+static int filter_port_range_cmp(const void *a, const void *b) {
+    const struct dpi_conntrack_port_range *ra = a, *rb = b;
+
+    return (int)ra->min - (int)rb->min;
+}
+
+/**
+ * Попадает ли порт в один из диапазонов
+ *
+ * @param r диапазоны, отсортированные по возрастанию и не пересекающиеся
+ * @param nr
+ * @param port
+ * @return
+ */
+static int filter_ports_match(const struct dpi_conntrack_port_range *r, unsigned int nr, u16 port) {
+    unsigned int i;
+
+    for(i = 0;(i < nr) && (r[i].min <= port);i++) {
+        if(port <= r[i].max) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Совпадает ли имя helper с одним из имен фильтра
+ *
+ * @param m
+ * @param helper
+ * @return
+ */
+static int filter_helper_name_rcu(const struct dpi_conntrack_match *m,
+                                  const struct nf_conntrack_helper *helper) {
+    unsigned int n;
+
+    for(n = 0;n < m->nr_helpers;n++) {
+        if(0 == strncmp(helper->name, m->helpers[n], NF_CT_HELPER_NAME_LEN)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Разбор одного значения критерия фильтра дескриптора
+ *
+ * @param ff
+ * @param key
+ * @param value
+ * @return -EINVAL, если критерий неизвестен или значение некорректно
+ */
+static int fd_filter_value(struct dpi_conntrack_fd_filter *ff, const char *key, char *value) {
+    int rv = -EINVAL;
+
+    if(0 == strcmp(key, "src")) {
+        ff->flags |= DPI_FD_FILTER_SRC;
+        rv = fd_filter_prefix_add(ff->src, value);
+    } else if(0 == strcmp(key, "dst")) {
+        ff->flags |= DPI_FD_FILTER_DST;
+        rv = fd_filter_prefix_add(ff->dst, value);
+    } else if(0 == strcmp(key, "sport")) {
+        ff->flags |= DPI_FD_FILTER_SPORT;
+        rv = fd_filter_port_add(ff->sport, &ff->nr_sport, value);
+    } else if(0 == strcmp(key, "dport")) {
+        ff->flags |= DPI_FD_FILTER_DPORT;
+        rv = fd_filter_port_add(ff->dport, &ff->nr_dport, value);
+    } else if(0 == strcmp(key, "zone")) {
+        ff->flags |= DPI_FD_FILTER_ZONE;
+        rv = kstrtou16(value, 0, &ff->zone);
+    } else if(0 == strcmp(key, "dir")) {
+        rv = 0;
+
+        if(0 == strcmp(value, "original")) {
+            ff->dir = DPI_FD_FILTER_DIR_ORIGINAL;
+        } else if(0 == strcmp(value, "reply")) {
+            ff->dir = DPI_FD_FILTER_DIR_REPLY;
+        } else if(0 == strcmp(value, "any")) {
+            ff->dir = DPI_FD_FILTER_DIR_ANY;
+        } else {
+            rv = -EINVAL;
+        }
+    }
+
+    return rv;
+}
+
+/**
+ * Добавление порта или диапазона портов "min-max"
+ *
+ * @param r
+ * @param nr
+ * @param value
+ * @return
+ */
+static int fd_filter_port_add(struct dpi_conntrack_port_range *r, unsigned int *nr, char *value) {
+    char *max = strchr(value, '-');
+
+    if(*nr >= DPI_CONNTRACK_FILTER_PORTS_MAX) {
+        return -EINVAL;
+    }
+
+    if(max) {
+        *max++ = '\0';
+    }
+
+    if(kstrtou16(value, 10, &r[*nr].min) || kstrtou16(max ? max : value, 10, &r[*nr].max)) {
+        return -EINVAL;
+    }
+
+    /* Диапазон проверяется при компиляции списка */
+    (*nr)++;
+
+    return 0;
+}
+
+/**
+ * Добавление адреса или префикса "addr/len"
+ *
+ * @param p префиксы по семействам
+ * @param value
+ * @return
+ */
+static int fd_filter_prefix_add(struct dpi_conntrack_prefixes *p, char *value) {
+    struct dpi_conntrack_addr_range *r;
+    char *plen = strchr(value, '/');
+    bool v6 = (NULL != strchr(value, ':'));
+    unsigned int bits = v6 ? 128 : 32;
+    unsigned int len = bits, host;
+    u64 hi_mask = 0, lo_mask = 0;
+    u8 addr[16];
+
+    if(plen) {
+        *plen++ = '\0';
+
+        if(kstrtouint(plen, 10, &len) || (len > bits)) {
+            return -EINVAL;
+        }
+    }
+
+    if(!(v6 ? in6_pton(value, -1, addr, -1, NULL) : in4_pton(value, -1, addr, -1, NULL))) {
+        return -EINVAL;
+    }
+
+    p += v6;
+
+    if(p->nr == p->size) {
+        /* Буфер увеличивается вдвое */
+        unsigned int size = p->size ? 2 * p->size : 16;
+
+        if((p->size >= FD_FILTER_PREFIXES_MAX) || (NULL == (r = vmalloc(size * sizeof(*r))))) {
+            return -ENOMEM;
+        }
+
+        if(p->nr) {
+            memcpy(r, p->range, p->nr * sizeof(*r));
+        }
+
+        vfree(p->range);
+
+        p->range = r;
+        p->size = size;
+    }
+
+    r = &p->range[p->nr++];
+
+    if(v6) {
+        r->first.hi = get_unaligned_be64(addr);
+        r->first.lo = get_unaligned_be64(addr + 8);
+    } else {
+        r->first.hi = 0;
+        r->first.lo = get_unaligned_be32(addr);
+    }
+
+    /* Маска части адреса узла */
+    host = bits - len;
+
+    if(host >= 64) {
+        lo_mask = ~0ULL;
+        hi_mask = (host > 64) ? (~0ULL >> (128 - host)) : 0;
+    } else if(host) {
+        lo_mask = ~0ULL >> (64 - host);
+    }
+
+    r->first.hi &= ~hi_mask;
+    r->first.lo &= ~lo_mask;
+    r->last.hi = r->first.hi | hi_mask;
+    r->last.lo = r->first.lo | lo_mask;
+
+    return 0;
+}
+
+/**
+ * Компиляция списка префиксов: сортировка диапазонов и объединение
+ * пересекающихся и смежных
+ *
+ * @param p
+ * @return
+ */
+static int fd_filter_prefixes_compile(struct dpi_conntrack_prefixes *p) {
+    struct dpi_conntrack_addr_range *r = p->range;
+    unsigned int i, out = 0;
+
+    if(!p->nr) {
+        return 0;
+    }
+
+    sort(r, p->nr, sizeof(struct dpi_conntrack_addr_range), addr_range_cmp, NULL);
+
+    for(i = 1;i < p->nr;i++) {
+        struct dpi_conntrack_addr next = r[out].last;
+
+        /* Адрес, следующий за диапазоном (если он есть) */
+        if(0 == ++next.lo) {
+            next.hi++;
+        }
+
+        if((addr_cmp(&r[i].first, &r[out].last) <= 0) ||
+           ((next.hi | next.lo) && (0 == addr_cmp(&r[i].first, &next)))) {
+            if(addr_cmp(&r[i].last, &r[out].last) > 0) {
+                r[out].last = r[i].last;
+            }
+        } else {
+            r[++out] = r[i];
+        }
+    }
+
+    p->nr = out + 1;
+
+    return 0;
+}
+
+/**
+ * Попадает ли адрес в один из диапазонов
+ *
+ * @param p
+ * @param a
+ * @return
+ */
+static int fd_filter_prefixes_match(const struct dpi_conntrack_prefixes *p,
+                                    const struct dpi_conntrack_addr *a) {
+    unsigned int lo = 0, hi = p->nr;
+
+    /* Первый диапазон, начинающийся после адреса */
+    while(lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+
+        if(addr_cmp(&p->range[mid].first, a) <= 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo && (addr_cmp(a, &p->range[lo - 1].last) <= 0);
+}
+
+/**
+ * Подходит ли кортеж адресам и портам фильтра дескриптора
+ *
+ * @param ff
+ * @param t
+ * @return
+ */
+static int fd_filter_tuple_match(const struct dpi_conntrack_fd_filter *ff,
+                                 const struct nf_conntrack_tuple *t) {
+    struct dpi_conntrack_addr src, dst;
+    unsigned int family;
+
+    if(ff->flags & (DPI_FD_FILTER_SRC | DPI_FD_FILTER_DST)) {
+        if(AF_INET == t->src.l3num) {
+            family = 0;
+
+            src.hi = dst.hi = 0;
+            src.lo = ntohl(t->src.u3.ip);
+            dst.lo = ntohl(t->dst.u3.ip);
+        } else if(AF_INET6 == t->src.l3num) {
+            family = 1;
+
+            src.hi = ((u64)ntohl(t->src.u3.ip6[0]) << 32) | ntohl(t->src.u3.ip6[1]);
+            src.lo = ((u64)ntohl(t->src.u3.ip6[2]) << 32) | ntohl(t->src.u3.ip6[3]);
+            dst.hi = ((u64)ntohl(t->dst.u3.ip6[0]) << 32) | ntohl(t->dst.u3.ip6[1]);
+            dst.lo = ((u64)ntohl(t->dst.u3.ip6[2]) << 32) | ntohl(t->dst.u3.ip6[3]);
+        } else {
+            return 0;
+        }
+
+        if((ff->flags & DPI_FD_FILTER_SRC) && !fd_filter_prefixes_match(&ff->src[family], &src)) {
+            return 0;
+        }
+
+        if((ff->flags & DPI_FD_FILTER_DST) && !fd_filter_prefixes_match(&ff->dst[family], &dst)) {
+            return 0;
+        }
+    }
+
+    if((ff->flags & DPI_FD_FILTER_SPORT) &&
+       !filter_ports_match(ff->sport, ff->nr_sport, ntohs(t->src.u.all))) {
+        return 0;
+    }
+
+    if((ff->flags & DPI_FD_FILTER_DPORT) &&
+       !filter_ports_match(ff->dport, ff->nr_dport, ntohs(t->dst.u.all))) {
+        return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * Сравнение адресов
+ *
+ * @param a
+ * @param b
+ * @return
+ */
+static int addr_cmp(const struct dpi_conntrack_addr *a, const struct dpi_conntrack_addr *b) {
+    if(a->hi != b->hi) {
+        return (a->hi < b->hi) ? -1 : 1;
+    }
+
+    if(a->lo != b->lo) {
+        return (a->lo < b->lo) ? -1 : 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Сравнение диапазонов адресов для сортировки
+ *
+ * @param a
+ * @param b
+ * @return
+ */
+static int addr_range_cmp(const void *a, const void *b) {
+    const struct dpi_conntrack_addr_range *ra = a, *rb = b;
+
+    return addr_cmp(&ra->first, &rb->first);
+}
@@ -0,0 +1,90 @@
+#include <linux/timer.h>
+#include <linux/jiffies.h>
+
+#include <net/netfilter/nf_conntrack.h>
+#include <net/netfilter/nf_conntrack_core.h>
+
+#include "dpi_conntrack_ko.h"
+
+/* Кол-во conntrack, обрабатываемых за один выход из rcu_read_lock */
+#define FLUSH_BATCH 64
+
+/* Параметры и результат операции */
+struct flush_ctx {
+    bool retime;
+    /* jiffies */
+    unsigned long timeout;
+    u64 done;
+};
+
+/* Предварительное объявление локальных функций модуля */
+static int flush_batch(struct nf_conn **ct, unsigned int nr, void *data);
+
+/**
+ * Удаление или изменение времени жизни всех conntrack "файла"
+ *
+ * @param net
+ * @param name имя "файла"
+ * @param retime false - удалить conntrack, true - установить время жизни
+ * не больше timeout (оставшееся время жизни меньше timeout не изменяется)
+ * @param timeout секунд
+ * @param done кол-во удаленных или измененных conntrack (в т.ч. при ошибке)
+ * @return -ENOENT, если "файл" не найден или снят с регистрации во время обхода
+ *
+ * conntrack обрабатываются пакетами по FLUSH_BATCH вне rcu_read_lock
+ * (dpi_conntrack_for_each_batch), поэтому ни окружение rcu_read_lock,
+ * ни блокировки таблицы conntrack не удерживаются дольше одного пакета.
+ *
+ * NB!
+ * Вызов может приостанавливать выполнение!
+ */
+int dpi_conntrack_flush(struct net *net, const char *name, bool retime, u32 timeout, u64 *done) {
+    struct flush_ctx ctx = {
+        .retime  = retime,
+        .timeout = (unsigned long)timeout * HZ,
+        .done    = 0,
+    };
+    int rv = dpi_conntrack_for_each_batch(net, name, flush_batch, &ctx, FLUSH_BATCH);
+
+    dpi_conntrack_stats_add(dpi_conntrack_pernet(net)->stats, flushed, ctx.done);
+
+    *done = ctx.done;
+
+    return rv;
+}
+
+/**
+ * Обработка пакета conntrack
+ *
+ * @param ct conntrack со ссылками (освобождаются вызывающим)
+ * @param nr
+ * @param data struct flush_ctx
+ * @return 0
+ *
+ * Как и в nf_ct_iterate_cleanup, conntrack удаляет тот, кто остановил его
+ * таймер (иначе он уже удаляется по истечении времени жизни).
+ */
+static int flush_batch(struct nf_conn **ct, unsigned int nr, void *data) {
+    struct flush_ctx *ctx = data;
+    unsigned int n;
+
+    for(n = 0;n < nr;n++) {
+        if(ctx->retime) {
+            unsigned long expires = jiffies + ctx->timeout;
+
+            if(time_before(expires, ct[n]->timeout.expires) && del_timer(&ct[n]->timeout)) {
+                ct[n]->timeout.expires = expires;
+
+                add_timer(&ct[n]->timeout);
+
+                ctx->done++;
+            }
+        } else if(del_timer(&ct[n]->timeout)) {
+            if(nf_ct_delete(ct[n], 0, 0)) {
+                ctx->done++;
+            }
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,501 @@
+#include <linux/slab.h>
+#include <linux/rcupdate.h>
+#include <linux/rculist.h>
+#include <linux/rhashtable.h>
+
+#include <net/netfilter/nf_conntrack.h>
+#include <net/netfilter/nf_conntrack_core.h>
+#include <net/netfilter/nf_conntrack_helper.h>
+
+#include "dpi_conntrack_ko.h"
+
+/* Предварительное объявление локальных функций модуля */
+static struct dpi_conntrack_index_entry *index_find(struct dpi_conntrack_net *pernet,
+                                                    const struct nf_conn *ct);
+static void index_add(struct dpi_conntrack_net *pernet, struct dpi_conntrack_file *f,
+                      struct nf_conn *ct);
+static void index_unlink(struct dpi_conntrack_net *pernet, struct dpi_conntrack_index_entry *e);
+static int index_entry_valid_rcu(const struct dpi_conntrack_index_entry *e);
+static int index_seed_iter(struct nf_conn *ct, void *data);
+static int index_seed_net_iter(struct nf_conn *ct, void *data);
+
+/* Параметры таблицы элементов индекса (размер меняется вместе с кол-вом
+ * conntrack, запись - под блокировками отдельных bucket)
+ */
+static const struct rhashtable_params index_params = {
+    .head_offset         = offsetof(struct dpi_conntrack_index_entry, node),
+    .key_offset          = offsetof(struct dpi_conntrack_index_entry, ct),
+    .key_len             = sizeof(struct nf_conn *),
+    .automatic_shrinking = true,
+};
+
+/**
+ * Инициализация индекса conntrack netns
+ *
+ * @param pernet
+ * @return
+ */
+int dpi_conntrack_index_init(struct dpi_conntrack_net *pernet) {
+    return rhashtable_init(&pernet->index, &index_params);
+}
+
+/**
+ * Удаление индекса conntrack netns
+ *
+ * @param pernet
+ *
+ * NB!
+ * Вызывается после освобождения всех "файлов" (элементы индекса освобождаются
+ * вместе с ними). Вызов может приостанавливать выполнение!
+ */
+void dpi_conntrack_index_exit(struct dpi_conntrack_net *pernet) {
+    rhashtable_destroy(&pernet->index);
+}
+
+/**
+ * Добавить conntrack в индекс "файла" для его helper (или перенести в индекс
+ * другого "файла" при смене helper)
+ *
+ * @param pernet
+ * @param f "файл" с именем helper conntrack (NULL - не зарегистрирован)
+ * @param ct
+ *
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+void dpi_conntrack_index_update_rcu(struct dpi_conntrack_net *pernet,
+                                    struct dpi_conntrack_file *f,
+                                    struct nf_conn *ct) {
+    struct dpi_conntrack_index_entry *e;
+    struct dpi_conntrack_sketch *sketch;
+
+    if((NULL == f) && (0 == atomic_read(&pernet->index.nelems))) {
+        /* conntrack без "файла", а индекс пуст - искать нечего */
+        return;
+    }
+
+    if(NULL != (e = index_find(pernet, ct))) {
+        if((e->f == f) &&
+           nf_ct_tuple_equal(&e->tuple, &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple)) {
+            /* conntrack уже находится в индексе нужного "файла" */
+            return;
+        }
+
+        /* Сменился helper, либо это устаревший элемент от переиспользованного nf_conn */
+        index_unlink(pernet, e);
+    }
+
+    if(f) {
+        index_add(pernet, f, ct);
+    }
+
+    if(f && (NULL != (sketch = rcu_dereference(f->sketch)))) {
+        /* conntrack учитывается в оценках при добавлении в индекс "файла" */
+        dpi_conntrack_sketch_add(sketch, ct);
+    }
+}
+
+/**
+ * Удалить conntrack из индекса
+ *
+ * @param pernet
+ * @param ct
+ *
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+void dpi_conntrack_index_del_rcu(struct dpi_conntrack_net *pernet,
+                                 const struct nf_conn *ct) {
+    struct dpi_conntrack_index_entry *e;
+
+    if(0 == atomic_read(&pernet->index.nelems)) {
+        /* Индекс пуст (в т.ч. нет "файлов"), поиск не нужен */
+        return;
+    }
+
+    if(NULL != (e = index_find(pernet, ct))) {
+        index_unlink(pernet, e);
+    }
+}
+
+/**
+ * Найти "файл", в индексе которого находится conntrack
+ *
+ * @param pernet
+ * @param ct
+ * @return
+ *
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+struct dpi_conntrack_file *dpi_conntrack_index_lookup_rcu(struct dpi_conntrack_net *pernet,
+                                                          const struct nf_conn *ct) {
+    struct dpi_conntrack_index_entry *e = index_find(pernet, ct);
+
+    return (e && index_entry_valid_rcu(e)) ? e->f : NULL;
+}
+
+/**
+ * Найти элемент индекса по nf_conn
+ *
+ * @param pernet
+ * @param ct
+ * @return элемент (возможно, уже устаревший) или NULL
+ *
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+struct dpi_conntrack_index_entry *dpi_conntrack_index_find_rcu(struct dpi_conntrack_net *pernet,
+                                                               const struct nf_conn *ct) {
+    return index_find(pernet, ct);
+}
+
+/**
+ * Проверка того, что элемент индекса соответствует действующему conntrack
+ *
+ * @param e
+ * @return
+ *
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+int dpi_conntrack_index_is_valid_rcu(const struct dpi_conntrack_index_entry *e) {
+    return index_entry_valid_rcu(e);
+}
+
+/**
+ * Первоначальное заполнение индекса вновь зарегистрированного "файла"
+ *
+ * @param f
+ *
+ * Выполняется однократный полный обход таблицы conntrack, далее индекс
+ * поддерживается уведомлениями. Элементы, добавленные параллельно
+ * уведомлениями, повторно не добавляются.
+ *
+ * NB!
+ * Вызов может приостанавливать выполнение (cond_resched)!
+ */
+void dpi_conntrack_index_seed(struct dpi_conntrack_file *f) {
+    rcu_read_lock();
+    
+    /* helper индекса сравниваются по указателю */
+    dpi_conntrack_filter_refresh_rcu(f, true);
+    
+    rcu_read_unlock();
+    
+    nf_ct_iterate_cleanup(f->net, index_seed_iter, f, 0, 0);
+}
+
+/**
+ * Заполнение индексов всех зарегистрированных в netns "файлов" одним обходом
+ *
+ * @param net
+ *
+ * Используется после регистрации группы "файлов" вместо обхода таблицы
+ * conntrack для каждого из них. conntrack, уже находящиеся в индексе,
+ * повторно не добавляются.
+ *
+ * NB!
+ * Вызов может приостанавливать выполнение (cond_resched)!
+ */
+void dpi_conntrack_index_seed_net(struct net *net) {
+    nf_ct_iterate_cleanup(net, index_seed_net_iter, dpi_conntrack_pernet(net), 0, 0);
+}
+
+/**
+ * Исключить все элементы индекса "файла" из поиска (при снятии с регистрации)
+ *
+ * @param pernet
+ * @param f
+ *
+ * Сами элементы остаются в списке f->index и освобождаются вместе
+ * с "файлом" по истечении grace period (dpi_conntrack_index_free).
+ */
+void dpi_conntrack_index_release(struct dpi_conntrack_net *pernet,
+                                 struct dpi_conntrack_file *f) {
+    struct dpi_conntrack_index_entry *e;
+
+    spin_lock_bh(&f->index_lock);
+
+    /* Новые элементы в индекс данного "файла" больше не добавляются */
+    f->dead = true;
+
+    list_for_each_entry(e, &f->index, list) {
+        /* -ENOENT: элемент уже удаляется параллельно (index_unlink) */
+        rhashtable_remove_fast(&pernet->index, &e->node, index_params);
+    }
+
+    spin_unlock_bh(&f->index_lock);
+}
+
+/**
+ * Освобождение элементов индекса "файла"
+ *
+ * @param f
+ *
+ * Вызывается только после dpi_conntrack_index_release() и истечения grace period.
+ */
+void dpi_conntrack_index_free(struct dpi_conntrack_file *f) {
+    struct dpi_conntrack_index_entry *e, *tmp;
+
+    list_for_each_entry_safe(e, tmp, &f->index, list) {
+        kfree(e);
+    }
+
+    INIT_LIST_HEAD(&f->index);
+}
+
+/**
+ * Получить следующий действующий элемент индекса "файла"
+ *
+ * @param f
+ * @param e текущий элемент (NULL - получить первый элемент)
+ * @return NULL, если элементов больше нет
+ *
+ * Устаревшие элементы (conntrack уничтожен или переиспользован, сменился helper)
+ * пропускаются и удаляются из индекса.
+ *
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+struct dpi_conntrack_index_entry *dpi_conntrack_index_next_rcu(struct dpi_conntrack_file *f,
+                                                               struct dpi_conntrack_index_entry *e) {
+    struct list_head *pos = e ? &e->list : &f->index;
+
+    for(;;) {
+        pos = rcu_dereference(list_next_rcu(pos));
+
+        if(pos == &f->index) {
+            /* Достигнут конец списка */
+            return NULL;
+        }
+
+        e = list_entry(pos, struct dpi_conntrack_index_entry, list);
+
+        if(likely(index_entry_valid_rcu(e))) {
+            return e;
+        }
+
+        if(!f->dead) {
+            /* Удаляем устаревший элемент (next у него остается действительным) */
+            index_unlink(dpi_conntrack_pernet(f->net), e);
+        }
+    }
+}
+
+/**
+ * Поиск элемента индекса по nf_conn
+ *
+ * @param pernet
+ * @param ct
+ * @return
+ *
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+static struct dpi_conntrack_index_entry *index_find(struct dpi_conntrack_net *pernet,
+                                                    const struct nf_conn *ct) {
+    return rhashtable_lookup_fast(&pernet->index, &ct, index_params);
+}
+
+/**
+ * Добавление нового элемента в индекс
+ *
+ * @param pernet
+ * @param f
+ * @param ct
+ *
+ * Если элемент для nf_conn был добавлен параллельно, новый элемент не
+ * добавляется.
+ *
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+static void index_add(struct dpi_conntrack_net *pernet, struct dpi_conntrack_file *f,
+                      struct nf_conn *ct) {
+    struct dpi_conntrack_index_entry *e;
+    int rv;
+
+    if(f->dead) {
+        /* "Файл" снимается с регистрации */
+        return;
+    }
+
+    if(NULL == (e = kmalloc(sizeof(struct dpi_conntrack_index_entry), GFP_ATOMIC))) {
+        /*
+         * Память не выделена. conntrack будет отсутствовать в индексе
+         * до следующего уведомления о нем.
+         */
+        dpi_conntrack_stats_inc(pernet->stats, alloc_failed);
+        
+        return;
+    }
+
+    e->f = f;
+    e->ct = ct;
+    e->tuple = ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple;
+
+    /* Список "файла" и признак dead изменяются под одной блокировкой, поэтому
+     * dpi_conntrack_index_release() исключит из поиска и этот элемент
+     */
+    spin_lock_bh(&f->index_lock);
+
+    rv = f->dead ? -ENOENT : rhashtable_lookup_insert_fast(&pernet->index, &e->node, index_params);
+
+    if(0 == rv) {
+        /* Новые элементы добавляются в конец списка, номера возрастают */
+        e->seq = f->index_seq++;
+
+        list_add_tail_rcu(&e->list, &f->index);
+
+        atomic_inc(&f->count);
+    }
+
+    spin_unlock_bh(&f->index_lock);
+
+    if(rv) {
+        if((-EEXIST != rv) && (-ENOENT != rv)) {
+            /* Как и при нехватке памяти, conntrack появится в индексе позже */
+            dpi_conntrack_stats_inc(pernet->stats, alloc_failed);
+        }
+
+        kfree(e);
+    }
+}
+
+/**
+ * Исключение элемента из индекса и освобождение его памяти (через kfree_rcu)
+ *
+ * @param pernet
+ * @param e
+ *
+ * Элемент освобождает только тот, кто удалил его из таблицы pernet->index.
+ *
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+static void index_unlink(struct dpi_conntrack_net *pernet, struct dpi_conntrack_index_entry *e) {
+    struct dpi_conntrack_file *f = e->f;
+
+    if(0 != rhashtable_remove_fast(&pernet->index, &e->node, index_params)) {
+        /* Удален параллельно, либо "файл" снимается с регистрации */
+        return;
+    }
+
+    spin_lock_bh(&f->index_lock);
+
+    list_del_rcu(&e->list);
+
+    atomic_dec(&f->count);
+
+    spin_unlock_bh(&f->index_lock);
+
+    kfree_rcu(e, rcu);
+}
+
+/**
+ * Проверка того, что элемент индекса соответствует действующему conntrack
+ *
+ * @param e
+ * @return
+ *
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+static int index_entry_valid_rcu(const struct dpi_conntrack_index_entry *e) {
+    struct nf_conn *ct = e->ct;
+
+    if(unlikely(!atomic_read(&ct->ct_general.use) ||
+                nf_ct_is_dying(ct) ||
+                !nf_ct_is_confirmed(ct))) {
+        /* conntrack уничтожается или уже освобожден */
+        return 0;
+    }
+
+    if(unlikely(!nf_ct_tuple_equal(&e->tuple, &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple))) {
+        /* nf_conn переиспользован для другого соединения */
+        return 0;
+    }
+
+    /* helper мог смениться без уведомления (например, при выгрузке модуля helper) */
+    return dpi_conntrack_filter_helper_rcu(e->f, dpi_conntrack_helper_rcu(ct));
+}
+
+/**
+ * Обработка очередного conntrack при первоначальном заполнении индекса
+ *
+ * @param ct
+ * @param data
+ * @return всегда 0 (nf_ct_iterate_cleanup не должен удалять conntrack!)
+ */
+static int index_seed_iter(struct nf_conn *ct, void *data) {
+    struct dpi_conntrack_file *f = data;
+
+    if(!nf_ct_is_confirmed(ct)) {
+        /* Уведомление IPCT_NEW о нем поступит при подтверждении */
+        return 0;
+    }
+
+    rcu_read_lock();
+
+    if(dpi_conntrack_filter_helper_rcu(f, dpi_conntrack_helper_rcu(ct))) {
+        dpi_conntrack_index_update_rcu(dpi_conntrack_pernet(f->net), f, ct);
+    }
+
+    rcu_read_unlock();
+
+    return 0;
+}
+
+/**
+ * Обработка очередного conntrack при заполнении индексов всех "файлов" netns
+ *
+ * @param ct
+ * @param data
+ * @return всегда 0 (nf_ct_iterate_cleanup не должен удалять conntrack!)
+ */
+static int index_seed_net_iter(struct nf_conn *ct, void *data) {
+    struct dpi_conntrack_net *pernet = data;
+    struct nf_conntrack_helper *helper;
+    struct dpi_conntrack_file *f;
+
+    if(!nf_ct_is_confirmed(ct)) {
+        /* Уведомление IPCT_NEW о нем поступит при подтверждении */
+        return 0;
+    }
+
+    rcu_read_lock();
+
+    helper = dpi_conntrack_helper_rcu(ct);
+
+    /* Индекс ведется только для "файлов" с именем helper (как и по уведомлениям) */
+    f = helper ? dpi_conntrack_file_find_rcu(pernet, helper->name) : NULL;
+
+    if(f && f->match.indexed && dpi_conntrack_filter_helper_rcu(f, helper)) {
+        dpi_conntrack_index_update_rcu(pernet, f, ct);
+    }
+
+    rcu_read_unlock();
+
+    return 0;
+}
@@ -0,0 +1,1057 @@
+#include <linux/rcupdate.h>
+#include <linux/rculist_nulls.h>
+#include <linux/seqlock.h>
+#include <linux/ktime.h>
+#include <linux/jhash.h>
+#include <linux/sort.h>
+#include <linux/bsearch.h>
+#include <linux/vmalloc.h>
+#include <linux/prefetch.h>
+
+#include <net/netfilter/nf_conntrack.h>
+#include <net/netfilter/nf_conntrack_helper.h>
+
+#include "dpi_conntrack_ko.h"
+#include "trace.h"
+
+/* Время участка проверяется не на каждом bucket (ktime_get_ns() не бесплатен) */
+#define SCAN_CHUNK_CLOCK_MASK   63
+/* Минимальный запас места под отпечатки conntrack на одно окружение rcu_read_lock */
+#define SCAN_SEEN_RESERVE       16384
+/* Кол-во стадий упреждающей загрузки (и элементов цепочки bucket, загружаемых заранее) */
+#define SCAN_PREFETCH_STAGES    4
+
+/* Бюджет участка обхода таблицы conntrack в одном окружении rcu_read_lock */
+static unsigned int scan_chunk_buckets __read_mostly = 4096;
+module_param(scan_chunk_buckets, uint, 0644);
+MODULE_PARM_DESC(scan_chunk_buckets, "Leave the RCU read section after this many conntrack buckets of a table walk (0 - no limit)");
+
+static unsigned int scan_chunk_us __read_mostly = 500;
+module_param(scan_chunk_us, uint, 0644);
+MODULE_PARM_DESC(scan_chunk_us, "Leave the RCU read section after this many microseconds of a table walk (0 - no limit)");
+
+/* Упреждающая загрузка при обходе таблицы conntrack (в bucket). По умолчанию
+ * выключена: выигрыш зависит от размера таблицы относительно LLC и должен
+ * быть измерен на целевой системе (bench/scan prefetch)
+ */
+static unsigned int scan_prefetch __read_mostly;
+module_param(scan_prefetch, uint, 0644);
+MODULE_PARM_DESC(scan_prefetch, "Prefetch conntracks and their extensions this many buckets ahead of a table walk (0 - disabled, default)");
+
+/* Предварительное объявление локальных функций модуля */
+static struct dpi_iterator *index_get_idx(struct dpi_iterator *i, struct dpi_conntrack_file *f,
+                                          const struct dpi_conntrack_fd_filter *ff, loff_t pos);
+static struct dpi_conntrack_index_entry *index_next(struct dpi_iterator *i, struct dpi_conntrack_file *f,
+                                                    const struct dpi_conntrack_fd_filter *ff,
+                                                    struct dpi_conntrack_index_entry *e);
+static struct dpi_iterator *index_restore(struct dpi_conntrack_cursor *st);
+static struct dpi_iterator *ct_get_idx(struct dpi_conntrack_cursor *st, loff_t pos);
+static struct dpi_iterator *ct_restore(struct dpi_conntrack_cursor *st);
+static struct dpi_iterator *ct_match(struct dpi_conntrack_cursor *st);
+static bool ct_relax(struct dpi_conntrack_cursor *st);
+static bool ct_resync(struct dpi_conntrack_cursor *st);
+static bool ct_chunk_exhausted(struct dpi_iterator *i);
+static void ct_seen_add(struct dpi_conntrack_cursor *st);
+static bool ct_is_seen(struct dpi_conntrack_cursor *st);
+static u32 ct_fingerprint(const struct nf_conntrack_tuple_hash *h);
+static int seen_cmp(const void *a, const void *b);
+static void ct_get_next(struct dpi_iterator *i, struct net *net);
+static void ct_get_first(struct dpi_iterator *i, struct net *net);
+static void ct_get_bucket(struct dpi_iterator *i, struct net *net);
+static void scan_prefetch_stage(struct hlist_nulls_head *head, unsigned int stage);
+static int ct_is_match(struct dpi_iterator *i, struct dpi_conntrack_file *f,
+                       const struct dpi_conntrack_fd_filter *ff);
+static int is_this_helper(struct nf_conntrack_tuple_hash *hash, const struct dpi_conntrack_file *f,
+                          const struct dpi_conntrack_fd_filter *ff);
+
+/**
+ * Начало (или продолжение) обхода с позиции pos
+ * 
+ * @param st
+ * @param pos
+ * @return 
+ * 
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+struct dpi_iterator *dpi_conntrack_iter_start(struct dpi_conntrack_cursor *st, loff_t pos) {
+    struct dpi_iterator *i = &st->i;
+    struct dpi_conntrack_file *f = st->f;
+    struct dpi_conntrack_net *pernet = dpi_conntrack_pernet(f->net);
+    /* Продолжение последовательного чтения (чтение с начала всегда
+     * выполняется заново - в т.ч. повторное после seq_lseek на 0, кроме
+     * прерванного по бюджету участка обхода, не нашедшего ни одного conntrack)
+     */
+    bool resume = st->saved && (pos || st->yield) && (st->saved_pos == pos);
+    
+    st->pos = pos;
+    st->yield = false;
+    
+    /* Новый участок обхода таблицы */
+    i->stalled = false;
+    i->chunk_buckets = 0;
+    i->chunk_started = ktime_get_ns();
+    
+    /* helper фильтра сравниваются по указателю (при новом обходе ищем заново) */
+    dpi_conntrack_filter_refresh_rcu(f, !resume);
+    
+    if(resume) {
+        st->saved = false;
+        
+        if(st->eof) {
+            /* Обход уже был завершен */
+            return NULL;
+        }
+        
+        trace_dpi_conntrack_scan_start(f->name, pos, i->indexed, true);
+        
+        /* Восстанавливаем итератор на том элементе, где была остановка */
+        return i->indexed ? index_restore(st) : ct_restore(st);
+    }
+    
+    /* Чтение с начала файла или после seq_lseek: начинаем новый обход */
+    st->saved = false;
+    st->lost = false;
+        
+    memset(i, 0, sizeof(struct dpi_iterator));
+    
+    /* При наличии индекса обходим только относящиеся к "файлу" conntrack */
+    i->indexed = pernet->events && f->match.indexed;
+    i->stats = pernet->stats;
+    
+    dpi_conntrack_stats_inc(i->stats, dumps);
+    st->started = ktime_get_ns();
+    i->chunk_started = st->started;
+    
+    trace_dpi_conntrack_scan_start(f->name, pos, i->indexed, false);
+    
+    /* Определяем первую подходящую позицию */
+    i = i->indexed ? index_get_idx(i, f, st->ff, pos) : ct_get_idx(st, pos);
+    
+    if(i) {
+        dpi_conntrack_stats_inc(i->stats, matches);
+        
+        trace_dpi_conntrack_scan_match(f->name, dpi_conntrack_iter_ct(i), pos);
+    }
+    
+    return i;
+}
+
+/**
+ * Перемещение итератора на следующую позицию
+ * 
+ * @param st
+ * @param i
+ * @return 
+ * 
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+struct dpi_iterator *dpi_conntrack_iter_next(struct dpi_conntrack_cursor *st, struct dpi_iterator *i) {
+    struct dpi_conntrack_file *f = st->f;
+    
+    st->pos++;
+    
+    if(i->indexed) {
+        i->entry = index_next(i, f, st->ff, i->entry);
+        
+        if(NULL == i->entry) {
+            return NULL;
+        }
+        
+        dpi_conntrack_stats_inc(i->stats, visited);
+    } else {
+        /* Текущий conntrack выдан вызывающим */
+        ct_seen_add(st);
+        
+        ct_get_next(i, f->net);
+        
+        if(NULL == ct_match(st)) {
+            /* Больше нет элементов (или обход прерван по бюджету участка) */
+            return NULL;
+        }
+    }
+    
+    dpi_conntrack_stats_inc(i->stats, matches);
+    
+    trace_dpi_conntrack_scan_match(f->name, dpi_conntrack_iter_ct(i), st->pos);
+    
+    return i;
+}
+
+/**
+ * Завершение процесса итерации 
+ * 
+ * @param st
+ * @param i
+ * 
+ * Запоминаем элемент, на котором остановились, чтобы следующий dpi_conntrack_iter_start()
+ * для этой же позиции продолжил обход с него. Если обход был прерван по
+ * бюджету участка (st->yield), то запоминается bucket, с которого он продолжится.
+ * 
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+void dpi_conntrack_iter_stop(struct dpi_conntrack_cursor *st, struct dpi_iterator *i) {
+    trace_dpi_conntrack_scan_stop(st->f->name, st->pos, (NULL == i) && !st->yield);
+    
+    st->saved = true;
+    st->saved_pos = st->pos;
+    st->eof = (NULL == i) && !st->yield;
+    
+    if(!st->i.indexed) {
+        /* Участок завершается вместе с окружением rcu_read_lock вызывающего */
+        dpi_conntrack_stats_chunk(st->i.stats, ktime_get_ns() - st->i.chunk_started);
+    }
+    
+    if(st->yield) {
+        /* Продолжим с начала st->i.bucket (ct_restore остановится на первом элементе) */
+        st->ct = NULL;
+        st->i.chain_pos = 0;
+    }
+    
+    if(st->eof && st->started) {
+        /* Обход завершен, учитываем его полную длительность */
+        dpi_conntrack_stats_latency(st->i.stats, ktime_get_ns() - st->started);
+        
+        st->started = 0;
+    }
+    
+    if(i) {
+        if(i->indexed) {
+            st->ct = i->entry->ct;
+            st->tuple = i->entry->tuple;
+            st->seq = i->entry->seq;
+        } else {
+            struct nf_conntrack_tuple_hash *h = (struct nf_conntrack_tuple_hash *)i->head;
+            
+            st->ct = nf_ct_tuplehash_to_ctrack(h);
+            st->tuple = h->tuple;
+        }
+    }
+}
+
+/**
+ * conntrack, на котором находится итератор
+ * 
+ * @param i
+ * @return 
+ * 
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+struct nf_conn *dpi_conntrack_iter_ct(struct dpi_iterator *i) {
+    if(i->indexed) {
+        return i->entry->ct;
+    }
+    
+    return nf_ct_tuplehash_to_ctrack((struct nf_conntrack_tuple_hash *)i->head);
+}
+
+/**
+ * Кортеж исходного направления conntrack, на котором находится итератор,
+ * каким он был при проверке фильтра
+ * 
+ * @param i
+ * @return 
+ * 
+ * Ссылка на conntrack при обходе не берется, поэтому nf_conn может быть
+ * переиспользован: после получения ссылки его кортеж сравнивается с этим.
+ * 
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+const struct nf_conntrack_tuple *dpi_conntrack_iter_tuple(struct dpi_iterator *i) {
+    if(i->indexed) {
+        return &i->entry->tuple;
+    }
+    
+    return &i->tuple;
+}
+
+/**
+ * Резервирование места под отпечатки conntrack, выдаваемых обходом таблицы
+ * 
+ * @param st
+ * 
+ * Вызывается перед rcu_read_lock(): в окружении отпечатки только добавляются
+ * в зарезервированное место. Если места не хватит, то после изменения
+ * размера таблицы обход завершается (повторы исключить нельзя).
+ * 
+ * Вне rcu_read_lock "файл" курсора разыменовывается, только если он
+ * удерживается вызывающим (preemptible): иначе он мог быть уже освобожден.
+ * 
+ * NB!
+ * Вызов может приостанавливать выполнение!
+ */
+void dpi_conntrack_iter_reserve(struct dpi_conntrack_cursor *st) {
+    struct dpi_conntrack_file *f = st->preemptible ? st->f : NULL;
+    unsigned int nr = st->i.nr_seen;
+    unsigned int cap;
+    u32 *seen;
+    
+    if(st->i.indexed || (f && dpi_conntrack_pernet(f->net)->events && f->match.indexed)) {
+        /* Обход по индексу не зависит от таблицы conntrack */
+        return;
+    }
+    
+    if(st->seen_cap - nr >= SCAN_SEEN_RESERVE) {
+        return;
+    }
+    
+    cap = max(st->seen_cap * 2, nr + SCAN_SEEN_RESERVE);
+    
+    if(NULL == (seen = vmalloc(cap * sizeof(u32)))) {
+        if(st->i.stats) {
+            dpi_conntrack_stats_inc(st->i.stats, alloc_failed);
+        } else if(f) {
+            dpi_conntrack_stats_inc(dpi_conntrack_pernet(f->net)->stats, alloc_failed);
+        }
+        
+        return;
+    }
+    
+    if(nr) {
+        memcpy(seen, st->seen, nr * sizeof(u32));
+    }
+    
+    vfree(st->seen);
+    
+    st->seen = seen;
+    st->seen_cap = cap;
+}
+
+/**
+ * Освобождение памяти курсора
+ * 
+ * @param st
+ */
+void dpi_conntrack_iter_release(struct dpi_conntrack_cursor *st) {
+    vfree(st->seen);
+    
+    st->seen = NULL;
+    st->seen_cap = 0;
+}
+
+/**
+ * Таблица conntrack netns
+ * 
+ * @param net
+ * @param hash
+ * @param size
+ * @return поколение таблицы (net->ct.generation)
+ * 
+ * Адрес и размер читаются согласованно. Таблица остается доступной до
+ * rcu_read_unlock(), даже если ее размер изменится (прежняя таблица
+ * освобождается после synchronize_net()), но conntrack из нее переносятся
+ * в новую таблицу.
+ * 
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+unsigned int dpi_conntrack_table_rcu(struct net *net, struct hlist_nulls_head **hash, unsigned int *size) {
+    unsigned int seq;
+    
+    do {
+        seq = read_seqcount_begin(&net->ct.generation);
+        
+        *hash = net->ct.hash;
+        *size = net->ct.htable_size;
+    } while(read_seqcount_retry(&net->ct.generation, seq));
+    
+    return seq;
+}
+
+/**
+ * Упреждающая загрузка bucket, которые будут просмотрены после bucket
+ * 
+ * @param hash
+ * @param size
+ * @param bucket текущий bucket обхода
+ * 
+ * Обход таблицы - цепочка зависимых загрузок (голова bucket -> nf_conn ->
+ * указатель на расширения -> расширения), каждая из которых обычно промах
+ * кэша. Поэтому загрузка выполняется конвейером из SCAN_PREFETCH_STAGES
+ * стадий, равномерно распределенных на scan_prefetch bucket вперед: каждая
+ * следующая стадия разыменовывает только то, что было запрошено предыдущей
+ * для того же bucket (см. scan_prefetch_stage), и ни одна не ждет загрузки.
+ * 
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+void dpi_conntrack_scan_prefetch_rcu(struct hlist_nulls_head *hash, unsigned int size, unsigned int bucket) {
+    unsigned int distance = READ_ONCE(scan_prefetch);
+    unsigned int stage;
+    
+    if(!distance) {
+        return;
+    }
+    
+    for(stage = 0;stage < SCAN_PREFETCH_STAGES;stage++) {
+        /* Первая стадия - самый дальний bucket, последняя - ближайший */
+        unsigned int ahead = distance * (SCAN_PREFETCH_STAGES - stage) / SCAN_PREFETCH_STAGES;
+        
+        if(ahead && (bucket + ahead < size)) {
+            scan_prefetch_stage(&hash[bucket + ahead], stage);
+        }
+    }
+}
+
+/**
+ * Стадия упреждающей загрузки bucket
+ * 
+ * @param head голова bucket
+ * @param stage номер стадии (0 - первая)
+ * 
+ * На стадии stage просматриваются первые stage + 1 элементов цепочки. Для
+ * элемента j это стадия j + 0 - загрузка элемента (кортеж и начало nf_conn),
+ * j + 1 - загрузка поля ct->ext, j + 2 - загрузка самих расширений. Адрес
+ * элемента j + 1 читается из элемента j, запрошенного стадией раньше.
+ * Расширения загружаются только по кортежу исходного направления (ответный
+ * кортеж обходом пропускается). prefetch() не обращается к памяти, поэтому
+ * загрузка переиспользованного или перенесенного nf_conn безопасна.
+ * 
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+static void scan_prefetch_stage(struct hlist_nulls_head *head, unsigned int stage) {
+    struct hlist_nulls_node *n = rcu_dereference(hlist_nulls_first_rcu(head));
+    unsigned int j;
+    
+    for(j = 0;(j <= stage) && !is_a_nulls(n);j++) {
+        struct nf_conntrack_tuple_hash *h = hlist_nulls_entry(n, struct nf_conntrack_tuple_hash, hnnode);
+        
+        if(stage == j) {
+            prefetch(n);
+        } else if(NF_CT_DIRECTION(h) == IP_CT_DIR_ORIGINAL) {
+            struct nf_conn *ct = nf_ct_tuplehash_to_ctrack(h);
+            
+            if(stage == j + 1) {
+                prefetch(&ct->ext);
+            } else if(stage == j + 2) {
+                prefetch(READ_ONCE(ct->ext));
+            }
+        }
+        
+        n = rcu_dereference(hlist_nulls_next_rcu(n));
+    }
+}
+
+/**
+ * Поиск позиции pos в индексе conntrack "файла"
+ * 
+ * @param i
+ * @param f
+ * @param ff
+ * @param pos
+ * @return 
+ * 
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+static struct dpi_iterator *index_get_idx(struct dpi_iterator *i, struct dpi_conntrack_file *f,
+                                          const struct dpi_conntrack_fd_filter *ff, loff_t pos) {
+    i->entry = index_next(i, f, ff, NULL);
+    
+    while(i->entry && pos) {
+        pos--;
+        
+        dpi_conntrack_stats_inc(i->stats, visited);
+        
+        i->entry = index_next(i, f, ff, i->entry);
+    }
+    
+    if(i->entry) {
+        dpi_conntrack_stats_inc(i->stats, visited);
+    }
+    
+    return i->entry ? i : NULL;
+}
+
+/**
+ * Восстановление итератора по индексу conntrack после dpi_conntrack_iter_stop()
+ * 
+ * @param st
+ * @return 
+ * 
+ * Элемент индекса находится по сохраненному nf_conn за O(1). Если он уже
+ * удален из индекса, то индекс просматривается с начала до первого элемента,
+ * добавленного не раньше сохраненного: позиция для этого не годится, т.к.
+ * элементы перед курсором могли быть удалены (например, FLUSH).
+ * 
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+static struct dpi_iterator *index_restore(struct dpi_conntrack_cursor *st) {
+    struct dpi_iterator *i = &st->i;
+    struct dpi_conntrack_file *f = st->f;
+    struct dpi_conntrack_index_entry *e;
+    
+    e = dpi_conntrack_index_find_rcu(dpi_conntrack_pernet(f->net), st->ct);
+    
+    if(e && (e->f == f) && nf_ct_tuple_equal(&e->tuple, &st->tuple)) {
+        /* Элемент на месте, но мог стать устаревшим - тогда берем следующий */
+        i->entry = dpi_conntrack_index_is_valid_rcu(e) ? e : index_next(i, f, st->ff, e);
+        
+        return i->entry ? i : NULL;
+    }
+    
+    /* Элементы с меньшими номерами уже были выданы */
+    i->entry = index_next(i, f, st->ff, NULL);
+    
+    while(i->entry && (i->entry->seq < st->seq)) {
+        dpi_conntrack_stats_inc(i->stats, visited);
+        
+        i->entry = index_next(i, f, st->ff, i->entry);
+    }
+    
+    if(i->entry) {
+        dpi_conntrack_stats_inc(i->stats, visited);
+    }
+    
+    return i->entry ? i : NULL;
+}
+
+/**
+ * Следующий за e элемент индекса, подходящий фильтру дескриптора
+ * 
+ * @param i
+ * @param f
+ * @param ff фильтр дескриптора (NULL - любой элемент)
+ * @param e NULL - первый элемент
+ * @return 
+ * 
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+static struct dpi_conntrack_index_entry *index_next(struct dpi_iterator *i, struct dpi_conntrack_file *f,
+                                                    const struct dpi_conntrack_fd_filter *ff,
+                                                    struct dpi_conntrack_index_entry *e) {
+    e = dpi_conntrack_index_next_rcu(f, e);
+    
+    while(ff && e && !dpi_conntrack_fd_filter_match_rcu(ff, e->ct)) {
+        dpi_conntrack_stats_inc(i->stats, visited);
+        
+        e = dpi_conntrack_index_next_rcu(f, e);
+    }
+    
+    return e;
+}
+
+/**
+ * 
+ * @param st
+ * @param pos
+ * @return 
+ * 
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+static struct dpi_iterator *ct_get_idx(struct dpi_conntrack_cursor *st, loff_t pos) {
+    struct dpi_iterator *i = &st->i;
+    
+    /* Попытка найти первую не нулевую позицию */
+    ct_get_first(i, st->f->net);
+    
+    while(ct_match(st)) {
+        if(!pos) {
+            /* Найдена подходящая нам позиция */
+            return i;
+        }
+        
+        pos--;
+        
+        /* Переходим к следующему connection */
+        ct_get_next(i, st->f->net);
+    }
+    
+    /* Больше нет подходящих нам позиций */
+    return NULL;
+}
+
+/**
+ * Восстановление итератора по таблице conntrack после dpi_conntrack_iter_stop()
+ * 
+ * @param st
+ * @return 
+ * 
+ * Просматривается только цепочка сохраненного bucket. Если сохраненный
+ * conntrack из нее исчез, то обход продолжается с той же позиции в цепочке
+ * (в пределах одной цепочки возможен пропуск элемента, повтор исключается
+ * по отпечаткам). Если размер таблицы изменился, то обход продолжается по
+ * новой таблице (ct_resync).
+ * 
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+static struct dpi_iterator *ct_restore(struct dpi_conntrack_cursor *st) {
+    struct dpi_iterator *i = &st->i;
+    struct dpi_conntrack_file *f = st->f;
+    struct net *net = f->net;
+    unsigned int bucket = i->bucket;
+    unsigned int chain_pos = i->chain_pos;
+    unsigned int bucket_seen = i->bucket_seen;
+    
+    if(raw_read_seqcount(&net->ct.generation) != i->generation) {
+        /* Таблица заменена после остановки, прежняя уже освобождена */
+        i->head = NULL;
+        i->resized = true;
+        
+        return ct_match(st);
+    }
+    
+    /* Ищем сохраненный conntrack в цепочке его bucket */
+    ct_get_bucket(i, net);
+    
+    if(i->bucket == bucket) {
+        /* Отпечатки выданных из этого bucket до остановки */
+        i->bucket_seen = bucket_seen;
+    }
+    
+    while(i->head && (i->bucket == bucket)) {
+        struct nf_conntrack_tuple_hash *h = (struct nf_conntrack_tuple_hash *)i->head;
+        
+        if((nf_ct_tuplehash_to_ctrack(h) == st->ct) && nf_ct_tuple_equal(&h->tuple, &st->tuple)) {
+            /* Найден, продолжаем с него (если он все еще подходит) */
+            break;
+        }
+        
+        if(i->chain_pos >= chain_pos) {
+            /* Сохраненный conntrack исчез, продолжаем с его позиции */
+            i->restarted = true;
+            
+            break;
+        }
+        
+        ct_get_next(i, net);
+    }
+    
+    return ct_match(st);
+}
+
+/**
+ * Переход к первому подходящему conntrack, начиная с текущего элемента
+ * 
+ * @param st
+ * @return NULL, если подходящих conntrack больше нет, либо обход прерван
+ * по бюджету участка (st->yield)
+ * 
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+static struct dpi_iterator *ct_match(struct dpi_conntrack_cursor *st) {
+    struct dpi_iterator *i = &st->i;
+    struct dpi_conntrack_file *f = st->f;
+    
+    for(;;) {
+        while(i->head && (!ct_is_match(i, f, st->ff) || ct_is_seen(st))) {
+            ct_get_next(i, f->net);
+        }
+        
+        if(i->head) {
+            return i;
+        }
+        
+        if(i->resized) {
+            if(!ct_resync(st)) {
+                return NULL;
+            }
+            
+            continue;
+        }
+        
+        if(!i->stalled || !ct_relax(st)) {
+            return NULL;
+        }
+    }
+}
+
+/**
+ * Завершение участка обхода таблицы conntrack
+ * 
+ * @param st
+ * @return true, если обход продолжен (итератор на первом элементе не
+ * пустого bucket, начиная с i->bucket), false - обход прерван (st->yield)
+ * 
+ * Если вызывающий допускает (st->preemptible), то rcu_read_lock снимается
+ * и другим задачам дается возможность выполниться. Сохранять conntrack при
+ * этом не нужно: бюджет исчерпывается только на границе bucket, а номер
+ * bucket остается пригодным и после изменения таблицы (как при продолжении
+ * чтения). Иначе обход продолжит следующий dpi_conntrack_iter_start().
+ * 
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+static bool ct_relax(struct dpi_conntrack_cursor *st) {
+    struct dpi_iterator *i = &st->i;
+    
+    dpi_conntrack_stats_inc(i->stats, yields);
+    
+    i->stalled = false;
+    
+    if(!st->preemptible) {
+        st->yield = true;
+        
+        return false;
+    }
+    
+    dpi_conntrack_stats_chunk(i->stats, ktime_get_ns() - i->chunk_started);
+    
+    rcu_read_unlock();
+    
+    dpi_conntrack_iter_reserve(st);
+    
+    cond_resched();
+    
+    rcu_read_lock();
+    
+    i->chunk_buckets = 0;
+    i->chunk_started = ktime_get_ns();
+    
+    /* Если размер таблицы успел измениться, то ct_get_bucket() это обнаружит */
+    ct_get_bucket(i, st->f->net);
+    
+    return true;
+}
+
+/**
+ * Продолжение обхода по таблице conntrack нового размера
+ * 
+ * @param st
+ * @return false, если повторы исключить нельзя (обход прекращается с
+ * st->lost: читатели сообщают об этом ошибкой -EAGAIN, а не концом обхода)
+ * 
+ * Порядок conntrack в новой таблице другой, поэтому она обходится с начала,
+ * а уже выданные conntrack пропускаются по отпечаткам. Совпадение отпечатков
+ * разных conntrack приводит к пропуску conntrack, но не к повтору.
+ * 
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+static bool ct_resync(struct dpi_conntrack_cursor *st) {
+    struct dpi_iterator *i = &st->i;
+    
+    i->resized = false;
+    
+    if(i->seen_lost) {
+        /* Обход завершается, но не как пройденный до конца */
+        st->lost = true;
+        
+        return false;
+    }
+    
+    dpi_conntrack_stats_inc(i->stats, resyncs);
+    
+    if(i->nr_sorted < i->nr_seen) {
+        /* Отпечатки, добавленные после предыдущего изменения размера */
+        sort(st->seen, i->nr_seen, sizeof(u32), seen_cmp, NULL);
+        
+        i->nr_sorted = i->nr_seen;
+    }
+    
+    ct_get_first(i, st->f->net);
+    
+    return true;
+}
+
+/**
+ * Исчерпан ли бюджет текущего участка (с учетом очередного bucket)
+ * 
+ * @param i
+ * @return 
+ */
+static bool ct_chunk_exhausted(struct dpi_iterator *i) {
+    unsigned int buckets = READ_ONCE(scan_chunk_buckets);
+    unsigned int us = READ_ONCE(scan_chunk_us);
+    
+    i->chunk_buckets++;
+    
+    if(buckets && (i->chunk_buckets > buckets)) {
+        return true;
+    }
+    
+    if(us && !(i->chunk_buckets & SCAN_CHUNK_CLOCK_MASK)) {
+        return (ktime_get_ns() - i->chunk_started) >= (u64)us * NSEC_PER_USEC;
+    }
+    
+    return false;
+}
+
+/**
+ * Учет выданного conntrack (текущего элемента итератора)
+ * 
+ * @param st
+ * 
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+static void ct_seen_add(struct dpi_conntrack_cursor *st) {
+    struct dpi_iterator *i = &st->i;
+    
+    if(i->nr_seen < st->seen_cap) {
+        st->seen[i->nr_seen++] = ct_fingerprint((struct nf_conntrack_tuple_hash *)i->head);
+    } else {
+        i->seen_lost = true;
+    }
+}
+
+/**
+ * Был ли текущий элемент итератора уже выдан
+ * 
+ * @param st
+ * @return 
+ * 
+ * Проверяются отпечатки, выданные до изменения размера таблицы, а после
+ * перезапуска цепочки - выданные из текущего bucket.
+ * 
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+static bool ct_is_seen(struct dpi_conntrack_cursor *st) {
+    struct dpi_iterator *i = &st->i;
+    unsigned int n;
+    u32 fp;
+    
+    if(likely(!i->nr_sorted && !i->restarted)) {
+        return false;
+    }
+    
+    fp = ct_fingerprint((struct nf_conntrack_tuple_hash *)i->head);
+    
+    if(i->restarted) {
+        for(n = i->bucket_seen;n < i->nr_seen;n++) {
+            if(st->seen[n] == fp) {
+                return true;
+            }
+        }
+    }
+    
+    return i->nr_sorted && bsearch(&fp, st->seen, i->nr_sorted, sizeof(u32), seen_cmp);
+}
+
+/**
+ * Отпечаток conntrack (по кортежу исходного направления)
+ * 
+ * @param h
+ * @return 
+ */
+static u32 ct_fingerprint(const struct nf_conntrack_tuple_hash *h) {
+    const struct nf_conntrack_tuple *t = &h->tuple;
+    
+    return jhash2((const u32 *)t, (sizeof(t->src) + sizeof(t->dst.u3)) / sizeof(u32),
+                  ((__force u32)t->dst.u.all << 16) | t->dst.protonum);
+}
+
+/**
+ * Сравнение отпечатков для sort() и bsearch()
+ * 
+ * @param a
+ * @param b
+ * @return 
+ */
+static int seen_cmp(const void *a, const void *b) {
+    u32 x = *(const u32 *)a;
+    u32 y = *(const u32 *)b;
+    
+    return (x > y) - (x < y);
+}
+
+
+/**
+ * 
+ * @param i
+ * @param net
+ * @return 
+ * 
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+static void ct_get_next(struct dpi_iterator *i, struct net *net) {
+    i->head = rcu_dereference(hlist_nulls_next_rcu(i->head));
+    i->chain_pos++;
+    
+    while(is_a_nulls(i->head)) {
+        if (likely(get_nulls_value(i->head) == i->bucket)) {
+            /* Цепочка пройдена, переходим к следующему не пустому bucket */
+            i->bucket++;
+            
+            ct_get_bucket(i, net);
+            
+            return;
+        }
+        
+        /* conntrack перенесен в другую цепочку, повторяем текущий bucket
+         * (уже выданные из него conntrack пропускаются)
+         */
+        dpi_conntrack_stats_inc(i->stats, restarts);
+        
+        i->restarted = true;
+        i->head = rcu_dereference(hlist_nulls_first_rcu(&i->hash[i->bucket]));
+        i->chain_pos = 0;
+    }
+}
+
+
+/**
+ * 
+ * @param i
+ * @param net
+ * 
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+static void ct_get_first(struct dpi_iterator *i, struct net *net) {
+    i->generation = dpi_conntrack_table_rcu(net, &i->hash, &i->htable_size);
+    i->bucket = 0;
+    
+    ct_get_bucket(i, net);
+}
+
+
+/**
+ * Переход на первый элемент первого не пустого bucket, начиная с i->bucket
+ * 
+ * @param i
+ * @param net
+ * 
+ * Если бюджет участка исчерпан, то i->head = NULL и i->stalled = true
+ * (i->bucket - еще не просмотренный bucket). Если размер таблицы изменился,
+ * то i->head = NULL и i->resized = true.
+ * 
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+static void ct_get_bucket(struct dpi_iterator *i, struct net *net) {
+    for(;i->bucket < i->htable_size;i->bucket++) {
+        if(unlikely(raw_read_seqcount(&net->ct.generation) != i->generation)) {
+            /* conntrack переносятся в новую таблицу, в этой их уже может не быть */
+            i->head = NULL;
+            i->resized = true;
+            
+            return;
+        }
+        
+        if(ct_chunk_exhausted(i)) {
+            i->head = NULL;
+            i->stalled = true;
+            
+            return;
+        }
+        
+        dpi_conntrack_stats_inc(i->stats, buckets);
+        
+        dpi_conntrack_scan_prefetch_rcu(i->hash, i->htable_size, i->bucket);
+        
+        i->head = rcu_dereference(hlist_nulls_first_rcu(&i->hash[i->bucket]));
+        i->chain_pos = 0;
+        
+        if(!is_a_nulls(i->head)) {
+            /* i->head != NULL */
+            i->bucket_seen = i->nr_seen;
+            i->restarted = false;
+            
+            trace_dpi_conntrack_scan_bucket(i->bucket, i->htable_size);
+            
+            return;
+        }
+    }
+    
+    i->head = NULL;
+}
+
+
+/**
+ * Подходит ли текущий элемент итератора по таблице conntrack
+ * 
+ * @param i
+ * @param f
+ * @param ff
+ * @return 
+ * 
+ * Каждый conntrack находится в таблице дважды (кортежи обоих направлений),
+ * учитываем только кортеж исходного направления.
+ * 
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+static int ct_is_match(struct dpi_iterator *i, struct dpi_conntrack_file *f,
+                       const struct dpi_conntrack_fd_filter *ff) {
+    struct nf_conntrack_tuple_hash *h = (struct nf_conntrack_tuple_hash *)i->head;
+    
+    dpi_conntrack_stats_inc(i->stats, visited);
+    
+    if(NF_CT_DIRECTION(h) != IP_CT_DIR_ORIGINAL) {
+        return 0;
+    }
+    
+    /* Кортеж до проверки фильтра (см. dpi_conntrack_iter_tuple) */
+    i->tuple = h->tuple;
+    
+    return is_this_helper(h, f, ff);
+}
+
+/**
+ * 
+ * @param hash
+ * @param f
+ * @param ff
+ * @return 
+ * 
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+static int is_this_helper(struct nf_conntrack_tuple_hash *hash, const struct dpi_conntrack_file *f,
+                          const struct dpi_conntrack_fd_filter *ff) {
+    struct nf_conn *ct = nf_ct_tuplehash_to_ctrack(hash);
+    
+    /* helper (по указателю) и остальные критерии фильтра "файла", затем
+     * фильтр дескриптора (если он записан)
+     */
+    return dpi_conntrack_filter_match_rcu(f, ct) && (!ff || dpi_conntrack_fd_filter_match_rcu(ff, ct));
+}
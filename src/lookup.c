@@ -0,0 +1,255 @@
+#include <linux/prefetch.h>
+#include <linux/jhash.h>
+#include <linux/kernel.h>
+#include <linux/rculist_nulls.h>
+#include <linux/seqlock.h>
+#include <linux/string.h>
+#include <linux/version.h>
+
+#include <net/netfilter/nf_conntrack.h>
+#include <net/netfilter/nf_conntrack_helper.h>
+#include <net/netfilter/nf_conntrack_zones.h>
+
+#include "dpi_conntrack_ko.h"
+
+/* Кол-во кортежей, bucket которых загружаются одновременно */
+#define LOOKUP_WINDOW   32
+
+/* Случайная составляющая hash таблицы conntrack (экспортируется nf_conntrack) */
+extern unsigned int nf_conntrack_hash_rnd;
+
+/* lookup_hash() повторяет hash_conntrack_raw() ядер, в которых зона не входит
+ * в hash (4.3, зоны по направлениям), а netns - еще не входит (4.7, net_hash_mix)
+ */
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(4, 3, 0)) || (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 7, 0))
+#error "lookup_hash() does not match hash_conntrack_raw() of this kernel"
+#endif
+
+/* Предварительное объявление локальных функций модуля */
+static unsigned int lookup_window_rcu(struct net *net, struct dpi_conntrack_lookup *l, unsigned int nr);
+static u32 lookup_hash(const struct dpi_conntrack_lookup *l);
+static struct nf_conntrack_tuple_hash *lookup_chain_rcu(struct hlist_nulls_head *hash, u32 bucket,
+                                                        struct hlist_nulls_node *n,
+                                                        const struct dpi_conntrack_lookup *l);
+static bool lookup_is_match(const struct nf_conntrack_tuple_hash *h, const struct dpi_conntrack_lookup *l);
+static bool lookup_fill_rcu(struct dpi_conntrack_lookup *l, const struct nf_conntrack_tuple_hash *h);
+
+/**
+ * Поиск conntrack по набору кортежей
+ *
+ * @param net
+ * @param l кортежи и зоны; для каждого заполняются flags, helper и meta
+ * @param nr
+ * @return кол-во найденных conntrack
+ *
+ * Все кортежи обрабатываются в одном окружении rcu_read_lock окнами по
+ * LOOKUP_WINDOW: сначала вычисляются bucket всех кортежей окна и
+ * загружаются их головы, затем первые элементы цепочек, и только после
+ * этого выполняется сравнение. Промахи кэша разных кортежей таким образом
+ * перекрываются, а не следуют друг за другом, как при поиске по одному.
+ *
+ * Ссылки на conntrack не берутся: после чтения helper и метаданных кортеж
+ * проверяется повторно (nf_conn мог быть переиспользован).
+ *
+ * Может вызываться в контексте softirq.
+ */
+int dpi_conntrack_lookup_batch(struct net *net, struct dpi_conntrack_lookup *l, unsigned int nr) {
+    unsigned int found = 0;
+    unsigned int n;
+
+    rcu_read_lock();
+
+    for(n = 0;n < nr;n += LOOKUP_WINDOW) {
+        found += lookup_window_rcu(net, &l[n], min_t(unsigned int, nr - n, LOOKUP_WINDOW));
+    }
+
+    rcu_read_unlock();
+
+    return found;
+}
+EXPORT_SYMBOL_GPL(dpi_conntrack_lookup_batch);
+
+/**
+ * Поиск conntrack для окна кортежей
+ *
+ * @param net
+ * @param l
+ * @param nr не больше LOOKUP_WINDOW
+ * @return кол-во найденных conntrack
+ *
+ * Если во время поиска изменился размер таблицы, conntrack могли быть уже
+ * перенесены в новую, поэтому при промахах поиск окна повторяется.
+ *
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+static unsigned int lookup_window_rcu(struct net *net, struct dpi_conntrack_lookup *l, unsigned int nr) {
+    struct nf_conntrack_tuple_hash *h[LOOKUP_WINDOW];
+    struct hlist_nulls_node *first[LOOKUP_WINDOW];
+    u32 bucket[LOOKUP_WINDOW];
+    struct hlist_nulls_head *hash;
+    unsigned int generation;
+    unsigned int size;
+    unsigned int found;
+    unsigned int n;
+
+    do {
+        generation = dpi_conntrack_table_rcu(net, &hash, &size);
+        found = 0;
+
+        /* Головы bucket */
+        for(n = 0;n < nr;n++) {
+            bucket[n] = reciprocal_scale(lookup_hash(&l[n]), size);
+
+            prefetch(&hash[bucket[n]]);
+        }
+
+        /* Первые элементы цепочек (кортежи в nf_conn) */
+        for(n = 0;n < nr;n++) {
+            first[n] = rcu_dereference(hlist_nulls_first_rcu(&hash[bucket[n]]));
+
+            if(!is_a_nulls(first[n])) {
+                prefetch(first[n]);
+            }
+        }
+
+        /* Сравнение кортежей, для найденных - расширения conntrack (helper) */
+        for(n = 0;n < nr;n++) {
+            if(NULL != (h[n] = lookup_chain_rcu(hash, bucket[n], first[n], &l[n]))) {
+                prefetch(READ_ONCE(nf_ct_tuplehash_to_ctrack(h[n])->ext));
+            }
+        }
+
+        for(n = 0;n < nr;n++) {
+            if(h[n] && lookup_fill_rcu(&l[n], h[n])) {
+                found++;
+            } else {
+                memset(&l[n].flags, 0, sizeof(*l) - offsetof(struct dpi_conntrack_lookup, flags));
+            }
+        }
+    } while((found < nr) && read_seqcount_retry(&net->ct.generation, generation));
+
+    return found;
+}
+
+/**
+ * hash кортежа в таблице conntrack
+ *
+ * @param l
+ * @return
+ *
+ * Повторяет hash_conntrack_raw() nf_conntrack_core.c: кортеж до портов
+ * назначения, порт назначения и протокол. Зона в hash не входит и
+ * проверяется только при сравнении (lookup_is_match).
+ */
+static u32 lookup_hash(const struct dpi_conntrack_lookup *l) {
+    const struct nf_conntrack_tuple *t = &l->tuple;
+
+    return jhash2((const u32 *)t, (sizeof(t->src) + sizeof(t->dst.u3)) / sizeof(u32),
+                  nf_conntrack_hash_rnd ^
+                  (((__force u32)(__force u16)t->dst.u.all << 16) | t->dst.protonum));
+}
+
+/**
+ * Поиск кортежа в цепочке bucket
+ *
+ * @param hash
+ * @param bucket
+ * @param n первый элемент цепочки
+ * @param l
+ * @return NULL, если кортеж не найден
+ *
+ * Как и в ____nf_conntrack_find(), цепочка просматривается заново, если ее
+ * конец принадлежит другому bucket (элемент был перенесен во время просмотра).
+ *
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+static struct nf_conntrack_tuple_hash *lookup_chain_rcu(struct hlist_nulls_head *hash, u32 bucket,
+                                                        struct hlist_nulls_node *n,
+                                                        const struct dpi_conntrack_lookup *l) {
+    for(;;) {
+        for(;!is_a_nulls(n);n = rcu_dereference(hlist_nulls_next_rcu(n))) {
+            struct nf_conntrack_tuple_hash *h = hlist_nulls_entry(n, struct nf_conntrack_tuple_hash, hnnode);
+
+            if(lookup_is_match(h, l)) {
+                return h;
+            }
+        }
+
+        if(likely(get_nulls_value(n) == bucket)) {
+            return NULL;
+        }
+
+        n = rcu_dereference(hlist_nulls_first_rcu(&hash[bucket]));
+    }
+}
+
+/**
+ * Совпадает ли элемент таблицы с искомым кортежем
+ *
+ * @param h
+ * @param l
+ * @return
+ *
+ * Зона сравнивается для направления найденного кортежа, как в
+ * ____nf_conntrack_find() (nf_ct_zone_equal): у зоны с направлением
+ * идентификатор другого направления - NF_CT_DEFAULT_ZONE_ID.
+ *
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+static bool lookup_is_match(const struct nf_conntrack_tuple_hash *h, const struct dpi_conntrack_lookup *l) {
+    struct nf_conn *ct = nf_ct_tuplehash_to_ctrack(h);
+
+    return nf_ct_tuple_equal(&l->tuple, &h->tuple) &&
+           (nf_ct_zone_id(nf_ct_zone(ct), NF_CT_DIRECTION(h)) == l->zone) &&
+           nf_ct_is_confirmed(ct);
+}
+
+/**
+ * Заполнение результата для найденного conntrack
+ *
+ * @param l
+ * @param h
+ * @return false, если conntrack уничтожается или nf_conn был переиспользован
+ *
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+static bool lookup_fill_rcu(struct dpi_conntrack_lookup *l, const struct nf_conntrack_tuple_hash *h) {
+    struct nf_conn *ct = nf_ct_tuplehash_to_ctrack(h);
+    struct nf_conntrack_helper *helper = dpi_conntrack_helper_rcu(ct);
+
+    l->flags = DPI_CONNTRACK_LOOKUP_FOUND;
+
+    if(NF_CT_DIRECTION(h) == IP_CT_DIR_REPLY) {
+        l->flags |= DPI_CONNTRACK_LOOKUP_REPLY;
+    }
+
+    if(helper) {
+        l->flags |= DPI_CONNTRACK_LOOKUP_HELPER;
+
+        strncpy(l->helper, helper->name, DPI_CONNTRACK_HELPER_NAME_LEN - 1);
+        l->helper[DPI_CONNTRACK_HELPER_NAME_LEN - 1] = '\0';
+    } else {
+        l->helper[0] = '\0';
+    }
+
+    if(0 == dpi_conntrack_meta_get(ct, &l->meta)) {
+        l->flags |= DPI_CONNTRACK_LOOKUP_META;
+    } else {
+        memset(&l->meta, 0, sizeof(l->meta));
+    }
+
+    /* Без ссылки на conntrack: результат действителен, только если это все еще он */
+    return !nf_ct_is_dying(ct) && lookup_is_match(h, l);
+}
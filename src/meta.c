@@ -0,0 +1,308 @@
+#include <linux/slab.h>
+#include <linux/rhashtable.h>
+#include <linux/seqlock.h>
+#include <linux/ktime.h>
+
+#include <net/netfilter/nf_conntrack.h>
+
+#include "dpi_conntrack_ko.h"
+
+/* Максимальное кол-во conntrack с метаданными в netns */
+static unsigned int meta_max = 1 << 20;
+module_param(meta_max, uint, 0644);
+MODULE_PARM_DESC(meta_max, "Maximum number of conntracks with DPI metadata per netns");
+
+/*
+ * Метаданные одного conntrack. Ищутся по указателю на nf_conn, кортеж
+ * исходного направления отличает переиспользованный nf_conn.
+ */
+struct meta_entry {
+    struct rhash_head node;
+    /* Для kfree_rcu */
+    struct rcu_head rcu;
+    /* Ключ (без увеличения счетчика использований!) */
+    const struct nf_conn *ct;
+    /* Кортеж conntrack на момент добавления */
+    struct nf_conntrack_tuple tuple;
+    /* Запись под блокировкой, чтение - без блокировок с повтором */
+    seqlock_t lock;
+    struct dpi_conntrack_meta meta;
+};
+
+/* Предварительное объявление локальных функций модуля */
+static struct meta_entry *meta_find_rcu(struct dpi_conntrack_net *pernet, const struct nf_conn *ct);
+static struct meta_entry *meta_new(struct dpi_conntrack_net *pernet, struct nf_conn *ct,
+                                   const struct dpi_conntrack_meta *meta, u64 now);
+static void meta_remove(struct dpi_conntrack_net *pernet, struct meta_entry *e);
+static void meta_free(void *ptr, void *arg);
+
+/* Параметры таблицы метаданных (размер меняется вместе с кол-вом conntrack) */
+static const struct rhashtable_params meta_params = {
+    .head_offset         = offsetof(struct meta_entry, node),
+    .key_offset          = offsetof(struct meta_entry, ct),
+    .key_len             = sizeof(const struct nf_conn *),
+    .automatic_shrinking = true,
+};
+
+/**
+ * Установка метаданных классификации conntrack
+ *
+ * @param ct conntrack, ссылка на который удерживается вызывающим
+ * @param meta first_ns и last_ns заполняются модулем
+ * @return -EOPNOTSUPP, если в netns нет уведомлений conntrack (метаданные
+ * не могли бы быть удалены вместе с conntrack), -EAGAIN, если conntrack
+ * еще не подтвержден, -ENOSPC при превышении meta_max
+ *
+ * Может вызываться в контексте softirq.
+ */
+int dpi_conntrack_meta_set(struct nf_conn *ct, const struct dpi_conntrack_meta *meta) {
+    struct dpi_conntrack_net *pernet = dpi_conntrack_pernet(nf_ct_net(ct));
+    struct meta_entry *e;
+    u64 now = ktime_get_ns();
+    int rv = 0;
+
+    if(!nf_ct_is_confirmed(ct)) {
+        /* Неподтвержденный conntrack уничтожается без уведомления */
+        return -EAGAIN;
+    }
+
+    rcu_read_lock();
+
+    /* В окружении: после сброса events при удалении netns таблица удаляется
+     * только по истечении grace period
+     */
+    if(!READ_ONCE(pernet->events)) {
+        rcu_read_unlock();
+
+        return -EOPNOTSUPP;
+    }
+
+    if(NULL == (e = meta_find_rcu(pernet, ct))) {
+        /* NULL - добавлен новый элемент */
+        e = meta_new(pernet, ct, meta, now);
+
+        if(ERR_PTR(-EEXIST) == e) {
+            /* Добавлен параллельно - обновляем существующий */
+            e = meta_find_rcu(pernet, ct);
+        } else if(IS_ERR(e)) {
+            rv = PTR_ERR(e);
+            e = NULL;
+        }
+    }
+
+    if(e) {
+        u64 first;
+
+        write_seqlock_bh(&e->lock);
+
+        first = e->meta.first_ns;
+
+        e->meta = *meta;
+        e->meta.first_ns = first;
+        e->meta.last_ns = now;
+
+        write_sequnlock_bh(&e->lock);
+    }
+
+    rcu_read_unlock();
+
+    return rv;
+}
+EXPORT_SYMBOL_GPL(dpi_conntrack_meta_set);
+
+/**
+ * Получение метаданных классификации conntrack
+ *
+ * @param ct
+ * @param meta
+ * @return -ENOENT, если метаданные не устанавливались
+ *
+ * Поиск выполняется за O(1) по указателю на nf_conn. Может вызываться в
+ * контексте softirq, в т.ч. без ссылки на conntrack в окружении rcu_read_lock.
+ */
+int dpi_conntrack_meta_get(const struct nf_conn *ct, struct dpi_conntrack_meta *meta) {
+    struct dpi_conntrack_net *pernet = dpi_conntrack_pernet(nf_ct_net(ct));
+    struct meta_entry *e;
+    int rv = -ENOENT;
+
+    if(0 == atomic_read(&pernet->meta.nelems)) {
+        /* Метаданные в netns не используются */
+        return rv;
+    }
+
+    rcu_read_lock();
+
+    /* Таблица удаленной netns освобождается после сброса events */
+    if(READ_ONCE(pernet->events) && (NULL != (e = meta_find_rcu(pernet, ct)))) {
+        unsigned int seq;
+
+        do {
+            seq = read_seqbegin(&e->lock);
+
+            *meta = e->meta;
+        } while(read_seqretry(&e->lock, seq));
+
+        rv = 0;
+    }
+
+    rcu_read_unlock();
+
+    return rv;
+}
+EXPORT_SYMBOL_GPL(dpi_conntrack_meta_get);
+
+/**
+ * Удаление метаданных уничтожаемого conntrack (IPCT_DESTROY)
+ *
+ * @param pernet
+ * @param ct
+ *
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+void dpi_conntrack_meta_del_rcu(struct dpi_conntrack_net *pernet, const struct nf_conn *ct) {
+    struct meta_entry *e;
+
+    if(0 == atomic_read(&pernet->meta.nelems)) {
+        return;
+    }
+
+    if(NULL != (e = rhashtable_lookup_fast(&pernet->meta, &ct, meta_params))) {
+        meta_remove(pernet, e);
+    }
+}
+
+/**
+ * Инициализация таблицы метаданных netns
+ *
+ * @param pernet
+ * @return
+ */
+int dpi_conntrack_meta_init(struct dpi_conntrack_net *pernet) {
+    return rhashtable_init(&pernet->meta, &meta_params);
+}
+
+/**
+ * Удаление таблицы метаданных netns
+ *
+ * @param pernet
+ *
+ * NB!
+ * Вызывается после отмены подписки на уведомления conntrack и истечения
+ * grace period. Вызов может приостанавливать выполнение!
+ */
+void dpi_conntrack_meta_exit(struct dpi_conntrack_net *pernet) {
+    rhashtable_free_and_destroy(&pernet->meta, meta_free, NULL);
+}
+
+/**
+ * Поиск действительных метаданных conntrack
+ *
+ * @param pernet
+ * @param ct
+ * @return
+ *
+ * Элемент переиспользованного nf_conn (уведомление об уничтожении было
+ * обработано до добавления элемента) удаляется.
+ *
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+static struct meta_entry *meta_find_rcu(struct dpi_conntrack_net *pernet, const struct nf_conn *ct) {
+    struct meta_entry *e = rhashtable_lookup_fast(&pernet->meta, &ct, meta_params);
+
+    if(e && !nf_ct_tuple_equal(&e->tuple, &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple)) {
+        meta_remove(pernet, e);
+
+        return NULL;
+    }
+
+    return e;
+}
+
+/**
+ * Добавление элемента метаданных
+ *
+ * @param pernet
+ * @param ct
+ * @param meta
+ * @param now
+ * @return NULL, если элемент добавлен, ERR_PTR(-EEXIST), если
+ * элемент добавлен параллельно (или другая ошибка)
+ *
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+static struct meta_entry *meta_new(struct dpi_conntrack_net *pernet, struct nf_conn *ct,
+                                   const struct dpi_conntrack_meta *meta, u64 now) {
+    struct meta_entry *e;
+    int rv;
+
+    if(atomic_read(&pernet->meta.nelems) >= meta_max) {
+        return ERR_PTR(-ENOSPC);
+    }
+
+    if(NULL == (e = kmalloc(sizeof(struct meta_entry), GFP_ATOMIC))) {
+        dpi_conntrack_stats_inc(pernet->stats, alloc_failed);
+
+        return ERR_PTR(-ENOMEM);
+    }
+
+    e->ct = ct;
+    e->tuple = ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple;
+
+    seqlock_init(&e->lock);
+
+    e->meta = *meta;
+    e->meta.first_ns = now;
+    e->meta.last_ns = now;
+
+    if(0 != (rv = rhashtable_lookup_insert_fast(&pernet->meta, &e->node, meta_params))) {
+        kfree(e);
+
+        return ERR_PTR(rv);
+    }
+
+    /* Добавление должно быть видно обработчику уведомления до проверки */
+    smp_mb();
+
+    if(unlikely(nf_ct_is_dying(ct) || !timer_pending(&ct->timeout))) {
+        /* Уведомление об уничтожении могло быть обработано до добавления:
+         * nf_ct_delete() отправляет IPCT_DESTROY до установки IPS_DYING,
+         * но уже после остановки таймера conntrack
+         */
+        meta_remove(pernet, e);
+    }
+
+    return NULL;
+}
+
+/**
+ * Удаление элемента из таблицы
+ *
+ * @param pernet
+ * @param e
+ *
+ * Память освобождает тот, кто удалил элемент из таблицы.
+ */
+static void meta_remove(struct dpi_conntrack_net *pernet, struct meta_entry *e) {
+    if(0 == rhashtable_remove_fast(&pernet->meta, &e->node, meta_params)) {
+        kfree_rcu(e, rcu);
+    }
+}
+
+/**
+ * Освобождение элемента, оставшегося в удаляемой таблице
+ *
+ * @param ptr
+ * @param arg
+ */
+static void meta_free(void *ptr, void *arg) {
+    kfree(ptr);
+}
@@ -3,6 +3,10 @@
 
 #include "dpi_conntrack_ko.h"
 
+/* Точки трассировки определяются в данном модуле */
+#define CREATE_TRACE_POINTS
+#include "trace.h"
+
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Igor V. Nikolaev <monster@vedga.com>");
 MODULE_DESCRIPTION("DPI connection tracking support module");
@@ -11,6 +15,19 @@ MODULE_ALIAS("dpi_conntrack");
 /* Предварительное объявление локальных функций */
 static int __init dpi_conntrack_startup(void);
 static void dpi_conntrack_cleanup(void);
+static int debug_set(const char *val, const struct kernel_param *kp);
+static int debug_get(char *buffer, const struct kernel_param *kp);
+
+/* Отладочный вывод (выключен - в коде остается только nop) */
+DEFINE_STATIC_KEY_FALSE(dpi_conntrack_debug_key);
+
+/* Параметр debug переключает static key (в т.ч. через /sys/module/.../parameters) */
+static const struct kernel_param_ops debug_ops = {
+    .set = debug_set,
+    .get = debug_get,
+};
+module_param_cb(debug, &debug_ops, NULL, 0644);
+MODULE_PARM_DESC(debug, "Enable debug output (tracepoints dpi_conntrack:* are always available)");
 
 /* Определение точек входа при загрузке и выгрузке модуля */
 module_init(dpi_conntrack_startup);
@@ -24,7 +41,41 @@ module_exit(dpi_conntrack_cleanup);
 static int __init dpi_conntrack_startup(void) {
     int ret;
     
+    /* Кэш памяти для "файлов" */
+    if(0 != (ret = dpi_conntrack_file_startup())) {
+        return ret;
+    }
+    
+    /* Очередь для параллельного обхода таблицы conntrack */
+    if(0 != (ret = dpi_conntrack_pscan_startup())) {
+        dpi_conntrack_file_cleanup();
+        
+        return ret;
+    }
+    
     if(0 != (ret = dpi_conntrack_netns_startup())) {
+        dpi_conntrack_pscan_cleanup();
+        dpi_conntrack_file_cleanup();
+        
+        return ret;
+    }
+    
+    /* Семейство generic netlink (dump conntrack "файлов") */
+    if(0 != (ret = dpi_conntrack_netlink_startup())) {
+        dpi_conntrack_netns_cleanup();
+        dpi_conntrack_pscan_cleanup();
+        dpi_conntrack_file_cleanup();
+        
+        return ret;
+    }
+    
+    /* Отслеживание регистрации helper (загрузка и выгрузка модулей) */
+    if(0 != (ret = dpi_conntrack_filter_startup())) {
+        dpi_conntrack_netlink_cleanup();
+        dpi_conntrack_netns_cleanup();
+        dpi_conntrack_pscan_cleanup();
+        dpi_conntrack_file_cleanup();
+        
         return ret;
     }
     
@@ -53,9 +104,54 @@ static int __init dpi_conntrack_startup(void) {
     return 0;
 }
 
+/**
+ * Установка значения параметра debug
+ * 
+ * @param val
+ * @param kp
+ * @return 
+ */
+static int debug_set(const char *val, const struct kernel_param *kp) {
+    bool on;
+    int rv;
+    
+    if(0 != (rv = strtobool(val, &on))) {
+        return rv;
+    }
+    
+    if(on) {
+        static_branch_enable(&dpi_conntrack_debug_key);
+    } else {
+        static_branch_disable(&dpi_conntrack_debug_key);
+    }
+    
+    return 0;
+}
+
+/**
+ * Получение значения параметра debug
+ * 
+ * @param buffer
+ * @param kp
+ * @return 
+ */
+static int debug_get(char *buffer, const struct kernel_param *kp) {
+    return sprintf(buffer, "%c", static_key_enabled(&dpi_conntrack_debug_key) ? 'Y' : 'N');
+}
+
 /**
  * Освобождение ресурсов при выгрузке модуля
  */
 static void dpi_conntrack_cleanup(void) {
+    dpi_conntrack_filter_cleanup();
+    
+    /* Новые запросы dump больше не поступят, начатые - завершены */
+    dpi_conntrack_netlink_cleanup();
+    
     dpi_conntrack_netns_cleanup();
+    
+    dpi_conntrack_pscan_cleanup();
+    
+    /* Все "файлы" освобождены (rcu_barrier в dpi_conntrack_netns_cleanup) */
+    dpi_conntrack_file_cleanup();
 }
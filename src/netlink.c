@@ -0,0 +1,406 @@
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include <net/netlink.h>
+#include <net/genetlink.h>
+
+#include "dpi_conntrack_ko.h"
+
+/*
+ * Состояние dump (cb->args[0]): имя "файла" и курсор обхода.
+ *
+ * "Файл" между вызовами dumpit ищется заново (ссылка на него не удерживается),
+ * курсор продолжает обход с conntrack, который не поместился в предыдущее skb.
+ */
+struct nl_dump_state {
+    struct dpi_conntrack_cursor cursor;
+    char name[DPI_CONNTRACK_NAME_MAX];
+    /* Параметры DPI_CONNTRACK_CMD_TOP */
+    u32 top_key;
+    u32 top_n;
+    /* Результат DPI_CONNTRACK_CMD_TOP (строится первым вызовом dumpit) и
+     * кол-во уже выданных его элементов
+     */
+    struct dpi_conntrack_top *top;
+    u32 top_pos;
+};
+
+/* Предварительное объявление локальных функций модуля */
+static int nl_dump(struct sk_buff *skb, struct netlink_callback *cb);
+static int nl_top(struct sk_buff *skb, struct netlink_callback *cb);
+static int nl_flush(struct sk_buff *skb, struct genl_info *info);
+static int nl_dump_done(struct netlink_callback *cb);
+static struct nl_dump_state *nl_dump_state_new(struct netlink_callback *cb);
+
+/* Проверка атрибутов запроса */
+static const struct nla_policy nl_policy[DPI_CONNTRACK_A_MAX + 1] = {
+    [DPI_CONNTRACK_A_NAME] = { .type = NLA_NUL_STRING, .len = DPI_CONNTRACK_NAME_MAX - 1 },
+    [DPI_CONNTRACK_A_TOP_KEY] = { .type = NLA_U32 },
+    [DPI_CONNTRACK_A_TOP_N] = { .type = NLA_U32 },
+    [DPI_CONNTRACK_A_TIMEOUT] = { .type = NLA_U32 },
+};
+
+/* Семейство generic netlink (доступно в каждой netns) */
+static struct genl_family nl_family = {
+    .id      = GENL_ID_GENERATE,
+    .hdrsize = 0,
+    .name    = DPI_CONNTRACK_GENL_NAME,
+    .version = DPI_CONNTRACK_GENL_VERSION,
+    .maxattr = DPI_CONNTRACK_A_MAX,
+    .netnsok = true,
+};
+
+/* Команды семейства */
+static const struct genl_ops nl_ops[] = {
+    {
+        .cmd    = DPI_CONNTRACK_CMD_DUMP,
+        .flags  = GENL_ADMIN_PERM,
+        .policy = nl_policy,
+        .dumpit = nl_dump,
+        .done   = nl_dump_done,
+    },
+    {
+        .cmd    = DPI_CONNTRACK_CMD_TOP,
+        .flags  = GENL_ADMIN_PERM,
+        .policy = nl_policy,
+        .dumpit = nl_top,
+        .done   = nl_dump_done,
+    },
+    {
+        .cmd    = DPI_CONNTRACK_CMD_FLUSH,
+        .flags  = GENL_ADMIN_PERM,
+        .policy = nl_policy,
+        .doit   = nl_flush,
+    },
+};
+
+/**
+ * Регистрация семейства generic netlink
+ *
+ * @return
+ */
+int __init dpi_conntrack_netlink_startup(void) {
+    return genl_register_family_with_ops(&nl_family, nl_ops);
+}
+
+/**
+ * Отмена регистрации семейства generic netlink
+ */
+void dpi_conntrack_netlink_cleanup(void) {
+    genl_unregister_family(&nl_family);
+}
+
+/**
+ * Очередная порция ответа на DPI_CONNTRACK_CMD_DUMP
+ *
+ * @param skb
+ * @param cb
+ * @return длина данных в skb, 0 - dump завершен, -EAGAIN - dump завершен
+ * неполным (обход прекращен после изменения размера таблицы), ошибка
+ * передается в NLMSG_DONE
+ *
+ * В одно сообщение упаковываются записи до заполнения skb. conntrack, который
+ * не поместился, запоминается курсором и будет первым в следующем вызове.
+ * "Файл" найден в том же окружении rcu_read_lock, поэтому обход не может его
+ * снимать: при исчерпании бюджета участка (scan_chunk_*) вызов завершается
+ * досрочно, в т.ч. сообщением без записей.
+ */
+static int nl_dump(struct sk_buff *skb, struct netlink_callback *cb) {
+    /* Область в netns сокета, из которого пришел запрос */
+    struct dpi_conntrack_net *pernet = dpi_conntrack_pernet(sock_net(skb->sk));
+    struct nl_dump_state *ds = (struct nl_dump_state *)cb->args[0];
+    struct dpi_conntrack_file *f;
+    struct dpi_iterator *i;
+    void *hdr;
+    int n = 0;
+
+    if(NULL == ds) {
+        /* Первый вызов: разбор запроса */
+        if(IS_ERR(ds = nl_dump_state_new(cb))) {
+            if(-ENOMEM == PTR_ERR(ds)) {
+                dpi_conntrack_stats_inc(pernet->stats, alloc_failed);
+            }
+
+            return PTR_ERR(ds);
+        }
+
+        cb->args[0] = (long)ds;
+    }
+
+    dpi_conntrack_iter_reserve(&ds->cursor);
+
+    rcu_read_lock();
+
+    f = dpi_conntrack_file_find_rcu(pernet, ds->name);
+
+    if(NULL == ds->cursor.f) {
+        if(NULL == f) {
+            rcu_read_unlock();
+
+            return -ENOENT;
+        }
+
+        ds->cursor.f = f;
+        ds->cursor.gen = f->gen;
+    } else if((NULL == f) || (f->gen != ds->cursor.gen)) {
+        /* "Файл" снят с регистрации во время dump (возможно, зарегистрирован заново) */
+        rcu_read_unlock();
+
+        return 0;
+    }
+
+    hdr = genlmsg_put(skb, NETLINK_CB(cb->skb).portid, cb->nlh->nlmsg_seq,
+                      &nl_family, NLM_F_MULTI, DPI_CONNTRACK_CMD_DUMP);
+
+    if(NULL == hdr) {
+        rcu_read_unlock();
+
+        return -EMSGSIZE;
+    }
+
+    /* Продолжаем обход с сохраненной позиции (0 - новый обход) */
+    i = dpi_conntrack_iter_start(&ds->cursor, ds->cursor.pos);
+
+    while(i) {
+        struct dpi_conntrack_bin_record r;
+
+        if(0 == dpi_conntrack_record_fill(&r, dpi_conntrack_iter_ct(i), dpi_conntrack_iter_tuple(i), f)) {
+            if(nla_put(skb, DPI_CONNTRACK_A_RECORD, sizeof(r), &r)) {
+                /* skb заполнен, этот conntrack будет первым в следующем вызове */
+                break;
+            }
+
+            n++;
+        }
+
+        i = dpi_conntrack_iter_next(&ds->cursor, i);
+    }
+
+    dpi_conntrack_iter_stop(&ds->cursor, i);
+
+    rcu_read_unlock();
+
+    if((NULL == i) && ds->cursor.lost) {
+        /* Выдача неполна: записи этого сообщения отправляются, а NLMSG_DONE
+         * вместо 0 содержит -EAGAIN
+         */
+        if(n) {
+            genlmsg_end(skb, hdr);
+        } else {
+            genlmsg_cancel(skb, hdr);
+        }
+
+        return -EAGAIN;
+    }
+
+    if(!n && !ds->cursor.yield) {
+        /* Записей больше нет, пустое сообщение не отправляем */
+        genlmsg_cancel(skb, hdr);
+
+        return 0;
+    }
+
+    /* Сообщение без записей, если участок таблицы не содержал подходящих
+     * conntrack: dump продолжится следующим вызовом
+     */
+
+    genlmsg_end(skb, hdr);
+
+    dpi_conntrack_stats_add(pernet->stats, bytes, (u64)n * sizeof(struct dpi_conntrack_bin_record));
+
+    return skb->len;
+}
+
+/**
+ * Очередная порция ответа на DPI_CONNTRACK_CMD_TOP
+ *
+ * @param skb
+ * @param cb
+ * @return длина данных в skb, 0 - dump завершен
+ *
+ * Первый вызов выполняет весь обход "файла" (с приостановками между участками),
+ * далее результат выдается до заполнения skb.
+ */
+static int nl_top(struct sk_buff *skb, struct netlink_callback *cb) {
+    struct net *net = sock_net(skb->sk);
+    struct nl_dump_state *ds = (struct nl_dump_state *)cb->args[0];
+    void *hdr;
+    u32 n = 0;
+
+    if(NULL == ds) {
+        /* Первый вызов: разбор запроса */
+        if(IS_ERR(ds = nl_dump_state_new(cb))) {
+            if(-ENOMEM == PTR_ERR(ds)) {
+                dpi_conntrack_stats_inc(dpi_conntrack_pernet(net)->stats, alloc_failed);
+            }
+
+            return PTR_ERR(ds);
+        }
+
+        cb->args[0] = (long)ds;
+    }
+
+    if(NULL == ds->top) {
+        struct dpi_conntrack_top *top = dpi_conntrack_top_run(net, ds->name, ds->top_key, ds->top_n);
+
+        if(IS_ERR(top)) {
+            return PTR_ERR(top);
+        }
+
+        ds->top = top;
+    }
+
+    if(ds->top_pos >= ds->top->nr) {
+        return 0;
+    }
+
+    hdr = genlmsg_put(skb, NETLINK_CB(cb->skb).portid, cb->nlh->nlmsg_seq,
+                      &nl_family, NLM_F_MULTI, DPI_CONNTRACK_CMD_TOP);
+
+    if(NULL == hdr) {
+        return -EMSGSIZE;
+    }
+
+    while(ds->top_pos < ds->top->nr) {
+        const struct dpi_conntrack_top_entry *e = &ds->top->entries[ds->top_pos];
+        /* Значение и запись выдаются только вместе */
+        struct nlattr *mark = (struct nlattr *)skb_tail_pointer(skb);
+
+        if(nla_put_u64(skb, DPI_CONNTRACK_A_VALUE, e->value) ||
+           nla_put(skb, DPI_CONNTRACK_A_RECORD, sizeof(e->record), &e->record)) {
+            nlmsg_trim(skb, mark);
+
+            break;
+        }
+
+        ds->top_pos++;
+        n++;
+    }
+
+    if(!n) {
+        /* Не поместилось ни одной записи */
+        genlmsg_cancel(skb, hdr);
+
+        return -EMSGSIZE;
+    }
+
+    genlmsg_end(skb, hdr);
+
+    dpi_conntrack_stats_add(dpi_conntrack_pernet(net)->stats, bytes,
+                            (u64)n * sizeof(struct dpi_conntrack_bin_record));
+
+    return skb->len;
+}
+
+/**
+ * Обработка DPI_CONNTRACK_CMD_FLUSH
+ *
+ * @param skb
+ * @param info
+ * @return
+ *
+ * Ответ отправляется и в том случае, если обход прерван ошибкой (например,
+ * "файл" снят с регистрации) после обработки части conntrack: кол-во
+ * обработанных до этого conntrack и код ошибки (DPI_CONNTRACK_A_ERROR).
+ */
+static int nl_flush(struct sk_buff *skb, struct genl_info *info) {
+    char name[DPI_CONNTRACK_NAME_MAX];
+    struct sk_buff *msg;
+    void *hdr;
+    u64 started, done;
+    u32 timeout = 0;
+    bool retime = false;
+    int rv;
+
+    if(NULL == info->attrs[DPI_CONNTRACK_A_NAME]) {
+        return -EINVAL;
+    }
+
+    nla_strlcpy(name, info->attrs[DPI_CONNTRACK_A_NAME], sizeof(name));
+
+    if(info->attrs[DPI_CONNTRACK_A_TIMEOUT]) {
+        retime = true;
+        timeout = nla_get_u32(info->attrs[DPI_CONNTRACK_A_TIMEOUT]);
+    }
+
+    started = ktime_get_ns();
+
+    rv = dpi_conntrack_flush(genl_info_net(info), name, retime, timeout, &done);
+
+    if(rv && !done) {
+        return rv;
+    }
+
+    /* Часть conntrack обработана: кол-во сообщается вместе с ошибкой */
+
+    if(NULL == (msg = genlmsg_new(NLMSG_DEFAULT_SIZE, GFP_KERNEL))) {
+        return -ENOMEM;
+    }
+
+    if((NULL == (hdr = genlmsg_put_reply(msg, info, &nl_family, 0, DPI_CONNTRACK_CMD_FLUSH))) ||
+       nla_put_u64(msg, DPI_CONNTRACK_A_COUNT, done) ||
+       nla_put_u64(msg, DPI_CONNTRACK_A_ELAPSED_NS, ktime_get_ns() - started) ||
+       (rv && nla_put_u32(msg, DPI_CONNTRACK_A_ERROR, -rv))) {
+        nlmsg_free(msg);
+
+        return -EMSGSIZE;
+    }
+
+    genlmsg_end(msg, hdr);
+
+    return genlmsg_reply(msg, info);
+}
+
+/**
+ * Завершение dump (в т.ч. досрочное)
+ *
+ * @param cb
+ * @return
+ */
+static int nl_dump_done(struct netlink_callback *cb) {
+    struct nl_dump_state *ds = (struct nl_dump_state *)cb->args[0];
+
+    if(ds) {
+        dpi_conntrack_iter_release(&ds->cursor);
+
+        if(ds->top) {
+            dpi_conntrack_top_free(ds->top);
+        }
+    }
+
+    kfree(ds);
+
+    return 0;
+}
+
+/**
+ * Создание состояния dump по атрибутам запроса
+ *
+ * @param cb
+ * @return ERR_PTR при ошибке
+ */
+static struct nl_dump_state *nl_dump_state_new(struct netlink_callback *cb) {
+    struct nlattr *attrs[DPI_CONNTRACK_A_MAX + 1];
+    struct nl_dump_state *ds;
+    int rv;
+
+    if(0 != (rv = nlmsg_parse(cb->nlh, GENL_HDRLEN + nl_family.hdrsize, attrs,
+                              DPI_CONNTRACK_A_MAX, nl_policy))) {
+        return ERR_PTR(rv);
+    }
+
+    if(NULL == attrs[DPI_CONNTRACK_A_NAME]) {
+        return ERR_PTR(-EINVAL);
+    }
+
+    if(NULL == (ds = kzalloc(sizeof(struct nl_dump_state), GFP_KERNEL))) {
+        return ERR_PTR(-ENOMEM);
+    }
+
+    nla_strlcpy(ds->name, attrs[DPI_CONNTRACK_A_NAME], sizeof(ds->name));
+
+    ds->top_key = attrs[DPI_CONNTRACK_A_TOP_KEY] ? nla_get_u32(attrs[DPI_CONNTRACK_A_TOP_KEY]) : DPI_CONNTRACK_TOP_BYTES;
+    ds->top_n = attrs[DPI_CONNTRACK_A_TOP_N] ? nla_get_u32(attrs[DPI_CONNTRACK_A_TOP_N]) : DPI_CONNTRACK_TOP_DEFAULT;
+
+    return ds;
+}
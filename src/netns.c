@@ -8,6 +8,14 @@
 /* Предварительное описание локальных функций модуля */
 static int __net_init dpi_conntrack_net_init(struct net *net);
 static void __net_exit dpi_conntrack_net_exit(struct net *net);
+static void dpi_conntrack_net_release_file(void *ptr, void *arg);
+
+/* Поддерживать индекс conntrack по уведомлениям (nf_conntrack_netlink в той же
+ * netns в этом случае загрузить не удастся - получатель уведомлений один!)
+ */
+static bool events = true;
+module_param(events, bool, 0444);
+MODULE_PARM_DESC(events, "Maintain per-helper conntrack index from conntrack events");
 
 /* Идентификатор реализуемой нами подсистемы в netns */
 static int dpi_conntrack_net_id __read_mostly;
@@ -36,6 +44,9 @@ int __init dpi_conntrack_netns_startup(void) {
  */
 void dpi_conntrack_netns_cleanup(void) {
     unregister_pernet_subsys(&dpi_conntrack_net_ops);
+    
+    /* Дожидаемся освобождения ресурсов "файлов" (call_rcu) до выгрузки модуля */
+    rcu_barrier();
 }
 
 /**
@@ -62,14 +73,69 @@ static int __net_init dpi_conntrack_net_init(struct net *net) {
     /* Область в netns для нашей подсистемы */
     struct dpi_conntrack_net *pernet = dpi_conntrack_pernet(net);
     
-    /* Инициализация spinlock */
-    spin_lock_init(&pernet->lock);
+    int rv;
+    
+    /* Инициализируем таблицу с хранилищем зарегистрированных "файлов" */
+    if(0 != (rv = dpi_conntrack_files_init(pernet))) {
+        return rv;
+    }
+    
+    /* Инициализируем индекс conntrack */
+    if(0 != (rv = dpi_conntrack_index_init(pernet))) {
+        dpi_conntrack_files_destroy(pernet, NULL, NULL);
+        
+        return rv;
+    }
     
-    /* Инициализируем hashtable с хранилищем зарегистрированных "файлов" */
-    hash_init(pernet->files);
+    /* Таблица метаданных классификации conntrack */
+    if(0 != (rv = dpi_conntrack_meta_init(pernet))) {
+        dpi_conntrack_index_exit(pernet);
+        dpi_conntrack_files_destroy(pernet, NULL, NULL);
+        
+        return rv;
+    }
     
     /* Создаем каталог /proc/net/dpi для указанной netns */
     if(NULL == (pernet->proc_dpi = proc_mkdir(PROC_NET_DPI, net->proc_net))) {
+        dpi_conntrack_meta_exit(pernet);
+        dpi_conntrack_index_exit(pernet);
+        dpi_conntrack_files_destroy(pernet, NULL, NULL);
+        
+        return -ENOMEM;
+    }
+    
+    /* Счетчики и файл /proc/net/dpi/stats */
+    if(0 != dpi_conntrack_stats_init(pernet)) {
+        proc_remove(pernet->proc_dpi);
+        
+        dpi_conntrack_meta_exit(pernet);
+        dpi_conntrack_index_exit(pernet);
+        dpi_conntrack_files_destroy(pernet, NULL, NULL);
+        
+        return -ENOMEM;
+    }
+    
+    /* Индекс поддерживается только при наличии уведомлений conntrack, иначе
+     * при чтении "файлов" выполняется полный обход таблицы conntrack
+     */
+    pernet->events = events && (0 == dpi_conntrack_events_register(net));
+    
+    /* Управляющий файл /proc/net/dpi/control */
+    if(0 != dpi_conntrack_control_init(pernet, net)) {
+        if(pernet->events) {
+            dpi_conntrack_events_unregister(net);
+            
+            pernet->events = false;
+        }
+        
+        dpi_conntrack_stats_exit(pernet);
+        
+        proc_remove(pernet->proc_dpi);
+        
+        dpi_conntrack_meta_exit(pernet);
+        dpi_conntrack_index_exit(pernet);
+        dpi_conntrack_files_destroy(pernet, NULL, NULL);
+        
         return -ENOMEM;
     }
     
@@ -84,22 +150,64 @@ static int __net_init dpi_conntrack_net_init(struct net *net) {
 static void __net_exit dpi_conntrack_net_exit(struct net *net) {
     /* Область в netns для нашей подсистемы */
     struct dpi_conntrack_net *pernet = dpi_conntrack_pernet(net);
-    struct dpi_conntrack_file *f;
-    struct hlist_node *tmp;
-    int bkt;
+    LIST_HEAD(files);
     
-    rcu_read_lock();
+    /* Больше не принимаем команд (выполняющиеся записи завершены) */
+    dpi_conntrack_control_exit(pernet);
     
-    /* Убеждаемся в том, что для удаляемой netns у нас нет зарегистрированных элементов */
-    hash_for_each_safe(pernet->files, bkt, tmp, f, link) {
-        /* Найден зарегистрированный элемент, снять его с регистрации */
-        dpi_conntrack_procfs_unregister_file(f);
+    if(pernet->events) {
+        /* Больше не получаем уведомлений conntrack */
+        dpi_conntrack_events_unregister(net);
+        
+        WRITE_ONCE(pernet->events, false);
+        
+        /* Дожидаемся завершения уже выполняющихся обработчиков уведомлений
+         * и установок метаданных (events проверяется в окружении rcu_read_lock)
+         */
+        synchronize_rcu();
     }
     
-    rcu_read_unlock();
+    /* Убеждаемся в том, что для удаляемой netns у нас нет зарегистрированных
+     * элементов (оставшиеся снимаются с регистрации вместе с удалением таблицы)
+     */
+    dpi_conntrack_files_destroy(pernet, dpi_conntrack_net_release_file, &files);
+    
+    /* Файлы procfs "файлов" удаляются и "файлы" освобождаются до удаления
+     * каталога /proc/net/dpi, в котором эти файлы находятся
+     */
+    dpi_conntrack_procfs_destroy_files(&files);
+    
+    /* Элементы индекса освобождены вместе с "файлами" */
+    dpi_conntrack_index_exit(pernet);
+    
+    /* Метаданные больше не устанавливаются (events сброшен до grace period).
+     * conntrack netns еще существуют (pernet exit nf_conntrack выполняется
+     * после нашего), уведомлений об их уничтожении мы уже не получим, поэтому
+     * оставшиеся элементы освобождаются вместе с таблицей
+     */
+    dpi_conntrack_meta_exit(pernet);
+    
+    /* Счетчики больше не используются (обработчики уведомлений завершены,
+     * dump netlink и чтение "файлов" в этот момент невозможны)
+     */
+    dpi_conntrack_stats_exit(pernet);
     
     if(pernet->proc_dpi) {
         /* Удаляем каталог /proc/net/dpi */
         proc_remove(pernet->proc_dpi);
     }
 }
+
+/**
+ * Снятие с регистрации "файла", оставшегося в таблице удаляемой netns
+ * 
+ * @param ptr
+ * @param arg список освобождаемых "файлов"
+ */
+static void dpi_conntrack_net_release_file(void *ptr, void *arg) {
+    rcu_read_lock();
+    
+    dpi_conntrack_procfs_release_file(ptr, arg);
+    
+    rcu_read_unlock();
+}
@@ -2,49 +2,56 @@
 #include <linux/fs.h>
 #include <linux/seq_file.h>
 #include <linux/rcupdate.h>
-
-#include <linux/rculist_nulls.h>
-#include <net/netfilter/nf_conntrack_helper.h>
-
+#include <linux/vmalloc.h>
 
 #include "dpi_conntrack_ko.h"
+#include "trace.h"
 
-/* Данные итератора для последовательного чтения файла */
-struct ct2_iter_state {
-    /* Элемент должен присутствовать и обязательно быть первым! */
-    struct seq_net_private p;
-    /* Глобальный указатель на дескриптор */
-    struct dpi_conntrack_file *fg;
-    unsigned int bucket;
-    
-};
-
-struct dpi_iterator {
-    unsigned int bucket;
-    struct hlist_nulls_node *head;
-};
-
+/* Размер буфера seq_file для двоичного файла (на один вызов read()) */
+#define BIN_SEQ_BUF_SIZE    (256 * 1024)
+/* Максимальный размер фильтра дескриптора (один вызов write()) */
+#define FD_FILTER_SIZE_MAX  (64 * 1024)
 
 /* Предварительное объявление локальных функций модуля */
 static int dpi_file_open(struct inode *inode, struct file *file);
+static int dpi_file_release(struct inode *inode, struct file *file);
+static ssize_t dpi_file_write(struct file *file, const char __user *buf, size_t len, loff_t *ppos);
 static void *dpi_seq_start(struct seq_file *s, loff_t *pos) __acquires(RCU);
 static void *dpi_seq_next(struct seq_file *s, void *v, loff_t *pos);
 static void dpi_seq_stop(struct seq_file *s, void *v)  __releases(RCU);
 static int dpi_seq_show(struct seq_file *s, void *v);
-static void dpi_conntrack_file_cleanup_rcu(struct rcu_head *head);
+static int dpi_bin_open(struct inode *inode, struct file *file);
+static void *dpi_bin_start(struct seq_file *s, loff_t *pos) __acquires(RCU);
+static void *dpi_bin_next(struct seq_file *s, void *v, loff_t *pos);
+static void dpi_bin_stop(struct seq_file *s, void *v)  __releases(RCU);
+static int dpi_bin_show(struct seq_file *s, void *v);
+static int dpi_bin_release(struct inode *inode, struct file *file);
+static void *bin_snap_start(struct dpi_conntrack_cursor *st, loff_t pos);
+static void *bin_iter(struct dpi_conntrack_cursor *st, struct dpi_iterator *i);
+static int procfs_register_filter_locked(const char *name, struct net *net,
+                                         const struct dpi_conntrack_filter *filter,
+                                         bool seed);
+static int procfs_check_name_rcu(struct dpi_conntrack_net *pernet, const char *name);
+static int procfs_helper_filter(struct dpi_conntrack_filter *filter, const char *name);
+static bool procfs_unregister_file_rcu(struct dpi_conntrack_file *f, struct list_head *files);
+static void procfs_remove_file(struct dpi_conntrack_file *f);
+static int bin_write(struct seq_file *s, struct dpi_conntrack_stats __percpu *stats,
+                     const void *data, size_t len);
+static int open_failed(struct inode *inode);
 
-static struct dpi_iterator *ct_get_idx(struct dpi_iterator *i, struct dpi_conntrack_file *f, loff_t pos);
-static void ct_get_next(struct dpi_iterator *i, struct net *net);
-static void ct_get_first(struct dpi_iterator *i, struct net *net);
-static int is_this_helper(struct nf_conntrack_tuple_hash *hash, const char *name);
+static struct proc_dir_entry *create_sibling(struct dpi_conntrack_net *pernet, const char *name,
+                                             const char *suffix, umode_t mode,
+                                             const struct file_operations *fops,
+                                             struct dpi_conntrack_file *f);
 
 /* Набор операций для файла */
 static const struct file_operations file_ops = {
     .owner   = THIS_MODULE,
     .open    = dpi_file_open,
     .read    = seq_read,
+    .write   = dpi_file_write,
     .llseek  = seq_lseek,
-    .release = seq_release,
+    .release = dpi_file_release,
 };
 
 /* Набор операций для последовательного чтения файла */
@@ -55,28 +62,185 @@ static const struct seq_operations seq_ops = {
     .show  = dpi_seq_show
 };
 
+/* Набор операций для двоичного файла <name>.bin */
+static const struct file_operations bin_file_ops = {
+    .owner   = THIS_MODULE,
+    .open    = dpi_bin_open,
+    .read    = seq_read,
+    .write   = dpi_file_write,
+    .llseek  = seq_lseek,
+    .release = dpi_bin_release,
+};
+
+/* Набор операций для последовательного чтения двоичного файла */
+static const struct seq_operations bin_seq_ops = {
+    .start = dpi_bin_start,
+    .next  = dpi_bin_next,
+    .stop  = dpi_bin_stop,
+    .show  = dpi_bin_show
+};
+
+/* Суффиксы дополнительных файлов "файла" (все, с которыми вызывается create_sibling) */
+static const char * const sibling_suffixes[] = {
+    ".bin",
+    ".summary",
+    ".count",
+    ".estimate",
+    ".ring",
+    ".delta",
+    ".distinct",
+};
 
 
+/**
+ * Регистрация "файла" для conntrack, использующих helper с именем name
+ * 
+ * @param name
+ * @param net
+ * @return -EINVAL, если имя не короче DPI_CONNTRACK_HELPER_NAME_LEN
+ * (усеченное имя отбирало бы conntrack другого helper), далее - как
+ * dpi_conntrack_register_filter()
+ */
 int dpi_conntrack_register_file(const char *name, struct net *net) {
+    struct dpi_conntrack_filter filter;
+    int rv;
+    
+    if(0 != (rv = procfs_helper_filter(&filter, name))) {
+        return rv;
+    }
+    
+    return dpi_conntrack_register_filter(name, net, &filter);
+}
+EXPORT_SYMBOL_GPL(dpi_conntrack_register_file);
+
+/**
+ * Регистрация "файла" для conntrack, удовлетворяющих фильтру
+ * 
+ * @param name
+ * @param net
+ * @param filter
+ * @return -EINVAL, если фильтр некорректен или имя зарезервировано (в т.ч.
+ * содержит '/'), -EEXIST, если имя или имя одного из дополнительных файлов
+ * (<name>.bin и т.п.) уже занято в /proc/net/dpi
+ * 
+ * Индекс conntrack используется только для "файлов", фильтр которых состоит
+ * из одного helper с именем "файла". Для остальных при чтении выполняется
+ * обход таблицы conntrack с проверкой фильтра.
+ * 
+ * NB!
+ * Вызов может приостанавливать выполнение!
+ */
+int dpi_conntrack_register_filter(const char *name, struct net *net,
+                                  const struct dpi_conntrack_filter *filter) {
+    /* Область в netns для нашей подсистемы */
+    struct dpi_conntrack_net *pernet = dpi_conntrack_pernet(net);
+    int rv;
+    
+    mutex_lock(&pernet->files_lock);
+    
+    rv = procfs_register_filter_locked(name, net, filter, true);
+    
+    mutex_unlock(&pernet->files_lock);
+    
+    return rv;
+}
+EXPORT_SYMBOL_GPL(dpi_conntrack_register_filter);
+
+/**
+ * Регистрация группы "файлов" (как dpi_conntrack_register_file) одним
+ * изменением таблицы "файлов"
+ * 
+ * @param net
+ * @param names
+ * @param nr
+ * @return первая ошибка регистрации (остальные "файлы" при этом регистрируются)
+ * 
+ * Группа регистрируется под одним захватом files_lock (другие регистрации
+ * не вклиниваются между ее "файлами"), индексы вновь зарегистрированных
+ * "файлов" заполняются одним обходом таблицы conntrack.
+ * 
+ * NB!
+ * Вызов может приостанавливать выполнение!
+ */
+int dpi_conntrack_procfs_register_files(struct net *net, char * const *names, unsigned int nr) {
+    /* Область в netns для нашей подсистемы */
+    struct dpi_conntrack_net *pernet = dpi_conntrack_pernet(net);
+    struct dpi_conntrack_filter filter;
+    unsigned int n, added = 0;
+    int rv = 0;
+    
+    mutex_lock(&pernet->files_lock);
+    
+    for(n = 0;n < nr;n++) {
+        int err;
+        
+        if(0 == (err = procfs_helper_filter(&filter, names[n]))) {
+            err = procfs_register_filter_locked(names[n], net, &filter, false);
+        }
+        
+        if(0 == err) {
+            added++;
+        } else if(!rv) {
+            rv = err;
+        }
+    }
+    
+    if(added && pernet->events) {
+        /* Заполняем индексы уже существующими conntrack */
+        dpi_conntrack_index_seed_net(net);
+    }
+    
+    mutex_unlock(&pernet->files_lock);
+    
+    return rv;
+}
+
+/**
+ * Регистрация "файла" с фильтром
+ * 
+ * @param name
+ * @param net
+ * @param filter
+ * @param seed заполнить индекс уже существующими conntrack (false - индекс
+ * заполняет вызывающий, например, одним обходом для нескольких "файлов")
+ * @return 
+ * 
+ * NB!
+ * Вызывается под pernet->files_lock. Вызов может приостанавливать выполнение!
+ */
+static int procfs_register_filter_locked(const char *name, struct net *net,
+                                         const struct dpi_conntrack_filter *filter,
+                                         bool seed) {
     struct dpi_conntrack_file *fg;
+    struct dpi_conntrack_match match;
     int rv;
     /* Область в netns для нашей подсистемы */
     struct dpi_conntrack_net *pernet = dpi_conntrack_pernet(net);
     
+    if(0 != (rv = dpi_conntrack_filter_compile(&match, name, filter))) {
+        trace_dpi_conntrack_register(name, rv);
+        
+        return rv;
+    }
+    
     rcu_read_lock();
     
-    /* Убеждаемся в том, что данный файл пока отсутствует, выделяем память
-     * под его дескриптор и добавляем его в hashtable files в структуре pernet.
+    /* Убеждаемся в том, что имя и имена дополнительных файлов свободны (под
+     * files_lock это не может измениться), выделяем память под дескриптор
+     * и добавляем его в таблицу files в структуре pernet.
      */
-    rv = dpi_conntrack_file_new_rcu(net, pernet, name, &fg);
+    if(0 == (rv = procfs_check_name_rcu(pernet, name))) {
+        rv = dpi_conntrack_file_new_rcu(net, pernet, name, &match, &fg);
+    }
     
     rcu_read_unlock();
     
     if(!rv) {
         /* Ошибок нет, можно создавать файл с запрошенным именем */
-        struct proc_dir_entry *pde = proc_create_data(name, 0440, pernet->proc_dpi, &file_ops, fg);
+        /* Запись - фильтр дескриптора */
+        struct proc_dir_entry *pde = proc_create_data(name, 0640, pernet->proc_dpi, &file_ops, fg);
         
-        pr_info("dpi_conntrack_register_file: Create new procfs net file %s\n", name);
+        dpi_conntrack_debug("dpi_conntrack_register_file: Create new procfs net file %s\n", name);
         
         if(pde) {
             rcu_read_lock();
@@ -84,28 +248,116 @@ int dpi_conntrack_register_file(const char *name, struct net *net) {
             rcu_dereference(fg)->pde = pde;
             
             rcu_read_unlock();
+        }
+        
+        if(pde && (NULL == (fg->pde_bin = create_sibling(pernet, name, ".bin", 0640, &bin_file_ops, fg)))) {
+            /* Не удалось создать двоичный файл */
+            pde = NULL;
+        }
+        
+        if(pde && (NULL == (fg->pde_summary = create_sibling(pernet, name, ".summary", 0440, &dpi_conntrack_summary_fops, fg)))) {
+            pde = NULL;
+        }
+        
+        if(pde && (NULL == (fg->pde_count = create_sibling(pernet, name, ".count", 0440, &dpi_conntrack_count_fops, fg)))) {
+            pde = NULL;
+        }
+        
+        if(pde && (NULL == (fg->pde_estimate = create_sibling(pernet, name, ".estimate", 0440, &dpi_conntrack_estimate_fops, fg)))) {
+            pde = NULL;
+        }
+        
+        if(pde && fg->match.indexed) {
+            /* Кольцевые буферы событий (если включены параметром ring_pages) */
+            struct dpi_conntrack_ring *ring = dpi_conntrack_ring_new();
+            
+            if(ring) {
+                rcu_assign_pointer(fg->ring, ring);
+                
+                /* Для mmap с записью consumer нужен доступ на запись */
+                if(NULL == (fg->pde_ring = create_sibling(pernet, name, ".ring", 0640, &dpi_conntrack_ring_fops, fg))) {
+                    pde = NULL;
+                }
+            }
+        }
+        
+        if(pde && pernet->events && fg->match.indexed) {
+            /* Журнал изменений (если включен параметром delta_events) */
+            struct dpi_conntrack_delta *delta = dpi_conntrack_delta_new();
             
-            pr_info("dpi_conntrack_register_file: Create new procfs net file %s complete.\n", name);
+            if(delta) {
+                rcu_assign_pointer(fg->delta, delta);
+                
+                if(NULL == (fg->pde_delta = create_sibling(pernet, name, ".delta", 0440, &dpi_conntrack_delta_fops, fg))) {
+                    pde = NULL;
+                }
+            }
+        }
+        
+        if(pde && pernet->events && fg->match.indexed) {
+            /* Оценки кол-ва различных значений (если включены параметром sketch_bits) */
+            struct dpi_conntrack_sketch *sketch = dpi_conntrack_sketch_new();
+            
+            if(sketch) {
+                rcu_assign_pointer(fg->sketch, sketch);
+                
+                if(NULL == (fg->pde_distinct = create_sibling(pernet, name, ".distinct", 0440, &dpi_conntrack_sketch_fops, fg))) {
+                    pde = NULL;
+                }
+            }
+        }
+        
+        if(pde) {
+            if(seed && pernet->events && fg->match.indexed) {
+                /* Заполняем индекс уже существующими conntrack */
+                dpi_conntrack_index_seed(fg);
+            }
+            
+            dpi_conntrack_debug("dpi_conntrack_register_file: Create new procfs net file %s complete.\n", name);
         } else {
             /* Не удалось создать файл в procfs */
+            LIST_HEAD(files);
+            
             rcu_read_lock();
             
-            dpi_conntrack_procfs_unregister_file(fg);
+            procfs_unregister_file_rcu(fg, &files);
             
             rcu_read_unlock();
             
+            dpi_conntrack_procfs_destroy_files(&files);
+            
             rv = -ENOMEM;
         }
     }
+    
+    if(!rv) {
+        dpi_conntrack_stats_inc(pernet->stats, registered);
+    }
+    
+    trace_dpi_conntrack_register(name, rv);
 
     return rv;
 }
-EXPORT_SYMBOL_GPL(dpi_conntrack_register_file);
 
+/**
+ * Снятие "файла" с регистрации
+ * 
+ * @param name
+ * @param net
+ * @return -ENOENT, если "файл" не зарегистрирован
+ * 
+ * Ресурсы освобождаются до возврата из вызова.
+ * 
+ * NB!
+ * Вызов может приостанавливать выполнение!
+ */
 int dpi_conntrack_unregister_file(const char *name, struct net *net) {
     struct dpi_conntrack_file *f;
     /* Область в netns для нашей подсистемы */
     struct dpi_conntrack_net *pernet = dpi_conntrack_pernet(net);
+    LIST_HEAD(files);
+    
+    mutex_lock(&pernet->files_lock);
     
     rcu_read_lock();
     
@@ -113,153 +365,430 @@ int dpi_conntrack_unregister_file(const char *name, struct net *net) {
     f = dpi_conntrack_file_find_rcu(pernet, name);
     
     if(f) {
-        /* Запрос освобождения ресурсов */
-        dpi_conntrack_procfs_unregister_file(f);
+        /* Удаляем элемент из таблицы */
+        procfs_unregister_file_rcu(f, &files);
     }
     
     rcu_read_unlock();
     
+    /* Файлы procfs удаляются вне rcu_read_lock: удаление ожидает читателей */
+    dpi_conntrack_procfs_destroy_files(&files);
+    
+    mutex_unlock(&pernet->files_lock);
+    
     /* Возвращаем результат операции */
     return f ? 0 : -ENOENT;
 }
 EXPORT_SYMBOL_GPL(dpi_conntrack_unregister_file);
 
 /**
- * Запрос освобождения ресурсов
+ * Кол-во conntrack, использующих helper с указанным именем
+ * 
+ * @param name
+ * @param net
+ * @return -ENOENT, если "файл" не зарегистрирован,
+ * -EOPNOTSUPP, если индекс conntrack не поддерживается (в т.ч. для "файла"
+ * с фильтром)
+ * 
+ * Значение берется из индекса и может включать еще не удаленные устаревшие
+ * элементы (они удаляются при чтении "файла").
+ */
+int dpi_conntrack_count(const char *name, struct net *net) {
+    struct dpi_conntrack_file *f;
+    /* Область в netns для нашей подсистемы */
+    struct dpi_conntrack_net *pernet = dpi_conntrack_pernet(net);
+    int rv;
+    
+    if(!pernet->events) {
+        return -EOPNOTSUPP;
+    }
+    
+    rcu_read_lock();
+    
+    /* Найти существующий элемент */
+    f = dpi_conntrack_file_find_rcu(pernet, name);
+    
+    rv = f ? (f->match.indexed ? atomic_read(&f->count) : -EOPNOTSUPP) : -ENOENT;
+    
+    rcu_read_unlock();
+    
+    return rv;
+}
+EXPORT_SYMBOL_GPL(dpi_conntrack_count);
+
+/**
+ * Удаление элемента из таблицы
  * 
  * @param f
+ * @param files список освобождаемых "файлов"
+ * @return false, если элемент уже удален (например, параллельным вызовом)
+ * 
+ * Освобождение выполняет только тот, кто удалил элемент из таблицы.
+ * 
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
  */
-void dpi_conntrack_procfs_unregister_file(struct dpi_conntrack_file *f) {
-    /* Удаляем элемент из таблицы (д.б. в окружении rcu_read_lock!) */
-    hash_del_rcu(&f->link);
+static bool procfs_unregister_file_rcu(struct dpi_conntrack_file *f, struct list_head *files) {
+    if(0 != dpi_conntrack_file_remove(dpi_conntrack_pernet(f->net), f)) {
+        return false;
+    }
+    
+    dpi_conntrack_procfs_release_file(f, files);
+    
+    return true;
+}
 
-    /* Ресурсы можно освобождать после истечения grace period */
-    call_rcu(&f->rcu, dpi_conntrack_file_cleanup_rcu);
+/**
+ * Подготовка к освобождению элемента, уже удаленного из таблицы
+ * 
+ * @param f
+ * @param files список, в который добавляется "файл"
+ * 
+ * Ресурсы освобождаются вызовом dpi_conntrack_procfs_destroy_files() для
+ * всего списка.
+ * 
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+void dpi_conntrack_procfs_release_file(struct dpi_conntrack_file *f, struct list_head *files) {
+    trace_dpi_conntrack_unregister(f->name);
+    
+    dpi_conntrack_stats_inc(dpi_conntrack_pernet(f->net)->stats, unregistered);
+    
+    /* Исключаем элементы индекса conntrack из поиска */
+    dpi_conntrack_index_release(dpi_conntrack_pernet(f->net), f);
+    
+    if(f->delta) {
+        /* Ожидающие изменений читатели завершают read() */
+        dpi_conntrack_delta_shutdown(f->delta);
+    }
+    
+    list_add_tail(&f->release, files);
 }
 
 /**
- * Операция открытия файла для последовательного чтения
+ * Освобождение ресурсов списка "файлов"
  * 
- * @param inode
- * @param file
- * @return 
+ * @param files "файлы", подготовленные dpi_conntrack_procfs_release_file()
+ * 
+ * Сначала удаляются файлы procfs (с ожиданием читателей, которые могут
+ * приостанавливать выполнение), затем после одного на весь список grace
+ * period освобождается память.
+ * 
+ * NB!
+ * Вызов может приостанавливать выполнение!
  */
-static int dpi_file_open(struct inode *inode, struct file *file) {
-    int rv = seq_open(file, &seq_ops);
+void dpi_conntrack_procfs_destroy_files(struct list_head *files) {
+    struct dpi_conntrack_file *f, *tmp;
     
-    if(!rv) {
-        /* Файл успешно открыт */
-        struct seq_file *s = file->private_data;
-        
-        /* struct dpi_conntrack_file *fg переносим в seq_file->private */
-        s->private = PDE_DATA(inode);
+    if(list_empty(files)) {
+        return;
     }
     
-    return rv;
+    list_for_each_entry(f, files, release) {
+        procfs_remove_file(f);
+    }
+    
+    /* Обработчики уведомлений и поиск по имени больше не используют "файлы" */
+    synchronize_rcu();
+    
+    list_for_each_entry_safe(f, tmp, files, release) {
+        dpi_conntrack_file_free(f);
+    }
+    
+    INIT_LIST_HEAD(files);
 }
 
 /**
+ * Снятие с регистрации группы "файлов" с ожиданием одного grace period
  * 
- * @param s
- * @param pos
- * @return 
+ * @param net
+ * @param names
+ * @param nr
+ * @return -ENOENT, если хотя бы один из "файлов" не зарегистрирован
+ * (остальные при этом снимаются с регистрации)
  * 
- * Возвращает итератор начиная с позиции *pos
+ * В отличие от dpi_conntrack_unregister_file ожидание grace period
+ * выполняется однократно для всех "файлов" группы.
+ * 
+ * NB!
+ * Вызов может приостанавливать выполнение!
  */
-static void *dpi_seq_start(struct seq_file *s, loff_t *pos) __acquires(RCU) {
-    /* Создаем итератор */
-    struct dpi_iterator *i = kzalloc(sizeof(struct dpi_iterator), GFP_ATOMIC);
+int dpi_conntrack_procfs_unregister_files(struct net *net, char * const *names, unsigned int nr) {
+    /* Область в netns для нашей подсистемы */
+    struct dpi_conntrack_net *pernet = dpi_conntrack_pernet(net);
+    LIST_HEAD(files);
+    unsigned int n;
+    int rv = 0;
     
-    if(i) {
-        /* Итератор создан */
-        struct dpi_iterator *first;
-        
-        rcu_read_lock();
-        
-        /* Определяем первую подходящую позицию */
-        first = ct_get_idx(i, rcu_dereference(s->private), *pos);
+    mutex_lock(&pernet->files_lock);
+    
+    rcu_read_lock();
+    
+    for(n = 0;n < nr;n++) {
+        struct dpi_conntrack_file *f = dpi_conntrack_file_find_rcu(pernet, names[n]);
         
-        rcu_read_unlock();
+        if((NULL == f) || !procfs_unregister_file_rcu(f, &files)) {
+            rv = -ENOENT;
+        }
+    }
+    
+    rcu_read_unlock();
+    
+    /* Один grace period на всю группу */
+    dpi_conntrack_procfs_destroy_files(&files);
+    
+    mutex_unlock(&pernet->files_lock);
+    
+    return rv;
+}
 
-        pr_info("dpi_seq_start(...) with first=0x%llx\n", (u64)first);
+/**
+ * Проверка имени нового "файла"
+ * 
+ * @param pernet
+ * @param name
+ * @return -EINVAL, если имя не может быть именем "файла" (пустое, содержит
+ * '/', "." и "..", имена служебных файлов /proc/net/dpi), -EEXIST, если имя
+ * совпадает с дополнительным файлом зарегистрированного "файла" (sip.bin
+ * при зарегистрированном sip) или наоборот
+ * 
+ * Совпадение с именем самого "файла" проверяется при добавлении в таблицу.
+ * 
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ * под pernet->files_lock.
+ */
+static int procfs_check_name_rcu(struct dpi_conntrack_net *pernet, const char *name) {
+    char buf[DPI_CONNTRACK_NAME_MAX];
+    size_t len = strlen(name);
+    unsigned int n;
+    
+    if((0 == len) || strchr(name, '/') ||
+       (0 == strcmp(name, ".")) || (0 == strcmp(name, "..")) ||
+       (0 == strcmp(name, PROC_NET_DPI_STATS)) || (0 == strcmp(name, PROC_NET_DPI_CONTROL))) {
+        return -EINVAL;
+    }
+    
+    if(len >= DPI_CONNTRACK_NAME_MAX) {
+        /* Отвергается при добавлении в таблицу */
+        return 0;
+    }
+    
+    for(n = 0;n < ARRAY_SIZE(sibling_suffixes);n++) {
+        size_t slen = strlen(sibling_suffixes[n]);
         
-        if(first) {
-            /* Итератор на первую позицию */
-            return first;
+        /* name - дополнительный файл зарегистрированного "файла" */
+        if((len > slen) && (0 == strcmp(name + len - slen, sibling_suffixes[n]))) {
+            memcpy(buf, name, len - slen);
+            buf[len - slen] = '\0';
+            
+            if(dpi_conntrack_file_find_rcu(pernet, buf)) {
+                return -EEXIST;
+            }
         }
         
-        /* Нет ни одной записи, освобождаем память */
-        kfree(i);
+        /* Дополнительный файл name - зарегистрированный "файл" */
+        if(len + slen < DPI_CONNTRACK_NAME_MAX) {
+            memcpy(buf, name, len);
+            memcpy(buf + len, sibling_suffixes[n], slen + 1);
+            
+            if(dpi_conntrack_file_find_rcu(pernet, buf)) {
+                return -EEXIST;
+            }
+        }
     }
     
-    /* Нет действующего итератора */
-    return NULL;
+    return 0;
 }
 
 /**
- * Перемещение итератора на следующую позицию
+ * Фильтр "файла" для conntrack, использующих helper с именем name
  * 
- * @param s
- * @param v
- * @param pos
- * @return 
+ * @param filter
+ * @param name
+ * @return -EINVAL, если имя не помещается в имя helper
  */
-static void *dpi_seq_next(struct seq_file *s, void *v, loff_t *pos) {
-    if(v) {
-        struct dpi_conntrack_file *f;
-        struct dpi_iterator *i = v;
-        
-        (*pos)++;
-
-        rcu_read_lock();
+static int procfs_helper_filter(struct dpi_conntrack_filter *filter, const char *name) {
+    if(strnlen(name, DPI_CONNTRACK_HELPER_NAME_LEN) >= DPI_CONNTRACK_HELPER_NAME_LEN) {
+        return -EINVAL;
+    }
+    
+    memset(filter, 0, sizeof(*filter));
+    
+    filter->nr_helpers = 1;
+    strlcpy(filter->helpers[0], name, DPI_CONNTRACK_HELPER_NAME_LEN);
+    
+    return 0;
+}
 
-        f = rcu_dereference(s->private);
+/**
+ * Создание дополнительного файла <name><suffix> в /proc/net/dpi
+ * 
+ * @param pernet
+ * @param name
+ * @param suffix
+ * @param mode
+ * @param fops
+ * @param f
+ * @return 
+ */
+static struct proc_dir_entry *create_sibling(struct dpi_conntrack_net *pernet, const char *name,
+                                             const char *suffix, umode_t mode,
+                                             const struct file_operations *fops,
+                                             struct dpi_conntrack_file *f) {
+    struct proc_dir_entry *pde;
+    char *fname = kasprintf(GFP_KERNEL, "%s%s", name, suffix);
+    
+    if(NULL == fname) {
+        /* Память не выделена */
+        return NULL;
+    }
+    
+    /* procfs копирует имя, поэтому буфер можно сразу освободить */
+    pde = proc_create_data(fname, mode, pernet->proc_dpi, fops, f);
+    
+    kfree(fname);
+    
+    return pde;
+}
 
-        pr_info("dpi_seq_next(...) for %s\n", f->name);
-        
-        do {
-            ct_get_next(i, f->net);
-        } while(i->head && !is_this_helper((struct nf_conntrack_tuple_hash *)i->head, f->name));
-        
-        rcu_read_unlock();
-        
-        /* Если еще есть элементы, то возвращаем итератор */
-        return i->head ? i : NULL;
+/**
+ * Операция открытия файла для последовательного чтения
+ * 
+ * @param inode
+ * @param file
+ * @return 
+ */
+static int dpi_file_open(struct inode *inode, struct file *file) {
+    /* Память под курсор обхода (обнуленная) размещается в seq_file->private */
+    struct dpi_conntrack_cursor *st = __seq_open_private(file, &seq_ops, sizeof(struct dpi_conntrack_cursor));
+    
+    if(NULL == st) {
+        return open_failed(inode);
     }
     
-    return NULL;
+    /* Файл успешно открыт, struct dpi_conntrack_file *fg переносим в состояние */
+    st->f = PDE_DATA(inode);
+    /* "Файл" не освобождается, пока открыт (read() может приостанавливаться) */
+    st->preemptible = true;
+    
+    return 0;
+}
 
-#if 0    
-#if 1
-    (*pos)++;
+/**
+ * Закрытие файла
+ * 
+ * @param inode
+ * @param file
+ * @return 
+ */
+static int dpi_file_release(struct inode *inode, struct file *file) {
+    struct seq_file *s = file->private_data;
+    struct dpi_conntrack_cursor *st = s->private;
+    
+    dpi_conntrack_fd_filter_free(st->ff);
+    dpi_conntrack_iter_release(st);
+    
+    return seq_release_private(inode, file);
+}
 
-    if(v) {
-        struct dpi_conntrack_file *f;
-        
-        rcu_read_lock();
-        
-        /* Наша управляющая структура */
-        f = rcu_dereference(s->private);
+/**
+ * Запись фильтра дескриптора (<name> и <name>.bin)
+ * 
+ * @param file
+ * @param buf текст фильтра (см. dpi_conntrack_fd_filter_parse), пустой - фильтр снимается
+ * @param len
+ * @param ppos не изменяется
+ * @return 
+ * 
+ * Каждый вызов заменяет фильтр целиком. Фильтр применяется к обходу,
+ * начатому после записи (чтение с начала файла), и проверяется в цикле
+ * обхода вместе с фильтром "файла", поэтому неподходящие conntrack
+ * не копируются в userspace.
+ */
+static ssize_t dpi_file_write(struct file *file, const char __user *buf, size_t len, loff_t *ppos) {
+    struct seq_file *s = file->private_data;
+    struct dpi_conntrack_cursor *st = s->private;
+    struct dpi_conntrack_fd_filter *ff;
+    char *text;
+    
+    if(len > FD_FILTER_SIZE_MAX) {
+        return -E2BIG;
+    }
+    
+    if(NULL == (text = vmalloc(len + 1))) {
+        dpi_conntrack_stats_inc(dpi_conntrack_pernet(st->f->net)->stats, alloc_failed);
         
-        pr_info("dpi_seq_next(...) for %s\n", f->name);
+        return -ENOMEM;
+    }
+    
+    if(copy_from_user(text, buf, len)) {
+        vfree(text);
         
-        rcu_read_unlock();
+        return -EFAULT;
     }
     
-    return NULL;
-#else
-    struct ct2_iter_state *st = s->private;
-    struct dpi_conntrack_file *f = rcu_dereference(st->fg);
+    text[len] = '\0';
     
-    (*pos)++;
+    ff = dpi_conntrack_fd_filter_parse(text);
+    
+    vfree(text);
+    
+    if(IS_ERR(ff)) {
+        return PTR_ERR(ff);
+    }
+    
+    /* Блокировка seq_file удерживается read() на время обхода */
+    mutex_lock(&s->lock);
+    
+    swap(st->ff, ff);
+    
+    /* Сохраненная позиция относится к обходу с прежним фильтром */
+    st->saved = false;
+    
+    mutex_unlock(&s->lock);
+    
+    dpi_conntrack_fd_filter_free(ff);
+    
+    return len;
+}
+
+/**
+ * 
+ * @param s
+ * @param pos
+ * @return 
+ * 
+ * Возвращает итератор начиная с позиции *pos
+ */
+static void *dpi_seq_start(struct seq_file *s, loff_t *pos) __acquires(RCU) {
+    dpi_conntrack_iter_reserve(s->private);
+    
+    /* Доступ к conntrack и индексу сохраняется до вызова dpi_seq_stop() */
+    rcu_read_lock();
     
-    do {
-        v = ct_get_next(s, v);
-    } while(v && !is_this_helper((struct nf_conntrack_tuple_hash *)v, f->name));
+    return dpi_conntrack_iter_start(s->private, *pos);
+}
+
+/**
+ * Перемещение итератора на следующую позицию
+ * 
+ * @param s
+ * @param v
+ * @param pos
+ * @return 
+ */
+static void *dpi_seq_next(struct seq_file *s, void *v, loff_t *pos) {
+    (*pos)++;
     
-    return v;
-#endif
-#endif
+    return dpi_conntrack_iter_next(s->private, v);
 }
 
 /**
@@ -269,183 +798,306 @@ static void *dpi_seq_next(struct seq_file *s, void *v, loff_t *pos) {
  * @param v
  */
 static void dpi_seq_stop(struct seq_file *s, void *v)  __releases(RCU) {
-    pr_info("dpi_seq_stop(...) for v=0x%llx\n", (u64)v);
-        
-    if(v) {
-        /* Освобождаем память итератора */
-        kfree(v);
-
-#if 0        
-        struct dpi_conntrack_file *f;
-        
-        rcu_read_lock();
-        
-        /* Наша управляющая структура */
-        f = rcu_dereference(s->private);
-        
-        pr_info("Destroy iterator for %s\n", f->name);
-        
-        rcu_read_unlock();
-#endif        
-    }
+    dpi_conntrack_iter_stop(s->private, v);
+    
+    /* Окончание доступа к conntrack и индексу (начат в dpi_seq_start) */
+    rcu_read_unlock();
 }
 
 static int dpi_seq_show(struct seq_file *s, void *v) {
     if(v) {
-        struct dpi_conntrack_file *f;
-        
-        rcu_read_lock();
-        
-        /* Наша управляющая структура */
-        f = rcu_dereference(s->private);
-        
-        pr_info("dpi_seq_show(...) for %s\n", f->name);
+        struct dpi_conntrack_cursor *st = s->private;
         
-        rcu_read_unlock();
+        dpi_conntrack_debug("dpi_seq_show(...) for %s\n", st->f->name);
     }
     
     return 0;
 }
 
 /**
- * Освобождение ресурсов после истечения RCU grace period
+ * Операция открытия двоичного файла для последовательного чтения
+ * 
+ * @param inode
+ * @param file
+ * @return 
  * 
- * @param head
+ * Буфер seq_file выделяется сразу большого размера, чтобы один вызов read()
+ * мог вернуть много записей.
  */
-static void dpi_conntrack_file_cleanup_rcu(struct rcu_head *head) {
-    struct dpi_conntrack_file *f;
-
-    f = container_of(head, struct dpi_conntrack_file, rcu);
-
-    /* Удаляем файл с запрошенным именем - только по окончании работы с ним! */
-    if(f->pde) {
-        /* Удаляем элемент из procfs */
-        proc_remove(f->pde);
-        
-        pr_info("dpi_conntrack_file_cleanup_rcu: Remove procfs net file\n");
-        
-        /* Освободить ресурсы */
-        dpi_conntrack_file_free(f);
+static int dpi_bin_open(struct inode *inode, struct file *file) {
+    struct dpi_conntrack_cursor *st = __seq_open_private(file, &bin_seq_ops, sizeof(struct dpi_conntrack_cursor));
+    struct seq_file *s;
+    
+    if(NULL == st) {
+        return open_failed(inode);
+    }
+    
+    st->f = PDE_DATA(inode);
+    st->preemptible = true;
+    
+    s = file->private_data;
+    
+    /* Буфер освобождается в seq_release_private (kvfree) */
+    if(NULL != (s->buf = vmalloc(BIN_SEQ_BUF_SIZE))) {
+        s->size = BIN_SEQ_BUF_SIZE;
     }
+    
+    return 0;
 }
 
 /**
  * 
- * @param i
- * @param f
+ * @param s
  * @param pos
  * @return 
  * 
- * NB!
- * Данный вызов всегда должен выполняться в окружении
- * rcu_read_lock();
- * rcu_read_unlock();
+ * Позиция 0 - заголовок, позиция N - запись N-1
  */
-static struct dpi_iterator *ct_get_idx(struct dpi_iterator *i, struct dpi_conntrack_file *f, loff_t pos) {
-    /* Попытка найти первую не нулевую позицию */
-    ct_get_first(i, f->net);
-    
-    pr_info("ct_get_first return head=0x%llx\n",(u64)i->head);
+static void *dpi_bin_start(struct seq_file *s, loff_t *pos) __acquires(RCU) {
+    struct dpi_conntrack_cursor *st = s->private;
     
-    while(i->head) {
-        if(is_this_helper((struct nf_conntrack_tuple_hash *)i->head, f->name)) {
-            if(!pos) {
-                /* Найдена подходящая нам позиция */
-                return i;
-            }
-            
-            pos--;
-        }
+    if(0 == *pos) {
+        /* Чтение с начала: снимок (или параллельный обход) получаем заново,
+         * при нехватке памяти выполняется последовательный обход
+         */
+        dpi_conntrack_snapshot_put(st->snap);
         
-        /* Переходим к следующему connection */
-        ct_get_next(i, f->net);
+        /* Снимок общий для всех читателей, с фильтром дескриптора - только обход */
+        st->snap = st->ff ? NULL : dpi_conntrack_snapshot_get(st->f);
+    }
+    
+    if(NULL == st->snap) {
+        dpi_conntrack_iter_reserve(st);
+    }
+    
+    /* Доступ к conntrack и индексу сохраняется до вызова dpi_bin_stop() */
+    rcu_read_lock();
+    
+    if(*pos && st->lost) {
+        /* Обход уже прекращен с неполной выдачей: ошибка до чтения с начала */
+        return ERR_PTR(-EAGAIN);
+    }
+    
+    if(st->snap) {
+        return *pos ? bin_snap_start(st, *pos - 1) : SEQ_START_TOKEN;
     }
-  
-    /* Больше нет подходящих нам позиций */
-    return NULL;
+    
+    return *pos ? bin_iter(st, dpi_conntrack_iter_start(st, *pos - 1)) : SEQ_START_TOKEN;
 }
 
-
 /**
+ * Результат обхода для seq_file
  * 
+ * @param st
  * @param i
- * @param net
- * @return 
+ * @return ERR_PTR(-EAGAIN), если обход прекращен с неполной выдачей
+ * (st->lost): seq_read() возвращает ошибку вместо конца файла (уже
+ * сформированные записи выдаются, ошибка - следующим вызовом read())
+ */
+static void *bin_iter(struct dpi_conntrack_cursor *st, struct dpi_iterator *i) {
+    if((NULL == i) && st->lost) {
+        return ERR_PTR(-EAGAIN);
+    }
+    
+    return i;
+}
+
+/**
+ * Позиция pos в снимке
  * 
- * NB!
- * Данный вызов всегда должен выполняться в окружении
- * rcu_read_lock();
- * rcu_read_unlock();
+ * @param st
+ * @param pos
+ * @return 
  */
-static void ct_get_next(struct dpi_iterator *i, struct net *net) {
-    i->head = rcu_dereference(hlist_nulls_next_rcu(i->head));
+static void *bin_snap_start(struct dpi_conntrack_cursor *st, loff_t pos) {
+    st->pos = pos;
     
-    while(is_a_nulls(i->head)) {
-        if (likely(get_nulls_value(i->head) == i->bucket)) {
-            if (++i->bucket >= net->ct.htable_size) {
-                i->head = NULL;
-                
-                break;
-            }
-        }
+    return (void *)dpi_conntrack_snapshot_record(st->snap, pos);
+}
 
-        i->head = rcu_dereference(hlist_nulls_first_rcu(&net->ct.hash[i->bucket]));
+/**
+ * Перемещение итератора на следующую позицию
+ * 
+ * @param s
+ * @param v
+ * @param pos
+ * @return 
+ */
+static void *dpi_bin_next(struct seq_file *s, void *v, loff_t *pos) {
+    struct dpi_conntrack_cursor *st = s->private;
+    
+    (*pos)++;
+    
+    if(st->snap) {
+        /* Записи уже сформированы */
+        return bin_snap_start(st, *pos - 1);
     }
+    
+    /* После заголовка - первая запись */
+    return bin_iter(st, (SEQ_START_TOKEN == v) ? dpi_conntrack_iter_start(st, 0) : dpi_conntrack_iter_next(st, v));
 }
 
-
 /**
+ * Завершение процесса итерации 
  * 
- * @param i
- * @param net
+ * @param s
+ * @param v
+ */
+static void dpi_bin_stop(struct seq_file *s, void *v)  __releases(RCU) {
+    struct dpi_conntrack_cursor *st = s->private;
+    
+    if((SEQ_START_TOKEN != v) && (NULL == st->snap)) {
+        /* Ошибка bin_iter() - конец обхода */
+        dpi_conntrack_iter_stop(st, IS_ERR(v) ? NULL : v);
+    }
+    
+    /* Окончание доступа к conntrack и индексу (начат в dpi_bin_start) */
+    rcu_read_unlock();
+}
+
+/**
+ * Вывод заголовка или очередной записи
  * 
- * NB!
- * Данный вызов всегда должен выполняться в окружении
- * rcu_read_lock();
- * rcu_read_unlock();
+ * @param s
+ * @param v
+ * @return 
  */
-static void ct_get_first(struct dpi_iterator *i, struct net *net) {
-    for(i->bucket = 0;i->bucket < net->ct.htable_size;i->bucket++) {
-        i->head = rcu_dereference(hlist_nulls_first_rcu(&net->ct.hash[i->bucket]));
-        if(!is_a_nulls(i->head)) {
-            /* i->head != NULL */
-            return;
+static int dpi_bin_show(struct seq_file *s, void *v) {
+    struct dpi_conntrack_cursor *st = s->private;
+    struct dpi_conntrack_stats __percpu *stats = dpi_conntrack_pernet(st->f->net)->stats;
+    
+    if(SEQ_START_TOKEN == v) {
+        struct dpi_conntrack_bin_header h;
+        
+        dpi_conntrack_record_header(&h);
+        
+        if(st->snap && st->snap->generation) {
+            /* Записи будут выданы из сохраненного снимка "файла" */
+            h.flags |= DPI_CONNTRACK_BIN_F_SNAPSHOT;
+            h.generation = st->snap->generation;
+            h.age_ns = ktime_get_ns() - st->snap->built;
+        }
+        
+        return bin_write(s, stats, &h, sizeof(h));
+    } else if(st->snap) {
+        /* Запись снимка */
+        return bin_write(s, stats, v, sizeof(struct dpi_conntrack_bin_record));
+    } else {
+        struct dpi_conntrack_bin_record r;
+        
+        if(dpi_conntrack_record_fill(&r, dpi_conntrack_iter_ct(v), dpi_conntrack_iter_tuple(v), st->f)) {
+            /* conntrack уничтожен за время обхода, пропускаем его */
+            return SEQ_SKIP;
         }
+        
+        return bin_write(s, stats, &r, sizeof(r));
     }
-    
-    i->head = NULL;
 }
 
+/**
+ * Закрытие двоичного файла
+ * 
+ * @param inode
+ * @param file
+ * @return 
+ */
+static int dpi_bin_release(struct inode *inode, struct file *file) {
+    struct seq_file *s = file->private_data;
+    struct dpi_conntrack_cursor *st = s->private;
+    
+    dpi_conntrack_snapshot_put(st->snap);
+    dpi_conntrack_fd_filter_free(st->ff);
+    dpi_conntrack_iter_release(st);
+    
+    return seq_release_private(inode, file);
+}
 
 /**
+ * Запись в буфер seq_file с учетом выданных байт
  * 
- * @param hash
- * @param name
+ * @param s
+ * @param stats
+ * @param data
+ * @param len
  * @return 
  * 
- * NB!
- * Данный вызов всегда должен выполняться в окружении
- * rcu_read_lock();
- * rcu_read_unlock();
+ * При переполнении буфера seq_file повторит вывод элемента, поэтому
+ * учитываются только успешно записанные данные.
  */
-static int is_this_helper(struct nf_conntrack_tuple_hash *hash, const char *name) {
-    struct nf_conn *ct = nf_ct_tuplehash_to_ctrack(hash);
-    struct nf_conn_help *help = nfct_help(ct);
+static int bin_write(struct seq_file *s, struct dpi_conntrack_stats __percpu *stats,
+                     const void *data, size_t len) {
+    int rv = seq_write(s, data, len);
     
-    pr_info("is_this_helper: ct=0x%llx help=0x%llx\n", (u64)ct, (u64)help);
+    if(!rv) {
+        dpi_conntrack_stats_add(stats, bytes, len);
+    }
     
-    if(help) {
-        struct nf_conntrack_helper __rcu *helper;
+    return rv;
+}
+
+/**
+ * Учет неудачного открытия "файла" (не выделена память под курсор обхода)
+ * 
+ * @param inode
+ * @return -ENOMEM
+ */
+static int open_failed(struct inode *inode) {
+    struct dpi_conntrack_file *f = PDE_DATA(inode);
+    
+    dpi_conntrack_stats_inc(dpi_conntrack_pernet(f->net)->stats, alloc_failed);
     
-        helper = rcu_dereference(help->helper);
+    return -ENOMEM;
+}
 
-        if(helper) {
-            pr_info("is_this_helper: %s %s\n", helper->name, name);
+/**
+ * Удаление файлов procfs "файла"
+ * 
+ * @param f
+ * 
+ * Ожидает завершения операций над файлами, поэтому вызывается только
+ * в контексте процесса, вне rcu_read_lock.
+ * 
+ * NB!
+ * Вызов может приостанавливать выполнение!
+ */
+static void procfs_remove_file(struct dpi_conntrack_file *f) {
+    /* Удаляем файл с запрошенным именем - только по окончании работы с ним! */
+    if(f->pde) {
+        if(f->pde_bin) {
+            /* Удаляем двоичный файл из procfs */
+            proc_remove(f->pde_bin);
+        }
+        
+        if(f->pde_ring) {
+            /* Удаляем файл кольцевых буферов из procfs */
+            proc_remove(f->pde_ring);
         }
         
-        /* Сравниваем имя helper, если он имеется */
-        return helper ? (strncmp(helper->name, name, NF_CT_HELPER_NAME_LEN) == 0) : 0;
+        if(f->pde_delta) {
+            /* Удаляем файл журнала изменений из procfs */
+            proc_remove(f->pde_delta);
+        }
+        
+        if(f->pde_summary) {
+            /* Удаляем файлы итогов из procfs */
+            proc_remove(f->pde_summary);
+        }
+        
+        if(f->pde_count) {
+            proc_remove(f->pde_count);
+        }
+        
+        if(f->pde_estimate) {
+            proc_remove(f->pde_estimate);
+        }
+        
+        if(f->pde_distinct) {
+            proc_remove(f->pde_distinct);
+        }
+        
+        /* Удаляем элемент из procfs */
+        proc_remove(f->pde);
+        
+        dpi_conntrack_debug("procfs_remove_file: Remove procfs net file\n");
     }
-    
-    return 0;
 }
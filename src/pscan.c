@@ -0,0 +1,399 @@
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <linux/cpumask.h>
+#include <linux/cpu.h>
+#include <linux/nodemask.h>
+#include <linux/ktime.h>
+#include <linux/seqlock.h>
+#include <linux/rculist_nulls.h>
+
+#include <net/netfilter/nf_conntrack.h>
+
+#include "dpi_conntrack_ko.h"
+
+/* Кол-во записей, под которые выделяется буфер участка изначально */
+#define PSCAN_SHARD_RECORDS     1024
+/* Кол-во bucket, просматриваемых в одном окружении rcu_read_lock */
+#define PSCAN_BUCKETS_PER_LOCK  1024
+/* Минимальное кол-во bucket на участок (меньшие таблицы обходятся последовательно) */
+#define PSCAN_MIN_BUCKETS       4096
+/* Максимальное кол-во участков */
+#define PSCAN_SHARDS_MAX        256
+/* Кол-во повторов обхода, если во время него изменился размер таблицы */
+#define PSCAN_RETRIES           2
+
+/* Кол-во участков параллельного обхода таблицы conntrack (0, 1 - обход последовательный) */
+static unsigned int pscan_shards __read_mostly;
+module_param(pscan_shards, uint, 0644);
+MODULE_PARM_DESC(pscan_shards, "Split full conntrack table walks of .bin files into this many parallel shards (0 - disabled)");
+
+/*
+ * Участок таблицы conntrack [lo, hi) и записи подходящих "файлу" conntrack
+ */
+struct pscan_shard {
+    struct work_struct work;
+    struct dpi_conntrack_file *f;
+    unsigned int lo;
+    unsigned int hi;
+    /* Поколение таблицы conntrack, по которой выполняется обход */
+    unsigned int generation;
+    /* Записи в порядке обхода участка */
+    struct dpi_conntrack_bin_record *rec;
+    size_t nr;
+    size_t cap;
+    int err;
+};
+
+/* Предварительное объявление локальных функций модуля */
+static struct dpi_conntrack_snapshot *pscan_once(struct dpi_conntrack_file *f);
+static void pscan_work(struct work_struct *work);
+static int pscan_bucket(struct pscan_shard *sh, struct hlist_nulls_head *hash, unsigned int bucket,
+                        struct dpi_conntrack_stats __percpu *stats);
+static int pscan_grow(struct pscan_shard *sh);
+static unsigned int pscan_cpu(unsigned int n);
+
+/* Очередь для обработчиков участков */
+static struct workqueue_struct *pscan_wq;
+
+/**
+ * Создание очереди для параллельного обхода
+ *
+ * @return
+ */
+int __init dpi_conntrack_pscan_startup(void) {
+    /* Обработчики участков привязаны к CPU, на которые они поставлены */
+    pscan_wq = alloc_workqueue("dpi_conntrack_pscan", WQ_CPU_INTENSIVE, 0);
+
+    return pscan_wq ? 0 : -ENOMEM;
+}
+
+/**
+ * Удаление очереди для параллельного обхода
+ */
+void dpi_conntrack_pscan_cleanup(void) {
+    destroy_workqueue(pscan_wq);
+}
+
+/**
+ * Выполнять ли обход таблицы conntrack "файла" параллельно
+ *
+ * @param f
+ * @return
+ *
+ * При наличии индекса таблица conntrack не обходится вовсе.
+ */
+bool dpi_conntrack_pscan_enabled(const struct dpi_conntrack_file *f) {
+    unsigned int shards = READ_ONCE(pscan_shards);
+
+    if((shards < 2) || (dpi_conntrack_pernet(f->net)->events && f->match.indexed)) {
+        return false;
+    }
+
+    return READ_ONCE(f->net->ct.htable_size) >= PSCAN_MIN_BUCKETS * 2;
+}
+
+/**
+ * Параллельный обход таблицы conntrack "файла"
+ *
+ * @param f
+ * @return ERR_PTR(-ENOMEM), если не хватило памяти, ERR_PTR(-EAGAIN), если
+ * размер таблицы менялся во время каждой из попыток
+ *
+ * Таблица делится на участки по bucket, каждый участок обходится на своем
+ * CPU (участки распределяются по узлам NUMA, см. pscan_cpu) в собственный
+ * буфер записей на узле этого CPU. Буферы не копируются: они становятся
+ * буферами снимка в порядке bucket.
+ *
+ * NB!
+ * Вызов может приостанавливать выполнение!
+ */
+struct dpi_conntrack_snapshot *dpi_conntrack_pscan_run(struct dpi_conntrack_file *f) {
+    struct dpi_conntrack_snapshot *s;
+    unsigned int attempt = 0;
+
+    for(;;) {
+        s = pscan_once(f);
+
+        if(!IS_ERR(s) || (-EAGAIN != PTR_ERR(s)) || (attempt++ == PSCAN_RETRIES)) {
+            return s;
+        }
+
+        /* Результат обхода еще не выдан, поэтому его можно просто повторить */
+        dpi_conntrack_stats_inc(dpi_conntrack_pernet(f->net)->stats, resyncs);
+    }
+}
+
+/**
+ * Одна попытка параллельного обхода
+ *
+ * @param f
+ * @return ERR_PTR(-EAGAIN), если во время обхода изменился размер таблицы
+ * (conntrack переносятся между таблицами, записи могли повториться)
+ */
+static struct dpi_conntrack_snapshot *pscan_once(struct dpi_conntrack_file *f) {
+    struct dpi_conntrack_net *pernet = dpi_conntrack_pernet(f->net);
+    unsigned int nr = min_t(unsigned int, READ_ONCE(pscan_shards), PSCAN_SHARDS_MAX);
+    struct dpi_conntrack_snapshot *s;
+    struct pscan_shard *shard;
+    struct hlist_nulls_head *hash;
+    u64 started = ktime_get_ns();
+    unsigned int size, generation, n;
+    int err = 0;
+
+    rcu_read_lock();
+
+    generation = dpi_conntrack_table_rcu(f->net, &hash, &size);
+
+    /* helper фильтра сравниваются по указателю (участки используют общий результат поиска) */
+    dpi_conntrack_filter_refresh_rcu(f, true);
+
+    rcu_read_unlock();
+
+    /* Участок не меньше PSCAN_MIN_BUCKETS */
+    nr = clamp_t(unsigned int, size / PSCAN_MIN_BUCKETS, 1, max(nr, 1U));
+
+    shard = kcalloc(nr, sizeof(struct pscan_shard), GFP_KERNEL);
+    s = dpi_conntrack_snapshot_new(nr);
+
+    if((NULL == shard) || (NULL == s)) {
+        dpi_conntrack_stats_inc(pernet->stats, alloc_failed);
+
+        dpi_conntrack_snapshot_put(s);
+        kfree(shard);
+
+        return ERR_PTR(-ENOMEM);
+    }
+
+    dpi_conntrack_stats_inc(pernet->stats, dumps);
+
+    get_online_cpus();
+
+    for(n = 0;n < nr;n++) {
+        struct pscan_shard *sh = &shard[n];
+
+        sh->f = f;
+        sh->lo = (u64)size * n / nr;
+        sh->hi = (u64)size * (n + 1) / nr;
+        sh->generation = generation;
+
+        INIT_WORK(&sh->work, pscan_work);
+
+        queue_work_on(pscan_cpu(n), pscan_wq, &sh->work);
+    }
+
+    for(n = 0;n < nr;n++) {
+        flush_work(&shard[n].work);
+
+        /* Буфер участка переходит в снимок (освобождается вместе с ним) */
+        s->chunk[n].rec = shard[n].rec;
+        s->chunk[n].nr = shard[n].nr;
+
+        s->nr += shard[n].nr;
+
+        if(shard[n].err && (-ENOMEM != err)) {
+            err = shard[n].err;
+        }
+    }
+
+    put_online_cpus();
+
+    kfree(shard);
+
+    if(!err && read_seqcount_retry(&f->net->ct.generation, generation)) {
+        /* Участки, завершенные до изменения размера, об этом не знают */
+        err = -EAGAIN;
+    }
+
+    if(err) {
+        if(-ENOMEM == err) {
+            dpi_conntrack_stats_inc(pernet->stats, alloc_failed);
+        }
+
+        dpi_conntrack_snapshot_put(s);
+
+        return ERR_PTR(err);
+    }
+
+    dpi_conntrack_stats_latency(pernet->stats, ktime_get_ns() - started);
+
+    return s;
+}
+
+/**
+ * Обход участка таблицы conntrack
+ *
+ * @param work
+ *
+ * Окружение rcu_read_lock снимается каждые PSCAN_BUCKETS_PER_LOCK bucket,
+ * а также для увеличения буфера записей. Если размер таблицы изменился,
+ * то обход участка прекращается (sh->err = -EAGAIN).
+ */
+static void pscan_work(struct work_struct *work) {
+    struct pscan_shard *sh = container_of(work, struct pscan_shard, work);
+    struct net *net = sh->f->net;
+    struct dpi_conntrack_stats __percpu *stats = dpi_conntrack_pernet(net)->stats;
+    unsigned int bucket = sh->lo;
+
+    while(bucket < sh->hi) {
+        unsigned int end = min(bucket + PSCAN_BUCKETS_PER_LOCK, sh->hi);
+        struct hlist_nulls_head *hash;
+        unsigned int size;
+
+        rcu_read_lock();
+
+        if(dpi_conntrack_table_rcu(net, &hash, &size) != sh->generation) {
+            rcu_read_unlock();
+
+            sh->err = -EAGAIN;
+
+            return;
+        }
+
+        /* Таблица доступна до rcu_read_unlock, даже если ее размер изменится */
+        while(bucket < end) {
+            dpi_conntrack_scan_prefetch_rcu(hash, size, bucket);
+
+            if(0 != pscan_bucket(sh, hash, bucket, stats)) {
+                break;
+            }
+
+            bucket++;
+        }
+
+        rcu_read_unlock();
+
+        if((bucket < end) && (0 != (sh->err = pscan_grow(sh)))) {
+            /* Буфер заполнен и не может быть увеличен */
+            return;
+        }
+
+        cond_resched();
+    }
+}
+
+/**
+ * Обход одного bucket
+ *
+ * @param sh
+ * @param hash таблица поколения sh->generation
+ * @param bucket
+ * @param stats
+ * @return -ENOSPC, если записи bucket не поместились в буфер (добавленные
+ * записи bucket при этом отбрасываются)
+ *
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+static int pscan_bucket(struct pscan_shard *sh, struct hlist_nulls_head *hash, unsigned int bucket,
+                        struct dpi_conntrack_stats __percpu *stats) {
+    struct nf_conntrack_tuple_hash *h;
+    struct hlist_nulls_node *n;
+    size_t start = sh->nr;
+
+restart:
+    hlist_nulls_for_each_entry_rcu(h, n, &hash[bucket], hnnode) {
+        struct nf_conntrack_tuple tuple;
+        struct nf_conn *ct;
+
+        dpi_conntrack_stats_inc(stats, visited);
+
+        /* Каждый conntrack учитываем только по кортежу исходного направления */
+        if(NF_CT_DIRECTION(h) != IP_CT_DIR_ORIGINAL) {
+            continue;
+        }
+
+        ct = nf_ct_tuplehash_to_ctrack(h);
+        /* Кортеж до проверки фильтра: nf_conn может быть переиспользован */
+        tuple = h->tuple;
+
+        if(!dpi_conntrack_filter_match_rcu(sh->f, ct)) {
+            continue;
+        }
+
+        if(sh->nr == sh->cap) {
+            sh->nr = start;
+
+            return -ENOSPC;
+        }
+
+        if(0 == dpi_conntrack_record_fill(&sh->rec[sh->nr], ct, &tuple, sh->f)) {
+            sh->nr++;
+
+            dpi_conntrack_stats_inc(stats, matches);
+        }
+    }
+
+    if(get_nulls_value(n) != bucket) {
+        /* conntrack перенесен в другую цепочку, повторяем bucket */
+        dpi_conntrack_stats_inc(stats, restarts);
+
+        sh->nr = start;
+
+        goto restart;
+    }
+
+    dpi_conntrack_stats_inc(stats, buckets);
+
+    return 0;
+}
+
+/**
+ * Увеличение буфера записей участка вдвое
+ *
+ * @param sh
+ * @return
+ *
+ * Память выделяется на узле NUMA того CPU, где обходится участок.
+ */
+static int pscan_grow(struct pscan_shard *sh) {
+    size_t cap = sh->cap ? sh->cap * 2 : PSCAN_SHARD_RECORDS;
+    struct dpi_conntrack_bin_record *rec;
+
+    if(NULL == (rec = vmalloc_node(cap * sizeof(*rec), numa_node_id()))) {
+        return -ENOMEM;
+    }
+
+    if(sh->nr) {
+        memcpy(rec, sh->rec, sh->nr * sizeof(*rec));
+    }
+
+    vfree(sh->rec);
+
+    sh->rec = rec;
+    sh->cap = cap;
+
+    return 0;
+}
+
+/**
+ * CPU для участка
+ *
+ * @param n номер участка
+ * @return
+ *
+ * Участки по очереди назначаются узлам NUMA, у которых есть CPU (участок n -
+ * узлу n % кол-во узлов), а внутри узла - его CPU по очереди. Так обход
+ * нагружает контроллеры памяти всех узлов, а не CPU первого узла.
+ * cpumask_local_spread() с NUMA_NO_NODE узлы не учитывает. Если участков
+ * узла больше, чем у него CPU, cpumask_local_spread() выбирает CPU
+ * других узлов.
+ *
+ * NB!
+ * Вызывается при get_online_cpus().
+ */
+static unsigned int pscan_cpu(unsigned int n) {
+    unsigned int nodes = max(num_node_state(N_CPU), 1);
+    unsigned int k = n % nodes;
+    int node;
+
+    for_each_node_state(node, N_CPU) {
+        if(0 == k--) {
+            return cpumask_local_spread(n / nodes, node);
+        }
+    }
+
+    return cpumask_local_spread(n, NUMA_NO_NODE);
+}
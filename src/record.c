@@ -0,0 +1,127 @@
+#include <linux/string.h>
+
+#include <net/netfilter/nf_conntrack.h>
+#include <net/netfilter/nf_conntrack_acct.h>
+#include <net/netfilter/nf_conntrack_zones.h>
+
+#include "dpi_conntrack_ko.h"
+
+/* Предварительное объявление локальных функций модуля */
+static void record_fill_tuple(struct dpi_conntrack_bin_tuple *bt,
+                              const struct nf_conntrack_tuple *t);
+
+/**
+ * Заполнение заголовка двоичного "файла"
+ *
+ * @param h
+ */
+void dpi_conntrack_record_header(struct dpi_conntrack_bin_header *h) {
+    memset(h, 0, sizeof(struct dpi_conntrack_bin_header));
+
+    h->magic = DPI_CONNTRACK_BIN_MAGIC;
+    h->version = DPI_CONNTRACK_BIN_VERSION;
+    h->header_size = sizeof(struct dpi_conntrack_bin_header);
+    h->record_size = sizeof(struct dpi_conntrack_bin_record);
+    h->flags = DPI_CONNTRACK_BIN_F_ACCT;
+}
+
+/**
+ * Заполнение двоичной записи по conntrack
+ *
+ * @param r
+ * @param ct
+ * @param tuple кортеж исходного направления, по которому conntrack был найден
+ * @param f "файл", фильтру которого должен соответствовать conntrack
+ * @return -ENOENT, если conntrack уже уничтожается или не подходит
+ *
+ * Запись заполняется при удерживаемой ссылке на conntrack, поэтому ее
+ * содержимое согласовано (nf_conn не может быть переиспользован). До
+ * получения ссылки nf_conn мог быть освобожден и переиспользован (в т.ч. еще
+ * не подтвержденным conntrack), поэтому, как и для индекса, проверяются
+ * подтверждение, кортеж и фильтр.
+ *
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+int dpi_conntrack_record_fill(struct dpi_conntrack_bin_record *r, struct nf_conn *ct,
+                              const struct nf_conntrack_tuple *tuple,
+                              const struct dpi_conntrack_file *f) {
+    if(unlikely(!atomic_inc_not_zero(&ct->ct_general.use))) {
+        /* conntrack уже освобождается */
+        return -ENOENT;
+    }
+
+    if(unlikely(nf_ct_is_dying(ct) ||
+                !nf_ct_is_confirmed(ct) ||
+                !nf_ct_tuple_equal(tuple, &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple) ||
+                !dpi_conntrack_filter_match_rcu(f, ct))) {
+        /* nf_conn был переиспользован до получения ссылки */
+        nf_ct_put(ct);
+
+        return -ENOENT;
+    }
+
+    dpi_conntrack_record_fill_ct(r, ct);
+
+    nf_ct_put(ct);
+
+    return 0;
+}
+
+/**
+ * Заполнение двоичной записи по conntrack, который удерживается вызывающим
+ *
+ * @param r
+ * @param ct
+ */
+void dpi_conntrack_record_fill_ct(struct dpi_conntrack_bin_record *r, struct nf_conn *ct) {
+    struct nf_conn_acct *acct;
+
+    memset(r, 0, sizeof(struct dpi_conntrack_bin_record));
+
+    record_fill_tuple(&r->tuple[DPI_CONNTRACK_BIN_DIR_ORIGINAL], &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple);
+    record_fill_tuple(&r->tuple[DPI_CONNTRACK_BIN_DIR_REPLY], &ct->tuplehash[IP_CT_DIR_REPLY].tuple);
+
+    r->l3num = nf_ct_l3num(ct);
+    r->protonum = nf_ct_protonum(ct);
+    r->zone = nf_ct_zone(ct)->id;
+
+#if defined(CONFIG_NF_CONNTRACK_MARK)
+    r->mark = ct->mark;
+#endif
+
+    r->status = (u32)ct->status;
+
+    if(timer_pending(&ct->timeout)) {
+        long timeout = (long)(ct->timeout.expires - jiffies) / HZ;
+
+        r->timeout = (timeout > 0) ? (u32)timeout : 0;
+    }
+
+    if(NULL != (acct = nf_conn_acct_find(ct))) {
+        r->packets[DPI_CONNTRACK_BIN_DIR_ORIGINAL] = atomic64_read(&acct->counter[IP_CT_DIR_ORIGINAL].packets);
+        r->bytes[DPI_CONNTRACK_BIN_DIR_ORIGINAL] = atomic64_read(&acct->counter[IP_CT_DIR_ORIGINAL].bytes);
+        r->packets[DPI_CONNTRACK_BIN_DIR_REPLY] = atomic64_read(&acct->counter[IP_CT_DIR_REPLY].packets);
+        r->bytes[DPI_CONNTRACK_BIN_DIR_REPLY] = atomic64_read(&acct->counter[IP_CT_DIR_REPLY].bytes);
+    }
+
+    /* Без метаданных запись остается обнуленной */
+    dpi_conntrack_meta_get(ct, &r->meta);
+}
+
+/**
+ * Заполнение кортежа одного направления
+ *
+ * @param bt
+ * @param t
+ */
+static void record_fill_tuple(struct dpi_conntrack_bin_tuple *bt,
+                              const struct nf_conntrack_tuple *t) {
+    memcpy(bt->src, &t->src.u3, sizeof(bt->src));
+    memcpy(bt->dst, &t->dst.u3, sizeof(bt->dst));
+
+    bt->sport = t->src.u.all;
+    bt->dport = t->dst.u.all;
+}
@@ -0,0 +1,314 @@
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/log2.h>
+#include <linux/ktime.h>
+#include <linux/proc_fs.h>
+
+#include "dpi_conntrack_ko.h"
+
+/* Кол-во страниц данных кольцевого буфера одного CPU (0 - буферы не создаются) */
+static unsigned int ring_pages __read_mostly;
+module_param(ring_pages, uint, 0444);
+MODULE_PARM_DESC(ring_pages, "Per-CPU event ring data pages for each file (0 - disabled)");
+
+/* Предварительное объявление локальных функций модуля */
+static int ring_open(struct inode *inode, struct file *file);
+static int ring_release(struct inode *inode, struct file *file);
+static int ring_mmap(struct file *file, struct vm_area_struct *vma);
+static unsigned int ring_poll(struct file *file, struct poll_table_struct *wait);
+static void ring_vm_open(struct vm_area_struct *vma);
+static void ring_vm_close(struct vm_area_struct *vma);
+static int ring_pending(struct dpi_conntrack_ring *r);
+
+/* Набор операций для файла <name>.ring */
+const struct file_operations dpi_conntrack_ring_fops = {
+    .owner   = THIS_MODULE,
+    .open    = ring_open,
+    .release = ring_release,
+    .mmap    = ring_mmap,
+    .poll    = ring_poll,
+    .llseek  = noop_llseek,
+};
+
+/* Операции для отображения буферов в адресное пространство процесса */
+static const struct vm_operations_struct ring_vm_ops = {
+    .open  = ring_vm_open,
+    .close = ring_vm_close,
+};
+
+/**
+ * Управляющая страница кольцевого буфера указанного CPU
+ *
+ * @param r
+ * @param cpu
+ * @return
+ */
+static inline struct dpi_conntrack_ring_ctl *ring_ctl(struct dpi_conntrack_ring *r, unsigned int cpu) {
+    return (struct dpi_conntrack_ring_ctl *)((char *)r->area + (size_t)cpu * r->ring_size);
+}
+
+/**
+ * Элемент кольцевого буфера для события с номером n
+ *
+ * @param r
+ * @param ctl
+ * @param n
+ * @return
+ */
+static inline struct dpi_conntrack_ring_event *ring_event(struct dpi_conntrack_ring *r,
+                                                          struct dpi_conntrack_ring_ctl *ctl,
+                                                          u64 n) {
+    struct dpi_conntrack_ring_event *events = (void *)((char *)ctl + PAGE_SIZE);
+
+    return &events[n & (r->nr_events - 1)];
+}
+
+/**
+ * Создание кольцевых буферов для "файла"
+ *
+ * @return NULL, если буферы отключены (ring_pages == 0) или не хватило памяти
+ */
+struct dpi_conntrack_ring *dpi_conntrack_ring_new(void) {
+    struct dpi_conntrack_ring *r;
+    unsigned int cpu;
+
+    if(!ring_pages) {
+        /* Буферы событий не используются */
+        return NULL;
+    }
+
+    if(NULL == (r = kzalloc(sizeof(struct dpi_conntrack_ring), GFP_KERNEL))) {
+        return NULL;
+    }
+
+    /* Кол-во элементов должно быть степенью 2 (индекс получаем маской) */
+    r->nr_events = rounddown_pow_of_two(ring_pages * PAGE_SIZE / sizeof(struct dpi_conntrack_ring_event));
+    r->nr_rings = nr_cpu_ids;
+    r->ring_size = PAGE_SIZE + PAGE_ALIGN(r->nr_events * sizeof(struct dpi_conntrack_ring_event));
+
+    /* Память обнулена и пригодна для remap_vmalloc_range() */
+    if(NULL == (r->area = vmalloc_user(r->nr_rings * r->ring_size))) {
+        kfree(r);
+
+        return NULL;
+    }
+
+    for(cpu = 0;cpu < r->nr_rings;cpu++) {
+        struct dpi_conntrack_ring_ctl *ctl = ring_ctl(r, cpu);
+
+        ctl->version = DPI_CONNTRACK_RING_VERSION;
+        ctl->event_size = sizeof(struct dpi_conntrack_ring_event);
+        ctl->nr_events = r->nr_events;
+        ctl->nr_rings = r->nr_rings;
+        ctl->ring_size = r->ring_size;
+        ctl->data_offset = PAGE_SIZE;
+        ctl->wakeup_watermark = 1;
+    }
+
+    init_waitqueue_head(&r->wait);
+
+    /* Ссылка "файла" */
+    atomic_set(&r->refs, 1);
+
+    return r;
+}
+
+/**
+ * Освобождение ссылки на кольцевые буферы
+ *
+ * @param r
+ *
+ * Буферы освобождаются после снятия "файла" с регистрации, закрытия всех
+ * дескрипторов и удаления всех отображений.
+ */
+void dpi_conntrack_ring_put(struct dpi_conntrack_ring *r) {
+    if(atomic_dec_and_test(&r->refs)) {
+        vfree(r->area);
+
+        kfree(r);
+    }
+}
+
+/**
+ * Запись события в кольцевой буфер текущего CPU
+ *
+ * @param r
+ * @param type DPI_CONNTRACK_RING_EV_*
+ * @param ct
+ *
+ * NB!
+ * Вызывается из обработчика уведомлений conntrack (rcu_read_lock, в т.ч. softirq).
+ * conntrack удерживается вызывающим.
+ */
+void dpi_conntrack_ring_event(struct dpi_conntrack_ring *r, u32 type, struct nf_conn *ct) {
+    struct dpi_conntrack_ring_ctl *ctl;
+    struct dpi_conntrack_ring_event *ev;
+    u64 head, tail;
+    u32 watermark;
+
+    /* Буфер текущего CPU не должен использоваться параллельно из softirq */
+    local_bh_disable();
+
+    ctl = ring_ctl(r, smp_processor_id());
+
+    head = ctl->producer;
+    /* Читатель освободил элементы до tail (после чтения их содержимого) */
+    tail = smp_load_acquire(&ctl->consumer);
+
+    if(unlikely(head - tail >= r->nr_events)) {
+        /* Буфер заполнен */
+        ctl->overflow++;
+
+        local_bh_enable();
+
+        return;
+    }
+
+    ev = ring_event(r, ctl, head);
+
+    ev->timestamp = ktime_get_ns();
+    ev->type = type;
+    ev->reserved = 0;
+
+    dpi_conntrack_record_fill_ct(&ev->record, ct);
+
+    /* Содержимое элемента должно быть видно до нового значения producer */
+    smp_store_release(&ctl->producer, head + 1);
+
+    watermark = READ_ONCE(ctl->wakeup_watermark);
+
+    if((head + 1 - tail) >= max_t(u32, watermark, 1)) {
+        /* Пробуждаем только при наличии ожидающих (без лишнего захвата wait.lock) */
+        smp_mb();
+
+        if(waitqueue_active(&r->wait)) {
+            wake_up_interruptible_poll(&r->wait, POLLIN | POLLRDNORM);
+        }
+    }
+
+    local_bh_enable();
+}
+
+/**
+ * Открытие файла <name>.ring
+ *
+ * @param inode
+ * @param file
+ * @return
+ */
+static int ring_open(struct inode *inode, struct file *file) {
+    struct dpi_conntrack_file *f = PDE_DATA(inode);
+    struct dpi_conntrack_ring *r = f->ring;
+
+    /* Ссылка открытого дескриптора */
+    atomic_inc(&r->refs);
+
+    file->private_data = r;
+
+    return 0;
+}
+
+/**
+ * Закрытие файла <name>.ring
+ *
+ * @param inode
+ * @param file
+ * @return
+ */
+static int ring_release(struct inode *inode, struct file *file) {
+    dpi_conntrack_ring_put(file->private_data);
+
+    return 0;
+}
+
+/**
+ * Отображение буферов всех CPU в адресное пространство процесса
+ *
+ * @param file
+ * @param vma
+ * @return
+ *
+ * Отображается вся область целиком и только с нулевого смещения.
+ */
+static int ring_mmap(struct file *file, struct vm_area_struct *vma) {
+    struct dpi_conntrack_ring *r = file->private_data;
+    int rv;
+
+    if(vma->vm_pgoff || ((vma->vm_end - vma->vm_start) != (unsigned long)r->nr_rings * r->ring_size)) {
+        return -EINVAL;
+    }
+
+    if(0 != (rv = remap_vmalloc_range(vma, r->area, 0))) {
+        return rv;
+    }
+
+    vma->vm_ops = &ring_vm_ops;
+    vma->vm_private_data = r;
+
+    ring_vm_open(vma);
+
+    return 0;
+}
+
+/**
+ * Ожидание событий
+ *
+ * @param file
+ * @param wait
+ * @return
+ */
+static unsigned int ring_poll(struct file *file, struct poll_table_struct *wait) {
+    struct dpi_conntrack_ring *r = file->private_data;
+
+    poll_wait(file, &r->wait, wait);
+
+    return ring_pending(r) ? (POLLIN | POLLRDNORM) : 0;
+}
+
+/**
+ * Новое отображение (mmap, fork, разделение vma)
+ *
+ * @param vma
+ */
+static void ring_vm_open(struct vm_area_struct *vma) {
+    struct dpi_conntrack_ring *r = vma->vm_private_data;
+
+    /* Отображение переживает закрытие дескриптора - удерживаем буферы и модуль */
+    atomic_inc(&r->refs);
+
+    __module_get(THIS_MODULE);
+}
+
+/**
+ * Удаление отображения
+ *
+ * @param vma
+ */
+static void ring_vm_close(struct vm_area_struct *vma) {
+    dpi_conntrack_ring_put(vma->vm_private_data);
+
+    module_put(THIS_MODULE);
+}
+
+/**
+ * Есть ли буфер, в котором накоплено не менее wakeup_watermark событий
+ *
+ * @param r
+ * @return
+ */
+static int ring_pending(struct dpi_conntrack_ring *r) {
+    unsigned int cpu;
+
+    for(cpu = 0;cpu < r->nr_rings;cpu++) {
+        struct dpi_conntrack_ring_ctl *ctl = ring_ctl(r, cpu);
+        u64 pending = smp_load_acquire(&ctl->producer) - READ_ONCE(ctl->consumer);
+
+        if(pending && (pending >= max_t(u32, READ_ONCE(ctl->wakeup_watermark), 1))) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,275 @@
+#include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/cache.h>
+#include <linux/seq_file.h>
+#include <linux/proc_fs.h>
+#include <linux/jhash.h>
+#include <linux/random.h>
+#include <linux/bitops.h>
+#include <linux/math64.h>
+
+#include <net/netfilter/nf_conntrack.h>
+
+#include "dpi_conntrack_ko.h"
+
+/* Оценки кол-ва различных значений (наборы регистров следуют подряд) */
+enum {
+    /* Адреса клиентов (источник исходного направления) */
+    SKETCH_SRC,
+    /* Адреса серверов */
+    SKETCH_DST,
+    /* Порты серверов вместе с протоколом (для ICMP - тип и код) */
+    SKETCH_DPORT,
+    SKETCH_MAX,
+};
+
+/* Допустимое кол-во бит номера регистра (16 .. 4096 регистров на оценку) */
+#define SKETCH_BITS_MIN     4
+#define SKETCH_BITS_MAX     12
+
+/* ln(2) с 16 двоичными знаками после запятой */
+#define SKETCH_LN2_Q16      45426
+
+static unsigned int sketch_bits __read_mostly;
+module_param(sketch_bits, uint, 0444);
+MODULE_PARM_DESC(sketch_bits, "Distinct-count sketches for each indexed file: 2^N one-byte registers per sketch and CPU, 4..12 (0 - disabled)");
+
+/* Предварительное объявление локальных функций модуля */
+static int sketch_open(struct inode *inode, struct file *file);
+static int sketch_show(struct seq_file *s, void *v);
+static void sketch_update(u8 *reg, unsigned int bits, u32 hash);
+static u64 sketch_estimate(const u8 *reg, unsigned int bits);
+static u32 sketch_log2(u32 n);
+
+/* Набор операций для файла <name>.distinct */
+const struct file_operations dpi_conntrack_sketch_fops = {
+    .owner   = THIS_MODULE,
+    .open    = sketch_open,
+    .read    = seq_read,
+    .llseek  = seq_lseek,
+    .release = single_release,
+};
+
+/**
+ * Создание оценок кол-ва различных значений для "файла"
+ *
+ * @return NULL, если оценки отключены (sketch_bits == 0) или не хватило памяти
+ */
+struct dpi_conntrack_sketch *dpi_conntrack_sketch_new(void) {
+    struct dpi_conntrack_sketch *s;
+    unsigned int bits = READ_ONCE(sketch_bits);
+
+    if(!bits) {
+        /* Оценки не используются */
+        return NULL;
+    }
+
+    if(NULL == (s = kzalloc(sizeof(*s), GFP_KERNEL))) {
+        return NULL;
+    }
+
+    s->bits = clamp_t(unsigned int, bits, SKETCH_BITS_MIN, SKETCH_BITS_MAX);
+    s->seed = prandom_u32();
+
+    /* Регистры всех оценок одного CPU - одна область */
+    if(NULL == (s->regs = __alloc_percpu(SKETCH_MAX << s->bits, SMP_CACHE_BYTES))) {
+        kfree(s);
+
+        return NULL;
+    }
+
+    return s;
+}
+
+/**
+ * Освобождение оценок
+ *
+ * @param s
+ *
+ * Вызывается вместе с освобождением "файла".
+ */
+void dpi_conntrack_sketch_free(struct dpi_conntrack_sketch *s) {
+    free_percpu(s->regs);
+    kfree(s);
+}
+
+/**
+ * Учет conntrack в оценках
+ *
+ * @param s
+ * @param ct
+ *
+ * Обновляются только регистры текущего CPU. Повторный учет того же conntrack
+ * (или тех же значений) оценки не меняет. Обновление, прерванное softirq на
+ * том же CPU, может потеряться, что лишь незначительно занижает регистр.
+ *
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+void dpi_conntrack_sketch_add(struct dpi_conntrack_sketch *s, const struct nf_conn *ct) {
+    const struct nf_conntrack_tuple *t = &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple;
+    unsigned int bits = s->bits;
+    /* Одинаковые адреса разных семейств считаются разными */
+    u32 seed = s->seed ^ t->src.l3num;
+    u8 *reg;
+
+    reg = get_cpu_ptr(s->regs);
+
+    sketch_update(reg + (SKETCH_SRC << bits), bits, jhash2(t->src.u3.all, ARRAY_SIZE(t->src.u3.all), seed));
+    sketch_update(reg + (SKETCH_DST << bits), bits, jhash2(t->dst.u3.all, ARRAY_SIZE(t->dst.u3.all), seed));
+    sketch_update(reg + (SKETCH_DPORT << bits), bits,
+                  jhash_2words((__force u16)t->dst.u.all, t->dst.protonum, s->seed));
+
+    put_cpu_ptr(s->regs);
+}
+
+/**
+ * Открытие файла оценок
+ *
+ * @param inode
+ * @param file
+ * @return
+ */
+static int sketch_open(struct inode *inode, struct file *file) {
+    return single_open(file, sketch_show, PDE_DATA(inode));
+}
+
+/**
+ * Вывод оценок кол-ва различных значений среди conntrack "файла"
+ *
+ * @param s
+ * @param v
+ * @return
+ *
+ * Регистры всех CPU объединяются (максимум по каждому регистру). Оценки
+ * учитывают все conntrack, попавшие в индекс "файла" с момента регистрации,
+ * относительная стандартная ошибка - 1.04 / sqrt(registers).
+ */
+static int sketch_show(struct seq_file *s, void *v) {
+    struct dpi_conntrack_file *f = s->private;
+    /* Освобождается вместе с "файлом", который удерживается открытым читателем */
+    struct dpi_conntrack_sketch *sk = rcu_dereference_protected(f->sketch, 1);
+    unsigned int size = SKETCH_MAX << sk->bits;
+    unsigned int cpu;
+    unsigned int n;
+    u8 *reg;
+
+    if(NULL == (reg = kzalloc(size, GFP_KERNEL))) {
+        return -ENOMEM;
+    }
+
+    for_each_possible_cpu(cpu) {
+        const u8 *r = per_cpu_ptr(sk->regs, cpu);
+
+        for(n = 0;n < size;n++) {
+            reg[n] = max_t(u8, reg[n], READ_ONCE(r[n]));
+        }
+    }
+
+    seq_printf(s, "registers %u\n", 1U << sk->bits);
+    seq_printf(s, "src_addrs %llu\n", sketch_estimate(reg + (SKETCH_SRC << sk->bits), sk->bits));
+    seq_printf(s, "dst_addrs %llu\n", sketch_estimate(reg + (SKETCH_DST << sk->bits), sk->bits));
+    seq_printf(s, "dst_ports %llu\n", sketch_estimate(reg + (SKETCH_DPORT << sk->bits), sk->bits));
+
+    kfree(reg);
+
+    return 0;
+}
+
+/**
+ * Учет значения в регистрах оценки
+ *
+ * @param reg
+ * @param bits
+ * @param hash
+ *
+ * Старшие bits бит hash - номер регистра, в регистре - максимальный номер
+ * старшей единицы среди остальных бит (1 - старший бит).
+ */
+static void sketch_update(u8 *reg, unsigned int bits, u32 hash) {
+    /* Ограничитель: номер не больше 32 - bits + 1 */
+    u32 w = (hash << bits) | (1U << (bits - 1));
+    u8 rank = 33 - fls(w);
+    u8 *r = &reg[hash >> (32 - bits)];
+
+    if(rank > *r) {
+        *r = rank;
+    }
+}
+
+/**
+ * Оценка HyperLogLog по регистрам
+ *
+ * @param reg
+ * @param bits
+ * @return
+ *
+ * E = alpha * m^2 / sum(2^-reg), при E <= 2.5 m и наличии пустых регистров -
+ * m ln(m / пустых). Вычисления выполняются в фиксированной точке:
+ * sum(2^-reg) - с 32, alpha - с 16 двоичными знаками после запятой.
+ */
+static u64 sketch_estimate(const u8 *reg, unsigned int bits) {
+    unsigned int m = 1U << bits;
+    unsigned int zeros = 0;
+    unsigned int n;
+    u64 alpha;
+    u64 sum = 0;
+    u64 e;
+
+    for(n = 0;n < m;n++) {
+        sum += 1ULL << (32 - reg[n]);
+
+        if(0 == reg[n]) {
+            zeros++;
+        }
+    }
+
+    if(16 == m) {
+        alpha = 44106;
+    } else if(32 == m) {
+        alpha = 45679;
+    } else if(64 == m) {
+        alpha = 46465;
+    } else {
+        /* 0.7213 / (1 + 1.079 / m) */
+        alpha = div_u64(47271ULL * m * 1000, m * 1000 + 1079);
+    }
+
+    e = div64_u64((alpha * m * m) << 16, sum);
+
+    if((e <= 5ULL * m / 2) && zeros) {
+        /* Малые значения: линейный подсчет по пустым регистрам */
+        e = ((u64)m * (((u64)bits << 16) - sketch_log2(zeros)) * SKETCH_LN2_Q16) >> 32;
+    }
+
+    return e;
+}
+
+/**
+ * log2(n) с 16 двоичными знаками после запятой
+ *
+ * @param n больше 0
+ * @return
+ *
+ * Дробная часть вычисляется побитно возведением мантиссы в квадрат.
+ */
+static u32 sketch_log2(u32 n) {
+    unsigned int k = fls(n) - 1;
+    /* Мантисса n / 2^k в [1, 2) */
+    u64 y = ((u64)n << 16) >> k;
+    u32 r = k << 16;
+    u32 bit;
+
+    for(bit = 1U << 15;bit;bit >>= 1) {
+        y = (y * y) >> 16;
+
+        if(y >= (2U << 16)) {
+            y >>= 1;
+            r |= bit;
+        }
+    }
+
+    return r;
+}
@@ -0,0 +1,330 @@
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/kref.h>
+#include <linux/mutex.h>
+#include <linux/ktime.h>
+#include <linux/rcupdate.h>
+
+#include "dpi_conntrack_ko.h"
+
+/* Кол-во записей, под которые выделяется буфер последовательного обхода изначально */
+#define SNAPSHOT_RECORDS        1024
+/* Кол-во conntrack, обрабатываемых в одном окружении rcu_read_lock */
+#define SNAPSHOT_WALK_BATCH     4096
+
+/* Время, в течение которого снимок "файла" выдается читателям вместо обхода, мс (0 - снимки не ведутся) */
+static unsigned int snapshot_ms __read_mostly;
+module_param(snapshot_ms, uint, 0644);
+MODULE_PARM_DESC(snapshot_ms, "Serve .bin readers from a shared per-file snapshot not older than this many ms (0 - disabled)");
+
+/* Предварительное объявление локальных функций модуля */
+static struct dpi_conntrack_snapshot *snapshot_build(struct dpi_conntrack_file *f);
+static struct dpi_conntrack_snapshot *snapshot_walk(struct dpi_conntrack_file *f);
+static int snapshot_grow(struct dpi_conntrack_snapshot_chunk *c, size_t *cap);
+static void snapshot_release(struct kref *ref);
+static void snapshot_free_rcu(struct rcu_head *head);
+
+/**
+ * Создание пустого снимка
+ *
+ * @param nr_chunks кол-во буферов записей
+ * @return
+ */
+struct dpi_conntrack_snapshot *dpi_conntrack_snapshot_new(unsigned int nr_chunks) {
+    struct dpi_conntrack_snapshot *s;
+
+    s = kzalloc(sizeof(*s) + nr_chunks * sizeof(struct dpi_conntrack_snapshot_chunk), GFP_KERNEL);
+
+    if(s) {
+        kref_init(&s->ref);
+
+        s->nr_chunks = nr_chunks;
+        s->built = ktime_get_ns();
+    }
+
+    return s;
+}
+
+/**
+ * Освобождение ссылки на снимок
+ *
+ * @param s (NULL допускается)
+ *
+ * Память освобождается после истечения grace period, т.к. снимок мог быть
+ * получен читателем из f->snap в окружении rcu_read_lock.
+ */
+void dpi_conntrack_snapshot_put(struct dpi_conntrack_snapshot *s) {
+    if(s) {
+        kref_put(&s->ref, snapshot_release);
+    }
+}
+
+/**
+ * Запись с номером idx
+ *
+ * @param s
+ * @param idx
+ * @return NULL, если записей меньше
+ */
+const struct dpi_conntrack_bin_record *dpi_conntrack_snapshot_record(const struct dpi_conntrack_snapshot *s,
+                                                                     loff_t idx) {
+    unsigned int n;
+
+    for(n = 0;n < s->nr_chunks;n++) {
+        if(idx < s->chunk[n].nr) {
+            return &s->chunk[n].rec[idx];
+        }
+
+        idx -= s->chunk[n].nr;
+    }
+
+    return NULL;
+}
+
+/**
+ * Снимок для чтения двоичного "файла" с начала
+ *
+ * @param f
+ * @return NULL, если записи выдаются обходом при чтении (снимки не ведутся
+ * и параллельный обход не используется, либо не хватило памяти)
+ *
+ * Первый читатель строит снимок и сохраняет его в "файле", остальные в
+ * течение snapshot_ms получают ссылку на него. Одновременно снимок
+ * "файла" строит только один читатель.
+ *
+ * NB!
+ * Вызов может приостанавливать выполнение!
+ */
+struct dpi_conntrack_snapshot *dpi_conntrack_snapshot_get(struct dpi_conntrack_file *f) {
+    u64 window = (u64)READ_ONCE(snapshot_ms) * NSEC_PER_MSEC;
+    struct dpi_conntrack_snapshot *s, *old;
+
+    if(!window) {
+        /* Снимки не ведутся, но результат параллельного обхода выдается так же */
+        s = dpi_conntrack_pscan_enabled(f) ? dpi_conntrack_pscan_run(f) : NULL;
+
+        return IS_ERR(s) ? NULL : s;
+    }
+
+    rcu_read_lock();
+
+    s = rcu_dereference(f->snap);
+
+    if(s && ((ktime_get_ns() - s->built) < window) && kref_get_unless_zero(&s->ref)) {
+        rcu_read_unlock();
+
+        return s;
+    }
+
+    rcu_read_unlock();
+
+    mutex_lock(&f->snap_lock);
+
+    /* Снимок мог быть обновлен, пока мы ожидали */
+    old = rcu_dereference_protected(f->snap, lockdep_is_held(&f->snap_lock));
+
+    if(old && ((ktime_get_ns() - old->built) < window)) {
+        kref_get(&old->ref);
+
+        mutex_unlock(&f->snap_lock);
+
+        return old;
+    }
+
+    if(IS_ERR(s = snapshot_build(f))) {
+        mutex_unlock(&f->snap_lock);
+
+        return NULL;
+    }
+
+    s->generation = ++f->snap_gen;
+
+    /* Ссылка для "файла" */
+    kref_get(&s->ref);
+
+    rcu_assign_pointer(f->snap, s);
+
+    mutex_unlock(&f->snap_lock);
+
+    dpi_conntrack_snapshot_put(old);
+
+    return s;
+}
+
+/**
+ * Освобождение снимка "файла" (при освобождении самого "файла")
+ *
+ * @param f
+ */
+void dpi_conntrack_snapshot_drop(struct dpi_conntrack_file *f) {
+    dpi_conntrack_snapshot_put(rcu_dereference_protected(f->snap, 1));
+
+    RCU_INIT_POINTER(f->snap, NULL);
+}
+
+/**
+ * Построение снимка
+ *
+ * @param f
+ * @return ERR_PTR(-ENOMEM), если не хватило памяти
+ */
+static struct dpi_conntrack_snapshot *snapshot_build(struct dpi_conntrack_file *f) {
+    if(dpi_conntrack_pscan_enabled(f)) {
+        return dpi_conntrack_pscan_run(f);
+    }
+
+    return snapshot_walk(f);
+}
+
+/**
+ * Построение снимка последовательным обходом (по индексу или таблице conntrack)
+ *
+ * @param f
+ * @return ERR_PTR(-ENOMEM), если не хватило памяти, ERR_PTR(-EAGAIN), если
+ * обход прекращен после изменения размера таблицы (cursor->lost)
+ *
+ * Окружение rcu_read_lock снимается каждые SNAPSHOT_WALK_BATCH conntrack и
+ * для увеличения буфера, обход продолжается с места остановки.
+ */
+static struct dpi_conntrack_snapshot *snapshot_walk(struct dpi_conntrack_file *f) {
+    struct dpi_conntrack_net *pernet = dpi_conntrack_pernet(f->net);
+    struct dpi_conntrack_snapshot *s;
+    struct dpi_conntrack_snapshot_chunk *c;
+    struct dpi_conntrack_cursor *st;
+    struct dpi_iterator *i;
+    size_t cap = 0;
+    loff_t pos = 0;
+
+    st = kzalloc(sizeof(*st), GFP_KERNEL);
+    s = dpi_conntrack_snapshot_new(1);
+
+    if((NULL == st) || (NULL == s)) {
+        goto nomem;
+    }
+
+    st->f = f;
+    /* "Файл" удерживается открытым читателем */
+    st->preemptible = true;
+    c = &s->chunk[0];
+
+    for(;;) {
+        unsigned int n = 0;
+
+        if((c->nr == cap) && (0 != snapshot_grow(c, &cap))) {
+            goto nomem;
+        }
+
+        dpi_conntrack_iter_reserve(st);
+
+        rcu_read_lock();
+
+        i = dpi_conntrack_iter_start(st, pos);
+
+        while(i && (c->nr < cap) && (n++ < SNAPSHOT_WALK_BATCH)) {
+            if(0 == dpi_conntrack_record_fill(&c->rec[c->nr], dpi_conntrack_iter_ct(i),
+                                             dpi_conntrack_iter_tuple(i), f)) {
+                c->nr++;
+            }
+
+            i = dpi_conntrack_iter_next(st, i);
+        }
+
+        dpi_conntrack_iter_stop(st, i);
+
+        rcu_read_unlock();
+
+        if(NULL == i) {
+            break;
+        }
+
+        /* Продолжим с conntrack, на котором остановились */
+        pos = st->pos;
+
+        cond_resched();
+    }
+
+    dpi_conntrack_iter_release(st);
+
+    if(st->lost) {
+        /* Неполный снимок не сохраняется, читатель выполнит обход сам */
+        kfree(st);
+
+        dpi_conntrack_snapshot_put(s);
+
+        return ERR_PTR(-EAGAIN);
+    }
+
+    kfree(st);
+
+    s->nr = c->nr;
+
+    return s;
+
+nomem:
+    dpi_conntrack_stats_inc(pernet->stats, alloc_failed);
+
+    dpi_conntrack_snapshot_put(s);
+
+    if(st) {
+        dpi_conntrack_iter_release(st);
+    }
+
+    kfree(st);
+
+    return ERR_PTR(-ENOMEM);
+}
+
+/**
+ * Увеличение буфера записей вдвое
+ *
+ * @param c
+ * @param cap текущий размер буфера, записей
+ * @return
+ */
+static int snapshot_grow(struct dpi_conntrack_snapshot_chunk *c, size_t *cap) {
+    size_t n = *cap ? *cap * 2 : SNAPSHOT_RECORDS;
+    struct dpi_conntrack_bin_record *rec;
+
+    if(NULL == (rec = vmalloc(n * sizeof(*rec)))) {
+        return -ENOMEM;
+    }
+
+    if(c->nr) {
+        memcpy(rec, c->rec, c->nr * sizeof(*rec));
+    }
+
+    vfree(c->rec);
+
+    c->rec = rec;
+    *cap = n;
+
+    return 0;
+}
+
+/**
+ * Освобождение последней ссылки на снимок
+ *
+ * @param ref
+ */
+static void snapshot_release(struct kref *ref) {
+    struct dpi_conntrack_snapshot *s = container_of(ref, struct dpi_conntrack_snapshot, ref);
+
+    call_rcu(&s->rcu, snapshot_free_rcu);
+}
+
+/**
+ * Освобождение памяти снимка после истечения RCU grace period
+ *
+ * @param head
+ */
+static void snapshot_free_rcu(struct rcu_head *head) {
+    struct dpi_conntrack_snapshot *s = container_of(head, struct dpi_conntrack_snapshot, rcu);
+    unsigned int n;
+
+    for(n = 0;n < s->nr_chunks;n++) {
+        /* vfree из softirq откладывает освобождение */
+        vfree(s->chunk[n].rec);
+    }
+
+    kfree(s);
+}
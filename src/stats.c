@@ -0,0 +1,185 @@
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/log2.h>
+#include <linux/proc_fs.h>
+
+#include "dpi_conntrack_ko.h"
+
+/* Предварительное объявление локальных функций модуля */
+static int stats_open(struct inode *inode, struct file *file);
+static int stats_show(struct seq_file *s, void *v);
+static unsigned int stats_slot(u64 ns);
+static void stats_show_histogram(struct seq_file *s, const char *name, const u64 *h);
+
+/* Набор операций для файла /proc/net/dpi/stats */
+static const struct file_operations stats_fops = {
+    .owner   = THIS_MODULE,
+    .open    = stats_open,
+    .read    = seq_read,
+    .llseek  = seq_lseek,
+    .release = single_release,
+};
+
+/**
+ * Создание счетчиков и файла статистики netns
+ *
+ * @param pernet
+ * @return
+ */
+int dpi_conntrack_stats_init(struct dpi_conntrack_net *pernet) {
+    if(NULL == (pernet->stats = alloc_percpu(struct dpi_conntrack_stats))) {
+        return -ENOMEM;
+    }
+
+    if(NULL == proc_create_data(PROC_NET_DPI_STATS, 0444, pernet->proc_dpi, &stats_fops, pernet)) {
+        free_percpu(pernet->stats);
+
+        pernet->stats = NULL;
+
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+/**
+ * Удаление файла статистики и счетчиков netns
+ *
+ * @param pernet
+ */
+void dpi_conntrack_stats_exit(struct dpi_conntrack_net *pernet) {
+    if(pernet->stats) {
+        /* Дожидается завершения чтения файла */
+        remove_proc_entry(PROC_NET_DPI_STATS, pernet->proc_dpi);
+
+        free_percpu(pernet->stats);
+
+        pernet->stats = NULL;
+    }
+}
+
+/**
+ * Учет длительности завершенного обхода
+ *
+ * @param stats
+ * @param ns длительность, нс
+ *
+ * Интервал i гистограммы содержит обходы длительностью [2^(i-1), 2^i) мкс,
+ * интервал 0 - менее 1 мкс, последний интервал - все более длительные.
+ */
+void dpi_conntrack_stats_latency(struct dpi_conntrack_stats __percpu *stats, u64 ns) {
+    this_cpu_inc(stats->latency[stats_slot(ns)]);
+}
+
+/**
+ * Учет длительности участка обхода таблицы conntrack
+ *
+ * @param stats
+ * @param ns время от начала участка до снятия rcu_read_lock, нс
+ *
+ * Интервалы гистограммы те же, что у dpi_conntrack_stats_latency().
+ */
+void dpi_conntrack_stats_chunk(struct dpi_conntrack_stats __percpu *stats, u64 ns) {
+    this_cpu_inc(stats->chunk[stats_slot(ns)]);
+}
+
+/**
+ * Интервал гистограммы для длительности
+ *
+ * @param ns
+ * @return
+ */
+static unsigned int stats_slot(u64 ns) {
+    u64 us = ns / NSEC_PER_USEC;
+    unsigned int slot = us ? fls64(us) : 0;
+
+    return min_t(unsigned int, slot, DPI_STATS_LATENCY_SLOTS - 1);
+}
+
+/**
+ * Открытие файла статистики
+ *
+ * @param inode
+ * @param file
+ * @return
+ */
+static int stats_open(struct inode *inode, struct file *file) {
+    return single_open(file, stats_show, PDE_DATA(inode));
+}
+
+/**
+ * Вывод суммы счетчиков всех CPU
+ *
+ * @param s
+ * @param v
+ * @return
+ *
+ * Значения счетчиков CPU читаются без синхронизации, поэтому сумма не
+ * является атомарным снимком (каждый счетчик по отдельности монотонен).
+ */
+static int stats_show(struct seq_file *s, void *v) {
+    struct dpi_conntrack_net *pernet = s->private;
+    struct dpi_conntrack_stats sum;
+    unsigned int cpu, slot;
+
+    memset(&sum, 0, sizeof(sum));
+
+    for_each_possible_cpu(cpu) {
+        const struct dpi_conntrack_stats *c = per_cpu_ptr(pernet->stats, cpu);
+
+        sum.dumps += READ_ONCE(c->dumps);
+        sum.buckets += READ_ONCE(c->buckets);
+        sum.visited += READ_ONCE(c->visited);
+        sum.matches += READ_ONCE(c->matches);
+        sum.restarts += READ_ONCE(c->restarts);
+        sum.bytes += READ_ONCE(c->bytes);
+        sum.alloc_failed += READ_ONCE(c->alloc_failed);
+        sum.registered += READ_ONCE(c->registered);
+        sum.unregistered += READ_ONCE(c->unregistered);
+        sum.yields += READ_ONCE(c->yields);
+        sum.resyncs += READ_ONCE(c->resyncs);
+        sum.flushed += READ_ONCE(c->flushed);
+
+        for(slot = 0;slot < DPI_STATS_LATENCY_SLOTS;slot++) {
+            sum.latency[slot] += READ_ONCE(c->latency[slot]);
+            sum.chunk[slot] += READ_ONCE(c->chunk[slot]);
+        }
+    }
+
+    seq_printf(s, "dumps_started %llu\n", sum.dumps);
+    seq_printf(s, "buckets_visited %llu\n", sum.buckets);
+    seq_printf(s, "conntracks_visited %llu\n", sum.visited);
+    seq_printf(s, "matches %llu\n", sum.matches);
+    seq_printf(s, "nulls_restarts %llu\n", sum.restarts);
+    seq_printf(s, "bytes_emitted %llu\n", sum.bytes);
+    seq_printf(s, "alloc_failed %llu\n", sum.alloc_failed);
+    seq_printf(s, "files_registered %llu\n", sum.registered);
+    seq_printf(s, "files_unregistered %llu\n", sum.unregistered);
+    seq_printf(s, "scan_yields %llu\n", sum.yields);
+    seq_printf(s, "table_resyncs %llu\n", sum.resyncs);
+    seq_printf(s, "conntracks_flushed %llu\n", sum.flushed);
+
+    stats_show_histogram(s, "dump_latency", sum.latency);
+    stats_show_histogram(s, "scan_chunk", sum.chunk);
+
+    return 0;
+}
+
+/**
+ * Вывод гистограммы длительностей
+ *
+ * @param s
+ * @param name префикс строк
+ * @param h DPI_STATS_LATENCY_SLOTS интервалов
+ *
+ * Каждая строка - верхняя граница интервала (мкс, не включая) и кол-во.
+ */
+static void stats_show_histogram(struct seq_file *s, const char *name, const u64 *h) {
+    unsigned int slot;
+
+    for(slot = 0;slot < DPI_STATS_LATENCY_SLOTS - 1;slot++) {
+        seq_printf(s, "%s_us_lt_%llu %llu\n", name, 1ULL << slot, h[slot]);
+    }
+
+    seq_printf(s, "%s_us_inf %llu\n", name, h[DPI_STATS_LATENCY_SLOTS - 1]);
+}
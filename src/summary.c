@@ -0,0 +1,639 @@
+#include <linux/slab.h>
+#include <linux/seq_file.h>
+#include <linux/proc_fs.h>
+#include <linux/random.h>
+#include <linux/math64.h>
+#include <linux/kernel.h>
+#include <linux/rculist_nulls.h>
+#include <linux/netfilter/nf_conntrack_tcp.h>
+
+#include <net/netfilter/nf_conntrack.h>
+#include <net/netfilter/nf_conntrack_acct.h>
+
+#include "dpi_conntrack_ko.h"
+
+/* Кол-во bucket выборки, просматриваемых в одном окружении rcu_read_lock */
+#define ESTIMATE_BUCKETS_PER_LOCK   256
+/* Минимальное кол-во bucket выборки (для малых таблиц доля увеличивается) */
+#define ESTIMATE_MIN_BUCKETS        64
+/* Кол-во повторов выборки, если во время нее изменился размер таблицы */
+#define ESTIMATE_RETRIES            2
+
+/* Доля bucket таблицы conntrack, просматриваемых для <name>.estimate */
+static unsigned int estimate_permille __read_mostly = 10;
+module_param(estimate_permille, uint, 0644);
+MODULE_PARM_DESC(estimate_permille, "Fraction of conntrack buckets sampled for .estimate files, per mille (1..1000)");
+
+/* Итоги по conntrack "файла" */
+struct summary {
+    u64 conntracks;
+    u64 ipv4;
+    u64 ipv6;
+    u64 tcp;
+    u64 udp;
+    u64 icmp;
+    u64 other;
+    /* Кол-во TCP conntrack в каждом состоянии (enum tcp_conntrack) */
+    u64 tcp_state[TCP_CONNTRACK_MAX];
+    u64 assured;
+    /* Ответ еще не получен (нет IPS_SEEN_REPLY) */
+    u64 unreplied;
+    /* conntrack с расширением учета трафика и сумма счетчиков по направлениям */
+    u64 acct;
+    u64 packets[IP_CT_DIR_MAX];
+    u64 bytes[IP_CT_DIR_MAX];
+};
+
+/* Кол-во счетчиков struct summary (все поля до счетчиков трафика) */
+#define ESTIMATE_COUNTERS   (offsetof(struct summary, packets) / sizeof(u64))
+/* Номер счетчика по имени поля */
+#define ESTIMATE_FIELD(name) (offsetof(struct summary, name) / sizeof(u64))
+
+/*
+ * Выборка bucket таблицы conntrack: суммы по выбранным bucket и, для
+ * счетчиков, суммы их квадратов по bucket (для оценки дисперсии)
+ */
+struct estimate {
+    struct summary sum;
+    u64 sumsq[ESTIMATE_COUNTERS];
+    /* Размер таблицы и кол-во просмотренных bucket */
+    unsigned int buckets;
+    unsigned int sampled;
+};
+
+/* Имена состояний TCP (как в /proc/net/nf_conntrack) */
+static const char * const summary_tcp_states[TCP_CONNTRACK_MAX] = {
+    [TCP_CONNTRACK_NONE]        = "none",
+    [TCP_CONNTRACK_SYN_SENT]    = "syn_sent",
+    [TCP_CONNTRACK_SYN_RECV]    = "syn_recv",
+    [TCP_CONNTRACK_ESTABLISHED] = "established",
+    [TCP_CONNTRACK_FIN_WAIT]    = "fin_wait",
+    [TCP_CONNTRACK_CLOSE_WAIT]  = "close_wait",
+    [TCP_CONNTRACK_LAST_ACK]    = "last_ack",
+    [TCP_CONNTRACK_TIME_WAIT]   = "time_wait",
+    [TCP_CONNTRACK_CLOSE]       = "close",
+    [TCP_CONNTRACK_SYN_SENT2]   = "syn_sent2",
+};
+
+/* Предварительное объявление локальных функций модуля */
+static int summary_open(struct inode *inode, struct file *file);
+static int summary_show(struct seq_file *s, void *v);
+static int count_open(struct inode *inode, struct file *file);
+static int count_show(struct seq_file *s, void *v);
+static int summary_walk(struct dpi_conntrack_file *f, struct summary *sum, bool full);
+static void summary_add(struct summary *sum, const struct nf_conn *ct, bool acct);
+static int estimate_open(struct inode *inode, struct file *file);
+static int estimate_show(struct seq_file *s, void *v);
+static int estimate_walk(struct dpi_conntrack_file *f, struct estimate *est);
+static int estimate_once(struct dpi_conntrack_file *f, struct estimate *est, struct summary *b);
+static void estimate_bucket(struct estimate *est, struct summary *b, struct dpi_conntrack_file *f,
+                            struct hlist_nulls_head *hash, unsigned int bucket, bool acct);
+static void estimate_print(struct seq_file *s, const struct estimate *est, const char *name, unsigned int n);
+static u64 estimate_scale(const struct estimate *est, u64 sum);
+static u64 estimate_bound(const struct estimate *est, unsigned int n);
+
+/* Набор операций для файла <name>.summary */
+const struct file_operations dpi_conntrack_summary_fops = {
+    .owner   = THIS_MODULE,
+    .open    = summary_open,
+    .read    = seq_read,
+    .llseek  = seq_lseek,
+    .release = single_release,
+};
+
+/* Набор операций для файла <name>.count */
+const struct file_operations dpi_conntrack_count_fops = {
+    .owner   = THIS_MODULE,
+    .open    = count_open,
+    .read    = seq_read,
+    .llseek  = seq_lseek,
+    .release = single_release,
+};
+
+/* Набор операций для файла <name>.estimate */
+const struct file_operations dpi_conntrack_estimate_fops = {
+    .owner   = THIS_MODULE,
+    .open    = estimate_open,
+    .read    = seq_read,
+    .llseek  = seq_lseek,
+    .release = single_release,
+};
+
+/**
+ * Открытие файла итогов
+ *
+ * @param inode
+ * @param file
+ * @return
+ */
+static int summary_open(struct inode *inode, struct file *file) {
+    return single_open(file, summary_show, PDE_DATA(inode));
+}
+
+/**
+ * Вывод итогов по conntrack "файла"
+ *
+ * @param s
+ * @param v
+ * @return
+ *
+ * Итоги вычисляются одним обходом (по индексу или таблице conntrack) при
+ * каждом чтении файла с начала.
+ */
+static int summary_show(struct seq_file *s, void *v) {
+    struct summary *sum;
+    unsigned int n;
+    int rv;
+
+    if(NULL == (sum = kzalloc(sizeof(*sum), GFP_KERNEL))) {
+        return -ENOMEM;
+    }
+
+    if(0 != (rv = summary_walk(s->private, sum, true))) {
+        kfree(sum);
+
+        return rv;
+    }
+
+    seq_printf(s, "conntracks %llu\n", sum->conntracks);
+    seq_printf(s, "ipv4 %llu\n", sum->ipv4);
+    seq_printf(s, "ipv6 %llu\n", sum->ipv6);
+    seq_printf(s, "tcp %llu\n", sum->tcp);
+    seq_printf(s, "udp %llu\n", sum->udp);
+    seq_printf(s, "icmp %llu\n", sum->icmp);
+    seq_printf(s, "other %llu\n", sum->other);
+
+    for(n = 0;n < TCP_CONNTRACK_MAX;n++) {
+        seq_printf(s, "tcp_%s %llu\n", summary_tcp_states[n], sum->tcp_state[n]);
+    }
+
+    seq_printf(s, "assured %llu\n", sum->assured);
+    seq_printf(s, "unreplied %llu\n", sum->unreplied);
+    seq_printf(s, "acct %llu\n", sum->acct);
+    seq_printf(s, "packets_original %llu\n", sum->packets[IP_CT_DIR_ORIGINAL]);
+    seq_printf(s, "bytes_original %llu\n", sum->bytes[IP_CT_DIR_ORIGINAL]);
+    seq_printf(s, "packets_reply %llu\n", sum->packets[IP_CT_DIR_REPLY]);
+    seq_printf(s, "bytes_reply %llu\n", sum->bytes[IP_CT_DIR_REPLY]);
+
+    kfree(sum);
+
+    return 0;
+}
+
+/**
+ * Открытие файла кол-ва conntrack
+ *
+ * @param inode
+ * @param file
+ * @return
+ */
+static int count_open(struct inode *inode, struct file *file) {
+    return single_open(file, count_show, PDE_DATA(inode));
+}
+
+/**
+ * Вывод кол-ва conntrack "файла"
+ *
+ * @param s
+ * @param v
+ * @return
+ *
+ * Для "файла" с индексом выводится счетчик индекса (без обхода). Для
+ * остальных - только подсчет: поля conntrack, кроме проверяемых фильтром, и
+ * расширения учета трафика не читаются.
+ */
+static int count_show(struct seq_file *s, void *v) {
+    struct dpi_conntrack_file *f = s->private;
+    struct summary sum;
+    int rv;
+
+    if(READ_ONCE(dpi_conntrack_pernet(f->net)->events) && f->match.indexed) {
+        seq_printf(s, "%d\n", atomic_read(&f->count));
+
+        return 0;
+    }
+
+    memset(&sum, 0, sizeof(sum));
+
+    if(0 != (rv = summary_walk(f, &sum, false))) {
+        return rv;
+    }
+
+    seq_printf(s, "%llu\n", sum.conntracks);
+
+    return 0;
+}
+
+/**
+ * Обход conntrack "файла" с накоплением итогов
+ *
+ * @param f
+ * @param sum
+ * @param full false - только подсчет conntrack
+ * @return
+ *
+ * Ссылки на conntrack не берутся: поля читаются в окружении rcu_read_lock,
+ * и для переиспользованного во время обхода nf_conn итоги могут учесть
+ * его новое содержимое (как и при любом обходе без блокировок).
+ *
+ * NB!
+ * Вызов может приостанавливать выполнение!
+ */
+static int summary_walk(struct dpi_conntrack_file *f, struct summary *sum, bool full) {
+    /* Счетчики трафика ведутся, только если учет включен в netns */
+    bool acct = full && nf_ct_acct_enabled(f->net);
+    struct dpi_conntrack_cursor *st;
+    struct dpi_iterator *i;
+
+    if(NULL == (st = kzalloc(sizeof(*st), GFP_KERNEL))) {
+        dpi_conntrack_stats_inc(dpi_conntrack_pernet(f->net)->stats, alloc_failed);
+
+        return -ENOMEM;
+    }
+
+    st->f = f;
+    /* "Файл" удерживается открытым читателем */
+    st->preemptible = true;
+
+    dpi_conntrack_iter_reserve(st);
+
+    rcu_read_lock();
+
+    for(i = dpi_conntrack_iter_start(st, 0);i;i = dpi_conntrack_iter_next(st, i)) {
+        struct nf_conn *ct = dpi_conntrack_iter_ct(i);
+
+        if(unlikely(nf_ct_is_dying(ct))) {
+            continue;
+        }
+
+        sum->conntracks++;
+
+        if(full) {
+            summary_add(sum, ct, acct);
+        }
+    }
+
+    dpi_conntrack_iter_stop(st, i);
+
+    rcu_read_unlock();
+
+    dpi_conntrack_iter_release(st);
+    kfree(st);
+
+    return 0;
+}
+
+/**
+ * Учет conntrack в итогах (кроме общего кол-ва)
+ *
+ * @param sum
+ * @param ct
+ * @param acct учитывать счетчики трафика
+ *
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+static void summary_add(struct summary *sum, const struct nf_conn *ct, bool acct) {
+    unsigned long status = READ_ONCE(ct->status);
+    u16 l3num = nf_ct_l3num(ct);
+    u8 protonum = nf_ct_protonum(ct);
+
+    if(NFPROTO_IPV4 == l3num) {
+        sum->ipv4++;
+    } else if(NFPROTO_IPV6 == l3num) {
+        sum->ipv6++;
+    }
+
+    if(IPPROTO_TCP == protonum) {
+        u8 state = READ_ONCE(ct->proto.tcp.state);
+
+        sum->tcp++;
+
+        if(state < TCP_CONNTRACK_MAX) {
+            sum->tcp_state[state]++;
+        }
+    } else if(IPPROTO_UDP == protonum) {
+        sum->udp++;
+    } else if((IPPROTO_ICMP == protonum) || (IPPROTO_ICMPV6 == protonum)) {
+        sum->icmp++;
+    } else {
+        sum->other++;
+    }
+
+    if(status & IPS_ASSURED) {
+        sum->assured++;
+    }
+
+    if(!(status & IPS_SEEN_REPLY)) {
+        sum->unreplied++;
+    }
+
+    if(acct) {
+        struct nf_conn_acct *a = nf_conn_acct_find(ct);
+
+        if(a) {
+            sum->acct++;
+
+            sum->packets[IP_CT_DIR_ORIGINAL] += atomic64_read(&a->counter[IP_CT_DIR_ORIGINAL].packets);
+            sum->bytes[IP_CT_DIR_ORIGINAL] += atomic64_read(&a->counter[IP_CT_DIR_ORIGINAL].bytes);
+            sum->packets[IP_CT_DIR_REPLY] += atomic64_read(&a->counter[IP_CT_DIR_REPLY].packets);
+            sum->bytes[IP_CT_DIR_REPLY] += atomic64_read(&a->counter[IP_CT_DIR_REPLY].bytes);
+        }
+    }
+}
+
+/**
+ * Открытие файла оценок
+ *
+ * @param inode
+ * @param file
+ * @return
+ */
+static int estimate_open(struct inode *inode, struct file *file) {
+    return single_open(file, estimate_show, PDE_DATA(inode));
+}
+
+/**
+ * Вывод оценок итогов по выборке bucket таблицы conntrack
+ *
+ * @param s
+ * @param v
+ * @return -EAGAIN, если размер таблицы менялся во время каждой из попыток
+ *
+ * Для счетчиков выводится оценка и граница ее ошибки (95%), для счетчиков
+ * трафика - только оценка (их распределение по conntrack слишком неравномерно,
+ * чтобы граница по выборке была содержательной). Доли протоколов и состояний -
+ * отношение их оценок к оценке conntracks.
+ */
+static int estimate_show(struct seq_file *s, void *v) {
+    struct estimate *est;
+    unsigned int n;
+    int rv;
+
+    if(NULL == (est = kzalloc(sizeof(*est), GFP_KERNEL))) {
+        return -ENOMEM;
+    }
+
+    if(0 != (rv = estimate_walk(s->private, est))) {
+        kfree(est);
+
+        return rv;
+    }
+
+    seq_printf(s, "buckets %u\n", est->buckets);
+    seq_printf(s, "sampled_buckets %u\n", est->sampled);
+
+    estimate_print(s, est, "conntracks", ESTIMATE_FIELD(conntracks));
+    estimate_print(s, est, "ipv4", ESTIMATE_FIELD(ipv4));
+    estimate_print(s, est, "ipv6", ESTIMATE_FIELD(ipv6));
+    estimate_print(s, est, "tcp", ESTIMATE_FIELD(tcp));
+    estimate_print(s, est, "udp", ESTIMATE_FIELD(udp));
+    estimate_print(s, est, "icmp", ESTIMATE_FIELD(icmp));
+    estimate_print(s, est, "other", ESTIMATE_FIELD(other));
+
+    for(n = 0;n < TCP_CONNTRACK_MAX;n++) {
+        seq_printf(s, "tcp_");
+
+        estimate_print(s, est, summary_tcp_states[n], ESTIMATE_FIELD(tcp_state) + n);
+    }
+
+    estimate_print(s, est, "assured", ESTIMATE_FIELD(assured));
+    estimate_print(s, est, "unreplied", ESTIMATE_FIELD(unreplied));
+    estimate_print(s, est, "acct", ESTIMATE_FIELD(acct));
+
+    seq_printf(s, "packets_original %llu\n", estimate_scale(est, est->sum.packets[IP_CT_DIR_ORIGINAL]));
+    seq_printf(s, "bytes_original %llu\n", estimate_scale(est, est->sum.bytes[IP_CT_DIR_ORIGINAL]));
+    seq_printf(s, "packets_reply %llu\n", estimate_scale(est, est->sum.packets[IP_CT_DIR_REPLY]));
+    seq_printf(s, "bytes_reply %llu\n", estimate_scale(est, est->sum.bytes[IP_CT_DIR_REPLY]));
+
+    kfree(est);
+
+    return 0;
+}
+
+/**
+ * Выборка bucket таблицы conntrack
+ *
+ * @param f
+ * @param est
+ * @return -EAGAIN, если размер таблицы менялся во время каждой из попыток
+ *
+ * NB!
+ * Вызов может приостанавливать выполнение!
+ */
+static int estimate_walk(struct dpi_conntrack_file *f, struct estimate *est) {
+    struct summary *b;
+    unsigned int n;
+    int rv = -EAGAIN;
+
+    if(NULL == (b = kmalloc(sizeof(*b), GFP_KERNEL))) {
+        dpi_conntrack_stats_inc(dpi_conntrack_pernet(f->net)->stats, alloc_failed);
+
+        return -ENOMEM;
+    }
+
+    for(n = 0;(n <= ESTIMATE_RETRIES) && (-EAGAIN == rv);n++) {
+        memset(est, 0, sizeof(*est));
+
+        rv = estimate_once(f, est, b);
+    }
+
+    kfree(b);
+
+    return rv;
+}
+
+/**
+ * Одна попытка выборки
+ *
+ * @param f
+ * @param est
+ * @param b итоги одного bucket
+ * @return -EAGAIN, если во время выборки изменился размер таблицы
+ *
+ * Просматривается каждый stride-й bucket (stride = 1000 / estimate_permille),
+ * начиная со случайного: hash распределяет conntrack по bucket равномерно,
+ * поэтому такая выборка не смещена, а ее стоимость пропорциональна доле.
+ * "Файл" удерживается открытым читателем, поэтому rcu_read_lock снимается
+ * через каждые ESTIMATE_BUCKETS_PER_LOCK bucket выборки.
+ *
+ * NB!
+ * Вызов может приостанавливать выполнение!
+ */
+static int estimate_once(struct dpi_conntrack_file *f, struct estimate *est, struct summary *b) {
+    struct dpi_conntrack_stats __percpu *stats = dpi_conntrack_pernet(f->net)->stats;
+    bool acct = nf_ct_acct_enabled(f->net);
+    unsigned int permille = clamp_t(unsigned int, READ_ONCE(estimate_permille), 1, 1000);
+    struct hlist_nulls_head *hash;
+    unsigned int generation;
+    unsigned int bucket;
+    unsigned int stride;
+    unsigned int size;
+
+    rcu_read_lock();
+
+    generation = dpi_conntrack_table_rcu(f->net, &hash, &size);
+
+    dpi_conntrack_filter_refresh_rcu(f, true);
+
+    rcu_read_unlock();
+
+    stride = clamp_t(unsigned int, 1000 / permille, 1, max(size / ESTIMATE_MIN_BUCKETS, 1U));
+
+    est->buckets = size;
+
+    dpi_conntrack_stats_inc(stats, dumps);
+
+    for(bucket = prandom_u32_max(stride);bucket < size;) {
+        unsigned int n;
+
+        rcu_read_lock();
+
+        if(dpi_conntrack_table_rcu(f->net, &hash, &size) != generation) {
+            rcu_read_unlock();
+
+            dpi_conntrack_stats_inc(stats, resyncs);
+
+            return -EAGAIN;
+        }
+
+        for(n = 0;(n < ESTIMATE_BUCKETS_PER_LOCK) && (bucket < size);n++, bucket += stride) {
+            estimate_bucket(est, b, f, hash, bucket, acct);
+        }
+
+        rcu_read_unlock();
+
+        dpi_conntrack_stats_add(stats, buckets, n);
+
+        cond_resched();
+    }
+
+    return 0;
+}
+
+/**
+ * Учет bucket в выборке
+ *
+ * @param est
+ * @param b
+ * @param f
+ * @param hash
+ * @param bucket
+ * @param acct
+ *
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+static void estimate_bucket(struct estimate *est, struct summary *b, struct dpi_conntrack_file *f,
+                            struct hlist_nulls_head *hash, unsigned int bucket, bool acct) {
+    struct nf_conntrack_tuple_hash *h;
+    struct hlist_nulls_node *n;
+    const u64 *v = (const u64 *)b;
+    u64 *sum = (u64 *)&est->sum;
+    unsigned int k;
+
+restart:
+    memset(b, 0, sizeof(*b));
+
+    hlist_nulls_for_each_entry_rcu(h, n, &hash[bucket], hnnode) {
+        struct nf_conn *ct;
+
+        /* Каждый conntrack учитываем только по кортежу исходного направления */
+        if(NF_CT_DIRECTION(h) != IP_CT_DIR_ORIGINAL) {
+            continue;
+        }
+
+        ct = nf_ct_tuplehash_to_ctrack(h);
+
+        if(unlikely(nf_ct_is_dying(ct)) || !dpi_conntrack_filter_match_rcu(f, ct)) {
+            continue;
+        }
+
+        b->conntracks++;
+
+        summary_add(b, ct, acct);
+    }
+
+    if(get_nulls_value(n) != bucket) {
+        /* conntrack перенесен в другую цепочку, учитываем bucket заново */
+        goto restart;
+    }
+
+    for(k = 0;k < sizeof(*b) / sizeof(u64);k++) {
+        sum[k] += v[k];
+    }
+
+    for(k = 0;k < ESTIMATE_COUNTERS;k++) {
+        est->sumsq[k] += v[k] * v[k];
+    }
+
+    est->sampled++;
+}
+
+/**
+ * Вывод оценки счетчика и границы ее ошибки
+ *
+ * @param s
+ * @param est
+ * @param name
+ * @param n номер счетчика (ESTIMATE_FIELD)
+ */
+static void estimate_print(struct seq_file *s, const struct estimate *est, const char *name, unsigned int n) {
+    const u64 *sum = (const u64 *)&est->sum;
+
+    seq_printf(s, "%s %llu %llu\n", name, estimate_scale(est, sum[n]), estimate_bound(est, n));
+}
+
+/**
+ * Оценка суммы по всей таблице: sum * buckets / sampled
+ *
+ * @param est
+ * @param sum сумма по выборке
+ * @return
+ */
+static u64 estimate_scale(const struct estimate *est, u64 sum) {
+    u32 rem;
+    u64 q;
+
+    if(0 == est->sampled) {
+        return 0;
+    }
+
+    q = div_u64_rem(sum, est->sampled, &rem);
+
+    return q * est->buckets + div_u64((u64)rem * est->buckets, est->sampled);
+}
+
+/**
+ * Граница ошибки оценки счетчика (95%, 1.96 стандартного отклонения)
+ *
+ * @param est
+ * @param n номер счетчика
+ * @return 0 при полном просмотре таблицы
+ *
+ * Дисперсия оценки суммы по выборке m bucket из N без возвращения:
+ * N (N - m) s^2 / m, где s^2 - выборочная дисперсия значений bucket.
+ * s^2 вычисляется с 8 двоичными знаками после запятой (стандартное
+ * отклонение - с 4), корни извлекаются из множителей по отдельности,
+ * чтобы произведение не переполнялось.
+ */
+static u64 estimate_bound(const struct estimate *est, unsigned int n) {
+    const u64 *sum = (const u64 *)&est->sum;
+    u64 m = est->sampled;
+    u64 N = est->buckets;
+    u64 s2;
+    u64 a;
+
+    if((m < 2) || (m >= N)) {
+        return 0;
+    }
+
+    s2 = div64_u64((m * est->sumsq[n] - sum[n] * sum[n]) << 8, m * (m - 1));
+    a = div64_u64(N * (N - m), m);
+
+    return (u64)int_sqrt(a) * int_sqrt(s2) * 196 / (100 << 4);
+}
@@ -0,0 +1,330 @@
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/sort.h>
+#include <linux/ktime.h>
+
+#include <net/netfilter/nf_conntrack.h>
+#include <net/netfilter/nf_conntrack_acct.h>
+#include <net/netfilter/nf_conntrack_timestamp.h>
+
+#include "dpi_conntrack_ko.h"
+
+/* Предварительное объявление локальных функций модуля */
+static int top_walk(struct dpi_conntrack_top *top, struct dpi_conntrack_net *pernet, const char *name);
+static void top_add(struct dpi_conntrack_top *top, struct dpi_conntrack_file *f, struct nf_conn *ct,
+                    const struct nf_conntrack_tuple *tuple, u64 now);
+static bool top_value(const struct dpi_conntrack_top *top, const struct nf_conn *ct, u64 now, u64 *value);
+static void top_sift_down(struct dpi_conntrack_top *top, u32 n);
+static void top_sift_up(struct dpi_conntrack_top *top, u32 n);
+static void top_swap(void *a, void *b, int size);
+static int top_cmp(const void *a, const void *b);
+
+/**
+ * Поиск N наибольших conntrack "файла"
+ *
+ * @param net
+ * @param name имя "файла"
+ * @param key DPI_CONNTRACK_TOP_*
+ * @param n кол-во conntrack (1..DPI_CONNTRACK_TOP_MAX)
+ * @return ERR_PTR при ошибке
+ *
+ * Обходом "файла" поддерживается куча из n лучших conntrack (вершина -
+ * наименьший из них), поэтому память не зависит от размера таблицы, а запись
+ * заполняется только для conntrack, попадающего в кучу. Результат упорядочен
+ * по убыванию значения.
+ *
+ * NB!
+ * Вызов может приостанавливать выполнение!
+ */
+struct dpi_conntrack_top *dpi_conntrack_top_run(struct net *net, const char *name, u32 key, u32 n) {
+    struct dpi_conntrack_net *pernet = dpi_conntrack_pernet(net);
+    struct dpi_conntrack_top *top;
+    int rv;
+
+    if((0 == n) || (n > DPI_CONNTRACK_TOP_MAX)) {
+        return ERR_PTR(-EINVAL);
+    }
+
+    if((DPI_CONNTRACK_TOP_BYTES == key) || (DPI_CONNTRACK_TOP_PACKETS == key)) {
+        if(!nf_ct_acct_enabled(net)) {
+            /* Счетчики трафика не ведутся */
+            return ERR_PTR(-EOPNOTSUPP);
+        }
+    } else if(DPI_CONNTRACK_TOP_AGE == key) {
+        if(!nf_ct_tstamp_enabled(net)) {
+            /* Время создания conntrack не сохраняется */
+            return ERR_PTR(-EOPNOTSUPP);
+        }
+    } else {
+        return ERR_PTR(-EINVAL);
+    }
+
+    if(NULL == (top = vzalloc(sizeof(struct dpi_conntrack_top) + n * sizeof(struct dpi_conntrack_top_entry)))) {
+        dpi_conntrack_stats_inc(pernet->stats, alloc_failed);
+
+        return ERR_PTR(-ENOMEM);
+    }
+
+    top->key = key;
+    top->max = n;
+
+    if(0 != (rv = top_walk(top, pernet, name))) {
+        vfree(top);
+
+        return ERR_PTR(rv);
+    }
+
+    /* Куча -> убывание значения */
+    sort(top->entries, top->nr, sizeof(struct dpi_conntrack_top_entry), top_cmp, top_swap);
+
+    return top;
+}
+
+/**
+ * Освобождение результата dpi_conntrack_top_run()
+ *
+ * @param top
+ */
+void dpi_conntrack_top_free(struct dpi_conntrack_top *top) {
+    vfree(top);
+}
+
+/**
+ * Обход "файла" с заполнением кучи
+ *
+ * @param top
+ * @param pernet
+ * @param name
+ * @return -ENOENT, если "файл" не найден или снят с регистрации во время обхода
+ *
+ * Ссылка на "файл" не удерживается, поэтому обход выполняется участками
+ * (!preemptible): между ними rcu_read_lock снимается, а "файл" ищется заново.
+ *
+ * NB!
+ * Вызов может приостанавливать выполнение!
+ */
+static int top_walk(struct dpi_conntrack_top *top, struct dpi_conntrack_net *pernet, const char *name) {
+    struct dpi_conntrack_cursor *st;
+    int rv = 0;
+
+    if(NULL == (st = kzalloc(sizeof(*st), GFP_KERNEL))) {
+        dpi_conntrack_stats_inc(pernet->stats, alloc_failed);
+
+        return -ENOMEM;
+    }
+
+    do {
+        struct dpi_conntrack_file *f;
+        struct dpi_iterator *i;
+        /* Возраст отсчитывается от начала участка */
+        u64 now = ktime_get_real_ns();
+
+        dpi_conntrack_iter_reserve(st);
+
+        rcu_read_lock();
+
+        f = dpi_conntrack_file_find_rcu(pernet, name);
+
+        if((NULL == f) || (st->f && (f->gen != st->gen))) {
+            rcu_read_unlock();
+
+            rv = -ENOENT;
+
+            break;
+        }
+
+        st->f = f;
+        st->gen = f->gen;
+
+        for(i = dpi_conntrack_iter_start(st, st->pos);i;i = dpi_conntrack_iter_next(st, i)) {
+            top_add(top, f, dpi_conntrack_iter_ct(i), dpi_conntrack_iter_tuple(i), now);
+        }
+
+        dpi_conntrack_iter_stop(st, i);
+
+        rcu_read_unlock();
+
+        cond_resched();
+    } while(st->yield);
+
+    dpi_conntrack_iter_release(st);
+    kfree(st);
+
+    return rv;
+}
+
+/**
+ * Учет conntrack в куче
+ *
+ * @param top
+ * @param f
+ * @param ct
+ * @param tuple кортеж, по которому conntrack найден обходом
+ * @param now
+ *
+ * Значение вычисляется без ссылки на conntrack; запись (с повторной проверкой
+ * фильтра) заполняется, только если значение больше вершины заполненной кучи.
+ *
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+static void top_add(struct dpi_conntrack_top *top, struct dpi_conntrack_file *f, struct nf_conn *ct,
+                    const struct nf_conntrack_tuple *tuple, u64 now) {
+    struct dpi_conntrack_top_entry *e;
+    u64 value;
+
+    if(!top_value(top, ct, now, &value)) {
+        return;
+    }
+
+    if(top->nr < top->max) {
+        e = &top->entries[top->nr];
+
+        if(0 == dpi_conntrack_record_fill(&e->record, ct, tuple, f)) {
+            e->value = value;
+
+            top_sift_up(top, top->nr++);
+        }
+    } else if(value > top->entries[0].value) {
+        e = &top->entries[0];
+
+        /* Вытесняем наименьший (при ошибке запись не изменяется) */
+        if(0 == dpi_conntrack_record_fill(&e->record, ct, tuple, f)) {
+            e->value = value;
+
+            top_sift_down(top, 0);
+        }
+    }
+}
+
+/**
+ * Значение, по которому упорядочиваются conntrack
+ *
+ * @param top
+ * @param ct
+ * @param now
+ * @param value
+ * @return false, если у conntrack нет нужного расширения
+ *
+ * NB!
+ * Данный вызов всегда должен выполняться в окружении
+ * rcu_read_lock();
+ * rcu_read_unlock();
+ */
+static bool top_value(const struct dpi_conntrack_top *top, const struct nf_conn *ct, u64 now, u64 *value) {
+    if(DPI_CONNTRACK_TOP_AGE == top->key) {
+        struct nf_conn_tstamp *tstamp = nf_conn_tstamp_find(ct);
+        u64 start;
+
+        if((NULL == tstamp) || (0 == (start = READ_ONCE(tstamp->start)))) {
+            return false;
+        }
+
+        *value = (now > start) ? (now - start) : 0;
+    } else {
+        struct nf_conn_acct *acct = nf_conn_acct_find(ct);
+
+        if(NULL == acct) {
+            return false;
+        }
+
+        if(DPI_CONNTRACK_TOP_BYTES == top->key) {
+            *value = atomic64_read(&acct->counter[IP_CT_DIR_ORIGINAL].bytes) +
+                     atomic64_read(&acct->counter[IP_CT_DIR_REPLY].bytes);
+        } else {
+            *value = atomic64_read(&acct->counter[IP_CT_DIR_ORIGINAL].packets) +
+                     atomic64_read(&acct->counter[IP_CT_DIR_REPLY].packets);
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Восстановление кучи вниз от элемента n
+ *
+ * @param top
+ * @param n
+ */
+static void top_sift_down(struct dpi_conntrack_top *top, u32 n) {
+    struct dpi_conntrack_top_entry *e = top->entries;
+
+    for(;;) {
+        u32 min = n;
+        u32 l = 2 * n + 1;
+        u32 r = l + 1;
+
+        if((l < top->nr) && (e[l].value < e[min].value)) {
+            min = l;
+        }
+
+        if((r < top->nr) && (e[r].value < e[min].value)) {
+            min = r;
+        }
+
+        if(min == n) {
+            break;
+        }
+
+        top_swap(&e[n], &e[min], sizeof(*e));
+
+        n = min;
+    }
+}
+
+/**
+ * Восстановление кучи вверх от элемента n
+ *
+ * @param top
+ * @param n
+ */
+static void top_sift_up(struct dpi_conntrack_top *top, u32 n) {
+    struct dpi_conntrack_top_entry *e = top->entries;
+
+    while(n) {
+        u32 parent = (n - 1) / 2;
+
+        if(e[parent].value <= e[n].value) {
+            break;
+        }
+
+        top_swap(&e[n], &e[parent], sizeof(*e));
+
+        n = parent;
+    }
+}
+
+/**
+ * Обмен элементов кучи
+ *
+ * @param a
+ * @param b
+ * @param size
+ */
+static void top_swap(void *a, void *b, int size) {
+    struct dpi_conntrack_top_entry t;
+
+    memcpy(&t, a, sizeof(t));
+    memcpy(a, b, sizeof(t));
+    memcpy(b, &t, sizeof(t));
+}
+
+/**
+ * Сравнение для сортировки результата по убыванию значения
+ *
+ * @param a
+ * @param b
+ * @return
+ */
+static int top_cmp(const void *a, const void *b) {
+    const struct dpi_conntrack_top_entry *ea = a;
+    const struct dpi_conntrack_top_entry *eb = b;
+
+    if(ea->value == eb->value) {
+        return 0;
+    }
+
+    return (ea->value > eb->value) ? -1 : 1;
+}
@@ -0,0 +1,122 @@
+/*
+ * File:   trace.h
+ *
+ * Точки трассировки модуля (ftrace/perf: события dpi_conntrack:*).
+ *
+ * Пока трассировка не включена, каждая точка обходится одной инструкцией
+ * nop (static key), поэтому их можно вызывать в цикле обхода таблицы.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM dpi_conntrack
+
+#if !defined(DPI_CONNTRACK_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define DPI_CONNTRACK_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* Начало (или продолжение с сохраненного места) обхода "файла" */
+TRACE_EVENT(dpi_conntrack_scan_start,
+    TP_PROTO(const char *name, loff_t pos, bool indexed, bool resumed),
+    TP_ARGS(name, pos, indexed, resumed),
+    TP_STRUCT__entry(
+        __string(name, name)
+        __field(loff_t, pos)
+        __field(bool, indexed)
+        __field(bool, resumed)
+    ),
+    TP_fast_assign(
+        __assign_str(name, name);
+        __entry->pos = pos;
+        __entry->indexed = indexed;
+        __entry->resumed = resumed;
+    ),
+    TP_printk("name=%s pos=%lld indexed=%d resumed=%d",
+              __get_str(name), __entry->pos, __entry->indexed, __entry->resumed)
+);
+
+/* Остановка обхода (конец порции seq_file/netlink или конец таблицы) */
+TRACE_EVENT(dpi_conntrack_scan_stop,
+    TP_PROTO(const char *name, loff_t pos, bool eof),
+    TP_ARGS(name, pos, eof),
+    TP_STRUCT__entry(
+        __string(name, name)
+        __field(loff_t, pos)
+        __field(bool, eof)
+    ),
+    TP_fast_assign(
+        __assign_str(name, name);
+        __entry->pos = pos;
+        __entry->eof = eof;
+    ),
+    TP_printk("name=%s pos=%lld eof=%d", __get_str(name), __entry->pos, __entry->eof)
+);
+
+/* Переход обхода таблицы conntrack к очередному bucket */
+TRACE_EVENT(dpi_conntrack_scan_bucket,
+    TP_PROTO(unsigned int bucket, unsigned int htable_size),
+    TP_ARGS(bucket, htable_size),
+    TP_STRUCT__entry(
+        __field(unsigned int, bucket)
+        __field(unsigned int, htable_size)
+    ),
+    TP_fast_assign(
+        __entry->bucket = bucket;
+        __entry->htable_size = htable_size;
+    ),
+    TP_printk("bucket=%u/%u", __entry->bucket, __entry->htable_size)
+);
+
+/* Найден подходящий "файлу" conntrack */
+TRACE_EVENT(dpi_conntrack_scan_match,
+    TP_PROTO(const char *name, const struct nf_conn *ct, loff_t pos),
+    TP_ARGS(name, ct, pos),
+    TP_STRUCT__entry(
+        __string(name, name)
+        __field(const void *, ct)
+        __field(loff_t, pos)
+    ),
+    TP_fast_assign(
+        __assign_str(name, name);
+        __entry->ct = ct;
+        __entry->pos = pos;
+    ),
+    TP_printk("name=%s ct=%p pos=%lld", __get_str(name), __entry->ct, __entry->pos)
+);
+
+/* Регистрация "файла" (rv - результат dpi_conntrack_register_file) */
+TRACE_EVENT(dpi_conntrack_register,
+    TP_PROTO(const char *name, int rv),
+    TP_ARGS(name, rv),
+    TP_STRUCT__entry(
+        __string(name, name)
+        __field(int, rv)
+    ),
+    TP_fast_assign(
+        __assign_str(name, name);
+        __entry->rv = rv;
+    ),
+    TP_printk("name=%s rv=%d", __get_str(name), __entry->rv)
+);
+
+/* Снятие "файла" с регистрации */
+TRACE_EVENT(dpi_conntrack_unregister,
+    TP_PROTO(const char *name),
+    TP_ARGS(name),
+    TP_STRUCT__entry(
+        __string(name, name)
+    ),
+    TP_fast_assign(
+        __assign_str(name, name);
+    ),
+    TP_printk("name=%s", __get_str(name))
+);
+
+#endif /* DPI_CONNTRACK_TRACE_H */
+
+/* Заголовок находится вне include/trace/events ядра */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace
+#include <trace/define_trace.h>